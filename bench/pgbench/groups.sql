@@ -0,0 +1,3 @@
+SELECT count(m) FROM (
+  SELECT grp, median(:col) AS m FROM median_bench.:tab GROUP BY grp
+) AS G;
@@ -0,0 +1,4 @@
+SELECT count(m) FROM (
+  SELECT grp, percentile_disc(0.5) WITHIN GROUP (ORDER BY :col) AS m
+  FROM median_bench.:tab GROUP BY grp
+) AS G;
@@ -0,0 +1 @@
+SELECT median_os() WITHIN GROUP (ORDER BY :col) FROM median_bench.:tab;
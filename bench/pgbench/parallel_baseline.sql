@@ -0,0 +1,4 @@
+SET max_parallel_workers_per_gather = 4;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SELECT percentile_disc(0.5) WITHIN GROUP (ORDER BY :col) FROM median_bench.:tab;
@@ -0,0 +1 @@
+SELECT median(:col) FROM median_bench.:tab;
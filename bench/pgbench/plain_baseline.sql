@@ -0,0 +1 @@
+SELECT percentile_disc(0.5) WITHIN GROUP (ORDER BY :col) FROM median_bench.:tab;
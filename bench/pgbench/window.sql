@@ -0,0 +1,4 @@
+SELECT count(m) FROM (
+  SELECT median(:col) OVER (ORDER BY id ROWS BETWEEN 1000 PRECEDING AND CURRENT ROW) AS m
+  FROM median_bench.:tab
+) AS W;
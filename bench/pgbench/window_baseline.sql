@@ -0,0 +1,6 @@
+SELECT count(m) FROM (
+  SELECT (SELECT percentile_disc(0.5) WITHIN GROUP (ORDER BY x.:col)
+          FROM median_bench.:tab AS x
+          WHERE x.id BETWEEN w.id - 1000 AND w.id) AS m
+  FROM median_bench.:tab AS w
+) AS W;
@@ -0,0 +1,16 @@
+#!/bin/sh
+#
+# Reports the results of run.sh (results.csv, or $1): the latencies of
+# median and of percentile_disc(0.5), and how many times faster median is.
+
+awk -F, '
+NR == 1 {
+	printf "%10s %-12s %-6s %-9s %12s %12s %8s\n",
+		"rows", "dist", "class", "mode", "median ms", "baseline ms", "speedup"
+	next
+}
+{
+	speedup = ($5 > 0 && $6 != "") ? sprintf("%.2fx", $6 / $5) : "-"
+	printf "%10s %-12s %-6s %-9s %12s %12s %8s\n",
+		$1, $2, $3, $4, $5, ($6 == "") ? "-" : $6, speedup
+}' "${1:-results.csv}"
@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# Benchmarks median against percentile_disc(0.5), with pgbench, on the
+# server of the usual libpq environment (PGHOST, PGDATABASE, ...), which
+# needs the extension installed. The tables are made in (and left in) the
+# schema median_bench, and are only made again if missing.
+#
+# The benchmarks are the products of the (space separated) lists:
+#   BENCH_ROWS     row counts (1000 100000 1000000), up to 100000000
+#   BENCH_DISTS    distributions (sorted reverse random dups adversarial)
+#   BENCH_CLASSES  columns of value classes (i2 i4 i8 ts t_c t_icu)
+#   BENCH_MODES    queries, of bench/pgbench (plain window parallel groups
+#                  ordered), where ordered is median_os, sorted by the executor
+# each run BENCH_RUNS (3) times. The window baseline, a subquery per row,
+# is only run for up to BENCH_WINDOW_BASELINE_MAX (100000) rows. The
+# average latencies are written to BENCH_OUT (results.csv), and reported
+# by report.sh.
+
+set -e
+cd "$(dirname "$0")"
+
+rows=${BENCH_ROWS:-"1000 100000 1000000"}
+dists=${BENCH_DISTS:-"sorted reverse random dups adversarial"}
+classes=${BENCH_CLASSES:-"i2 i4 i8 ts t_c t_icu"}
+modes=${BENCH_MODES:-"plain window parallel groups ordered"}
+runs=${BENCH_RUNS:-3}
+window_baseline_max=${BENCH_WINDOW_BASELINE_MAX:-100000}
+out=${BENCH_OUT:-results.csv}
+
+psql="psql -X -q -v ON_ERROR_STOP=1"
+
+# Average latency (ms) of the pgbench script $1 on the table $2, column $3
+latency()
+{
+	pgbench -n -t "$runs" -f "pgbench/$1.sql" -D tab="$2" -D col="$3" |
+		sed -n 's/^latency average = \([0-9.]*\) ms$/\1/p'
+}
+
+$psql -c "CREATE EXTENSION IF NOT EXISTS median"
+icu=$($psql -At -c "SELECT collname FROM pg_collation WHERE collname = 'und-x-icu'")
+if [ -z "$icu" ]; then
+	echo "no ICU collations, t_icu is of collation \"C\"" >&2
+	icu=C
+fi
+
+echo "rows,dist,class,mode,median_ms,baseline_ms" > "$out"
+for n in $rows; do
+	for dist in $dists; do
+		tab="${dist}_$n"
+		exists=$($psql -At -c "SELECT to_regclass('median_bench.$tab') IS NOT NULL")
+		if [ "$exists" != t ]; then
+			echo "making $tab" >&2
+			$psql -v tab="$tab" -v dist="$dist" -v rows="$n" -v icu="$icu" -f setup.sql
+		fi
+		for class in $classes; do
+			for mode in $modes; do
+				echo "$tab $class $mode" >&2
+				m=$(latency "$mode" "$tab" "$class")
+				if [ "$mode" = window ] && [ "$n" -gt "$window_baseline_max" ]; then
+					b=
+				else
+					b=$(latency "${mode}_baseline" "$tab" "$class")
+				fi
+				echo "$n,$dist,$class,$mode,$m,$b" >> "$out"
+			done
+		done
+	done
+done
+
+./report.sh "$out"
@@ -0,0 +1,39 @@
+-- The table :tab of the benchmarks of bench/run.sh, of :rows rows of
+-- the distribution :dist, in the schema median_bench. It has a column of
+-- each class of values, all from the same integer `v`, and a group of 10
+-- rows, `grp`, for the GROUP BY benchmarks. :icu is the ICU collation of
+-- `t_icu` ("C", if the server has no ICU).
+
+CREATE SCHEMA IF NOT EXISTS median_bench;
+
+DROP TABLE IF EXISTS median_bench.:"tab";
+CREATE UNLOGGED TABLE median_bench.:"tab" AS
+SELECT id,
+       id / 10 AS grp,
+       (v % 32767)::int2 AS i2,
+       v::int4 AS i4,
+       v::int8 * 1000003 AS i8,
+       timestamptz '2000-01-01' + v * interval '1 second' AS ts,
+       lpad(v::text, 12, '0') COLLATE "C" AS t_c,
+       lpad(v::text, 12, '0') COLLATE :"icu" AS t_icu
+FROM (
+  SELECT id,
+         CASE :'dist'
+           WHEN 'sorted' THEN id
+           WHEN 'reverse' THEN :rows - id
+           WHEN 'random' THEN (random() * :rows)::int8
+           WHEN 'dups' THEN (random() * 10)::int8
+           -- Musser's median-of-3 killer sequence, for quickselect
+           WHEN 'adversarial' THEN
+             CASE
+               WHEN id <= :rows / 2 THEN
+                 CASE WHEN id % 2 = 1 THEN id ELSE :rows / 2 + id - 1 END
+               ELSE 2 * (id - :rows / 2)
+             END
+         END AS v
+  FROM generate_series(1, :rows) AS T(id)
+) AS S;
+
+CREATE INDEX ON median_bench.:"tab" (id);
+ALTER TABLE median_bench.:"tab" SET (parallel_workers = 4);
+VACUUM ANALYZE median_bench.:"tab";
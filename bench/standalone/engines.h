@@ -0,0 +1,212 @@
+/* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
+/*
+ * engines.h
+ *
+ * The state engines of median_engine.c, driven directly, outside
+ * PostgreSQL and its executor, for the standalone benchmark and fuzzer,
+ * linked with the runtime of shim.c instead of the server's.
+ *
+ * Only the by-value classes are driven: integers (`int8` and `int4`) and
+ * `float8`. Text and generic values need the catalog and collations,
+ * which is why their engines are in median.c.
+ */
+#ifndef MEDIAN_ENGINES_H
+#define MEDIAN_ENGINES_H
+
+#include <postgres.h>
+#include <miscadmin.h>
+#include <catalog/pg_type.h>
+#include <libpq/pqformat.h>
+#include <utils/memutils.h>
+
+#include "../../median_engine.h"
+#include "../../median_simd.h"
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+extern void shim_init(void);
+
+/* the runtime (and its printing) is the C library's, not libpgport's */
+#undef printf
+#undef fprintf
+#undef snprintf
+
+/** The type info of a by-value type, as `median_type_info` makes it */
+static struct MedianTypeInfo *
+engine_type_info(Oid typid)
+{
+	struct MedianTypeInfo *ti = MemoryContextAllocZero(TopMemoryContext, sizeof *ti);
+
+	ti->typid = typid;
+	ti->typbyval = true;
+	switch (typid)
+	{
+		case INT4OID:
+			ti->typlen = 4;
+			ti->typalign = TYPALIGN_INT;
+			ti->valclass = vcNumeral;
+			ti->ops = &median_numeral_ops;
+			ti->shift = 64 - 8 * ti->typlen;
+			break;
+		case INT8OID:
+			ti->typlen = 8;
+			ti->typalign = TYPALIGN_DOUBLE;
+			ti->valclass = vcNumeral;
+			ti->ops = &median_numeral_ops;
+			ti->shift = 0;
+			break;
+		case FLOAT8OID:
+			ti->typlen = 8;
+			ti->typalign = TYPALIGN_DOUBLE;
+			ti->valclass = vcFloat;
+			ti->ops = &median_float_ops;
+			break;
+		default:
+			elog(ERROR, "type oid=%u is not driven outside PostgreSQL", typid);
+			return NULL;
+	}
+	return ti;
+}
+
+/**
+ * A new state of the `engine`, in a memory context of its own, which
+ * `engine_free` deletes. A `meCounts` state is made empty, as the
+ * probe of an unsorted buffer or a flat array would make it.
+ */
+static struct MedianState *
+engine_create(struct MedianTypeInfo *ti, enum MedianEngine engine)
+{
+	MemoryContext ctx = AllocSetContextCreate(TopMemoryContext, "median engine",
+											  ALLOCSET_DEFAULT_SIZES);
+
+	return create_MedianState(ctx, ti, engine);
+}
+
+static void
+engine_free(struct MedianState *pms)
+{
+	median_spill_shutdown(PointerGetDatum(pms));
+	MemoryContextDelete(pms->ctx);
+}
+
+static inline struct MedianState *
+engine_add(struct MedianState *pms, Datum d)
+{
+	return pms->add(pms, d);
+}
+
+/** Adds the `n` values at `d`, in a batch, if the engine has one */
+static inline struct MedianState *
+engine_add_batch(struct MedianState *pms, Datum const *d, size_t n)
+{
+	MedianAddBatchFn add_batch = pms->ti->ops->add_batch[pms->engine];
+	size_t		i;
+
+	if (NULL != add_batch)
+	{
+		add_batch(pms, d, n);
+		return pms;
+	}
+	for (i = 0; i < n; ++i)
+	{
+		pms = pms->add(pms, d[i]);
+	}
+	return pms;
+}
+
+static inline bool
+engine_remove(struct MedianState *pms, Datum d)
+{
+	return pms->ti->ops->remove[pms->engine] (pms, d);
+}
+
+/** Number of values of the state, in memory or spilled */
+static inline size_t
+engine_count(struct MedianState *pms)
+{
+	return state_count(pms);
+}
+
+/** The value at `rank`, which, for an unsorted buffer, reorders it */
+static inline Datum
+engine_rank(struct MedianState *pms, size_t rank)
+{
+	return pms->ti->ops->rank(pms, rank);
+}
+
+static inline void
+engine_combine(struct MedianState *pms, struct MedianState *other)
+{
+	pms->ti->ops->combine(pms, other);
+}
+
+/**
+ * A copy of the state, by serializing and deserializing it, as
+ * `median_serialfn` and `median_deserialfn` do (without their header).
+ */
+static inline struct MedianState *
+engine_roundtrip(struct MedianState *pms)
+{
+	struct MedianState *copy;
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+	pms->ti->ops->serialize(pms, &buf);
+	copy = engine_create(pms->ti, pms->engine);
+	pms->ti->ops->deserialize(copy, &buf, engine_count(pms));
+	pq_getmsgend(&buf);
+	pfree(buf.data);
+
+	return copy;
+}
+
+/** Wall clock, in nanoseconds */
+static inline uint64
+clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** The cycle counter, where there is one, else the wall clock */
+static inline uint64
+clock_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64		t;
+
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+	return t;
+#else
+	return clock_ns();
+#endif
+}
+
+/** Next of the pseudo-random sequence of `seed` (splitmix64) */
+static inline uint64
+engine_random(uint64 *seed)
+{
+	uint64		z = (*seed += UINT64CONST(0x9E3779B97F4A7C15));
+
+	z = (z ^ (z >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+	z = (z ^ (z >> 27)) * UINT64CONST(0x94D049BB133111EB);
+	return z ^ (z >> 31);
+}
+
+/** Sets up the runtime and the kernels, as loading the module does. The
+    settings are at their defaults. */
+static void
+engine_init(void)
+{
+	shim_init();
+	median_simd_init();
+}
+
+#endif							/* MEDIAN_ENGINES_H */
@@ -0,0 +1,390 @@
+/* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
+/*
+ * fuzz.c
+ *
+ * Differential fuzzer of the state engines (see engines.h): random values
+ * are added to (and, for windows, removed from) states of every engine,
+ * and the elements they give at random ranks checked against a sorted
+ * copy of the values. Aggregates are also split into partial states,
+ * which are serialized and combined, as by parallel workers. Windows
+ * whose frame only grows have their median found on every row.
+ *
+ *   median_fuzz [iterations [seed]]
+ *
+ * The first failure is reported with the seed of its iteration, and
+ * exits 1 (with `median_fuzz 1 <seed>` reproducing it).
+ */
+#include "engines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static Oid const fuzz_types[] = {INT4OID, INT8OID, FLOAT8OID};
+
+/** The `Datum` of type `typid` for the (reference) value `v` */
+static Datum
+fuzz_datum(Oid typid, int64 v)
+{
+	switch (typid)
+	{
+		case INT4OID:
+			return Int32GetDatum((int32) v);
+		case INT8OID:
+			return Int64GetDatum(v);
+		default:
+			/* exact, and in the same order */
+			return Float8GetDatum((float8) v / 4);
+	}
+}
+
+static int64
+fuzz_value(Oid typid, Datum d)
+{
+	switch (typid)
+	{
+		case INT4OID:
+			return DatumGetInt32(d);
+		case INT8OID:
+			return DatumGetInt64(d);
+		default:
+			return (int64) (DatumGetFloat8(d) * 4);
+	}
+}
+
+/** A random value, of a random range, some with few distinct values */
+static int64
+fuzz_random_value(uint64 *seed, int64 range)
+{
+	return (int64) (engine_random(seed) % (uint64) (2 * range + 1)) - range;
+}
+
+static int64
+fuzz_random_range(uint64 *seed, Oid typid)
+{
+	switch (engine_random(seed) % ((typid == INT4OID) ? 4 : 5))
+	{
+		case 0:
+			return 2;
+		case 1:
+			return 100;
+		case 2:
+			return 100000;
+		case 3:
+			return PG_INT32_MAX / 2;
+		default:
+			return (int64) 1 << 40;
+	}
+}
+
+static int
+int64_cmp(const void *a, const void *b)
+{
+	int64		x = *(const int64 *) a;
+	int64		y = *(const int64 *) b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64 fuzz_seed;
+
+static void
+fuzz_fail(const char *what, size_t n, size_t rank, int64 got, int64 expected)
+{
+	fprintf(stderr, "FAIL seed %llu: %s, of %zu values, rank %zu: got %lld, expected %lld\n",
+			(unsigned long long) fuzz_seed, what, n, rank, (long long) got, (long long) expected);
+	exit(1);
+}
+
+/** Checks the middle, and 3 random ranks, of the state against the sorted `ref` */
+static void
+fuzz_check(struct MedianState *pms, Oid typid, int64 const *ref, size_t n, bool approx,
+		   uint64 *seed, const char *what)
+{
+	int			i;
+
+	if (engine_count(pms) != n)
+	{
+		fuzz_fail(what, n, 0, (int64) engine_count(pms), (int64) n);
+	}
+	for (i = 0; (n > 0) && (i < 4); ++i)
+	{
+		size_t		rank = (i == 0) ? n / 2 : engine_random(seed) % n;
+		int64		got = fuzz_value(typid, engine_rank(pms, rank));
+
+		if (approx)
+		{
+			/* the ranks the value has, which are to be within the accuracy */
+			int64 const *lo = ref;
+			size_t		len = n;
+			size_t		first;
+			size_t		last;
+			size_t		slack = (size_t) (3 * MEDIAN_SKETCH_ACCURACY * n) + 1;
+
+			while (len > 0)
+			{
+				size_t		half = len / 2;
+
+				if (lo[half] < got)
+				{
+					lo += half + 1;
+					len -= half + 1;
+				}
+				else
+				{
+					len = half;
+				}
+			}
+			first = lo - ref;
+			for (last = first; (last < n) && (ref[last] == got); ++last)
+			{
+			}
+			if ((last == first) || (rank + slack < first) || (rank >= last + slack))
+			{
+				fuzz_fail(what, n, rank, got, ref[rank]);
+			}
+		}
+		else if (got != ref[rank])
+		{
+			fuzz_fail(what, n, rank, got, ref[rank]);
+		}
+	}
+}
+
+/*
+ * An aggregate: the values added to 1 to 3 (or, sometimes, up to 16)
+ * partial states, of random engines, each maybe serialized, and then
+ * combined. The values are dealt to the states in turn, or as the
+ * partitions of a range, each maybe sorted.
+ */
+static void
+fuzz_aggregate(uint64 *seed)
+{
+	Oid const	typid = fuzz_types[engine_random(seed) % lengthof(fuzz_types)];
+	struct MedianTypeInfo *ti = engine_type_info(typid);
+	bool const	sketch = engine_random(seed) % 8 == 0;
+	size_t const n = engine_random(seed) % ((engine_random(seed) % 4 == 0) ? 50000 : 1500);
+	int const	nparts = 1 + engine_random(seed) % ((engine_random(seed) % 4 == 0) ? 16 : 3);
+	bool const	ranged = engine_random(seed) % 2 == 0;
+	int64 const range = fuzz_random_range(seed, typid);
+	struct MedianState *parts[16];
+	int64	   *ref = malloc(Max(n, 1) * sizeof(int64));
+	Datum	   *batch = malloc(MEDIAN_STAGE_CAP * sizeof(Datum));
+	size_t		nbatch = 0;
+	size_t		i;
+	int			p;
+
+	median_select = (engine_random(seed) % 2 == 0) ? msQuick : msRadix;
+	median_spill = engine_random(seed) % 4 == 0;
+	work_mem = 64;
+	for (p = 0; p < nparts; ++p)
+	{
+		static enum MedianEngine const engines[] = {meAppend, meAppend, meSorted, meCounts};
+
+		parts[p] = engine_create(ti, sketch ? meSketch :
+								 engines[engine_random(seed) % lengthof(engines)]);
+	}
+	for (i = 0; i < n; ++i)
+	{
+		ref[i] = fuzz_random_value(seed, range);
+	}
+	if ((n > 1) && (engine_random(seed) % 4 == 0))
+	{
+		/* in order, as a series, but for (maybe) one value out of it */
+		qsort(ref, n, sizeof(int64), int64_cmp);
+		if (engine_random(seed) % 2 == 0)
+		{
+			ref[engine_random(seed) % n] = fuzz_random_value(seed, range);
+		}
+	}
+	if (ranged && (engine_random(seed) % 2 == 0))
+	{
+		for (p = 0; p < nparts; ++p)
+		{
+			size_t const from = n * p / nparts;
+
+			qsort(ref + from, n * (p + 1) / nparts - from, sizeof(int64), int64_cmp);
+		}
+	}
+	for (i = 0; i < n; ++i)
+	{
+		p = ranged ? (int) (i * nparts / n) : (int) (i % nparts);
+		if ((p == 0) && (engine_random(seed) % 2 == 0))
+		{
+			/* some in batches, as staged by the transition function */
+			batch[nbatch++] = fuzz_datum(typid, ref[i]);
+			if (nbatch == MEDIAN_STAGE_CAP)
+			{
+				parts[0] = engine_add_batch(parts[0], batch, nbatch);
+				nbatch = 0;
+			}
+		}
+		else
+		{
+			parts[p] = engine_add(parts[p], fuzz_datum(typid, ref[i]));
+		}
+	}
+	parts[0] = engine_add_batch(parts[0], batch, nbatch);
+	for (p = 1; p < nparts; ++p)
+	{
+		if (engine_random(seed) % 2 == 0)
+		{
+			struct MedianState *copy = engine_roundtrip(parts[p]);
+
+			engine_free(parts[p]);
+			parts[p] = copy;
+		}
+		engine_combine(parts[0], parts[p]);
+		engine_free(parts[p]);
+	}
+	qsort(ref, n, sizeof(int64), int64_cmp);
+	fuzz_check(parts[0], typid, ref, n, sketch, seed, median_engine_names[parts[0]->engine]);
+	if (!sketch)
+	{
+		struct MedianState *copy = engine_roundtrip(parts[0]);
+
+		fuzz_check(copy, typid, ref, n, false, seed, "roundtrip");
+		engine_free(copy);
+	}
+	engine_free(parts[0]);
+	pfree(ti);
+	free(batch);
+	free(ref);
+}
+
+/*
+ * A window: values added at the tail, and removed from the head, of a
+ * frame of random (and changing) size, with removing an absent value
+ * checked to fail.
+ */
+static void
+fuzz_window(uint64 *seed)
+{
+	Oid const	typid = fuzz_types[engine_random(seed) % lengthof(fuzz_types)];
+	struct MedianTypeInfo *ti = engine_type_info(typid);
+	size_t const n = engine_random(seed) % 6000;
+	size_t		w = 1 + engine_random(seed) % 2000;
+	int64 const range = fuzz_random_range(seed, typid);
+	int64	   *v = malloc(Max(n, 1) * sizeof(int64));
+	int64	   *ref = malloc(Max(n, 1) * sizeof(int64));
+	size_t		head = 0;
+	size_t		i;
+	struct MedianState *pms;
+
+	median_small_window_threshold = (engine_random(seed) % 3 == 0) ? 0 : engine_random(seed) % 600;
+	pms = engine_create(ti, (median_small_window_threshold > 0) ? meFlat : meTree);
+	for (i = 0; i < n; ++i)
+	{
+		size_t		m = i - head;
+		size_t		j;
+
+		v[i] = fuzz_random_value(seed, range);
+		pms = engine_add(pms, fuzz_datum(typid, v[i]));
+		for (j = 0; (j < m) && (ref[j] <= v[i]); ++j)
+		{
+		}
+		memmove(ref + j + 1, ref + j, (m - j) * sizeof(int64));
+		ref[j] = v[i];
+		++m;
+		if (engine_random(seed) % 500 == 0)
+		{
+			w = 1 + engine_random(seed) % 2000;
+		}
+		while (m > w)
+		{
+			if (!engine_remove(pms, fuzz_datum(typid, v[head])))
+			{
+				fuzz_fail("remove", m, 0, v[head], v[head]);
+			}
+			for (j = 0; ref[j] != v[head]; ++j)
+			{
+			}
+			memmove(ref + j, ref + j + 1, (m - j - 1) * sizeof(int64));
+			++head;
+			--m;
+		}
+		if ((range <= 100000) && (engine_random(seed) % 64 == 0) &&
+			engine_remove(pms, fuzz_datum(typid, 3 * range)))
+		{
+			fuzz_fail("remove of an absent value", m, 0, 3 * range, 0);
+		}
+		if (engine_random(seed) % 16 == 0)
+		{
+			fuzz_check(pms, typid, ref, m, false, seed, median_engine_names[pms->engine]);
+		}
+	}
+	engine_free(pms);
+	pfree(ti);
+	free(ref);
+	free(v);
+}
+
+/*
+ * A window whose frame only grows, kept in sorted pages, as by
+ * `median_transfn`: the median found after every value, as by the finalfn,
+ * and checked (with random ranks, which move the `mid` element back and
+ * forth) against a sorted copy of the values on some rows.
+ */
+static void
+fuzz_growing(uint64 *seed)
+{
+	Oid const	typid = fuzz_types[engine_random(seed) % lengthof(fuzz_types)];
+	struct MedianTypeInfo *ti = engine_type_info(typid);
+	size_t const n = engine_random(seed) % ((engine_random(seed) % 4 == 0) ? 40000 : 3000);
+	int64 const range = fuzz_random_range(seed, typid);
+	bool const	series = engine_random(seed) % 4 == 0;
+	int64	   *v = malloc(Max(n, 1) * sizeof(int64));
+	int64	   *ref = malloc(Max(n, 1) * sizeof(int64));
+	struct MedianState *pms = engine_create(ti, meSorted);
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		v[i] = series ? (int64) i : fuzz_random_value(seed, range);
+		pms = engine_add(pms, fuzz_datum(typid, v[i]));
+		if ((engine_random(seed) % 512 == 0) || (i + 1 == n))
+		{
+			memcpy(ref, v, (i + 1) * sizeof(int64));
+			qsort(ref, i + 1, sizeof(int64), int64_cmp);
+			fuzz_check(pms, typid, ref, i + 1, false, seed, "growing");
+		}
+		else
+		{
+			(void) engine_rank(pms, (i + 1) / 2);
+		}
+	}
+	engine_free(pms);
+	pfree(ti);
+	free(ref);
+	free(v);
+}
+
+int
+main(int argc, char **argv)
+{
+	long		iterations = (argc > 1) ? atol(argv[1]) : 2000;
+	uint64		seed0 = (argc > 2) ? strtoull(argv[2], NULL, 10) : (uint64) clock_ns();
+	long		it;
+
+	engine_init();
+	for (it = 0; it < iterations; ++it)
+	{
+		uint64		seed;
+
+		fuzz_seed = seed = seed0 + it;
+		switch (engine_random(&seed) % 8)
+		{
+			case 0:
+			case 1:
+				fuzz_window(&seed);
+				break;
+			case 2:
+				fuzz_growing(&seed);
+				break;
+			default:
+				fuzz_aggregate(&seed);
+				break;
+		}
+	}
+	printf("%ld iterations from seed %llu: OK\n", iterations, (unsigned long long) seed0);
+	return 0;
+}
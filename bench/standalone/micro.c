@@ -0,0 +1,268 @@
+/* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
+/*
+ * micro.c
+ *
+ * Microbenchmark of the state engines (see engines.h): the time (and
+ * cycles) per value of adding the values of each distribution to a state
+ * of each engine, and of then finding their median. Windows add a value,
+ * remove the one leaving a frame of 1000 values (but for one whose frame
+ * only grows), and find the median, on every step, whose time is the one
+ * per value.
+ *
+ *   median_bench [values [repetitions]]
+ *
+ * The best of the repetitions is reported, one line per benchmark.
+ */
+#include "engines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_WINDOW 1000
+
+enum BenchDist
+{
+	bdSorted,
+	bdReverse,
+	bdRandom,
+	bdDups,
+	bdKiller
+};
+
+static const char *const bench_dist_names[] = {
+	[bdSorted] = "sorted",
+	[bdReverse] = "reverse",
+	[bdRandom] = "random",
+	[bdDups] = "dups",
+	[bdKiller] = "killer"
+};
+
+/** A benchmarked setup: the engine of the state, and its settings */
+struct BenchEngine
+{
+	const char *name;
+	enum MedianEngine engine;
+	int			select;
+	bool		batch;
+	/** A window whose frame only grows: nothing is removed from it */
+	bool		growing;
+};
+
+static const struct BenchEngine bench_engines[] = {
+	{"append", meAppend, msQuick, false, false},
+	{"append/batch", meAppend, msQuick, true, false},
+	{"append/radix", meAppend, msRadix, true, false},
+	{"sorted", meSorted, msQuick, false, false},
+	{"counts", meCounts, msQuick, true, false},
+	{"sketch", meSketch, msQuick, true, false},
+	{"window/grow", meSorted, msQuick, false, true},
+	{"window/flat", meFlat, msQuick, false, false},
+	{"window/tree", meTree, msQuick, false, false}
+};
+
+static Oid const bench_types[] = {INT4OID, INT8OID, FLOAT8OID};
+static const char *const bench_type_names[] = {"int4", "int8", "float8"};
+
+/** The `i`-th of `n` values of the distribution */
+static int64
+bench_value(enum BenchDist dist, size_t i, size_t n, uint64 *seed)
+{
+	size_t const k = n / 2;
+
+	switch (dist)
+	{
+		case bdSorted:
+			return i;
+		case bdReverse:
+			return n - i;
+		case bdRandom:
+			return engine_random(seed) % n;
+		case bdDups:
+			return engine_random(seed) % 10;
+		case bdKiller:
+			/* Musser's median-of-3 killer, 1-based */
+			++i;
+			if (i <= k)
+			{
+				return (i % 2 == 1) ? i : k + i - 1;
+			}
+			return 2 * (i - k);
+	}
+	return 0;
+}
+
+static Datum
+bench_datum(Oid typid, int64 v)
+{
+	switch (typid)
+	{
+		case INT4OID:
+			return Int32GetDatum((int32) v);
+		case INT8OID:
+			return Int64GetDatum(v);
+		default:
+			return Float8GetDatum((float8) v / 4);
+	}
+}
+
+struct BenchTime
+{
+	uint64		ns;
+	uint64		cycles;
+};
+
+static inline struct BenchTime
+bench_now(void)
+{
+	struct BenchTime t;
+
+	t.cycles = clock_cycles();
+	t.ns = clock_ns();
+	return t;
+}
+
+static inline struct BenchTime
+bench_since(struct BenchTime t0)
+{
+	struct BenchTime t = bench_now();
+
+	t.ns -= t0.ns;
+	t.cycles -= t0.cycles;
+	return t;
+}
+
+static void
+bench_best(struct BenchTime *best, struct BenchTime t)
+{
+	if ((best->ns == 0) || (t.ns < best->ns))
+	{
+		*best = t;
+	}
+}
+
+/* Keeps the result from being optimized away */
+static volatile Datum bench_sink;
+
+/*
+ * Adds the values to a state of the engine, and then finds their median,
+ * timing both.
+ */
+static void
+bench_aggregate(struct MedianTypeInfo *ti, struct BenchEngine const *be, Datum const *d,
+				size_t n, struct BenchTime *add, struct BenchTime *rank)
+{
+	struct MedianState *pms = engine_create(ti, be->engine);
+	struct BenchTime t0 = bench_now();
+	size_t		i;
+
+	/* as `stage_add` does, the values are only batched after the first ones */
+	for (i = 0; (i < n) && !(be->batch && (i >= MEDIAN_STAGE_CAP)); ++i)
+	{
+		pms = engine_add(pms, d[i]);
+	}
+	for (; i < n; i += MEDIAN_STAGE_CAP)
+	{
+		pms = engine_add_batch(pms, d + i, Min(n - i, MEDIAN_STAGE_CAP));
+	}
+	bench_best(add, bench_since(t0));
+	t0 = bench_now();
+	bench_sink = engine_rank(pms, engine_count(pms) / 2);
+	bench_best(rank, bench_since(t0));
+	engine_free(pms);
+}
+
+/*
+ * A moving window: one value added, one removed (unless the frame only
+ * grows), and the median found
+ */
+static void
+bench_window(struct MedianTypeInfo *ti, struct BenchEngine const *be, Datum const *d,
+			 size_t n, struct BenchTime *step)
+{
+	struct MedianState *pms;
+	struct BenchTime t0;
+	size_t		i;
+
+	median_small_window_threshold = (be->engine == meFlat) ? BENCH_WINDOW : 0;
+	pms = engine_create(ti, be->engine);
+	t0 = bench_now();
+	for (i = 0; i < n; ++i)
+	{
+		pms = engine_add(pms, d[i]);
+		if (!be->growing && (i >= BENCH_WINDOW))
+		{
+			engine_remove(pms, d[i - BENCH_WINDOW]);
+		}
+		bench_sink = engine_rank(pms, engine_count(pms) / 2);
+	}
+	bench_best(step, bench_since(t0));
+	engine_free(pms);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t		n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+	int			reps = (argc > 2) ? atoi(argv[2]) : 3;
+	Datum	   *d = malloc(Max(n, 1) * sizeof(Datum));
+	size_t		it;
+	enum BenchDist dist;
+
+	engine_init();
+	printf("%-7s %-8s %-13s %10s %12s %12s %12s\n",
+		   "type", "dist", "engine", "values", "ns/value", "cycles/value", "median us");
+	for (it = 0; it < lengthof(bench_types); ++it)
+	{
+		struct MedianTypeInfo *ti = engine_type_info(bench_types[it]);
+
+		for (dist = bdSorted; dist <= bdKiller; ++dist)
+		{
+			uint64		seed = 42;
+			size_t		i;
+			size_t		ie;
+
+			for (i = 0; i < n; ++i)
+			{
+				d[i] = bench_datum(bench_types[it], bench_value(dist, i, n, &seed));
+			}
+			for (ie = 0; ie < lengthof(bench_engines); ++ie)
+			{
+				struct BenchEngine const *be = &bench_engines[ie];
+				struct BenchTime add = {0, 0};
+				struct BenchTime rank = {0, 0};
+				int			r;
+
+				if ((be->select == msRadix) && (ti->valclass != vcNumeral))
+				{
+					continue;
+				}
+				median_select = be->select;
+				for (r = 0; r < reps; ++r)
+				{
+					if ((be->engine >= meTree) || be->growing)
+					{
+						bench_window(ti, be, d, n, &add);
+					}
+					else
+					{
+						bench_aggregate(ti, be, d, n, &add, &rank);
+					}
+				}
+				printf("%-7s %-8s %-13s %10zu %12.2f %12.2f ",
+					   bench_type_names[it], bench_dist_names[dist], be->name, n,
+					   (double) add.ns / Max(n, 1), (double) add.cycles / Max(n, 1));
+				if ((be->engine >= meTree) || be->growing)
+				{
+					printf("%12s\n", "-");
+				}
+				else
+				{
+					printf("%12.1f\n", (double) rank.ns / 1000);
+				}
+			}
+		}
+		pfree(ti);
+	}
+	free(d);
+	return 0;
+}
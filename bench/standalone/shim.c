@@ -0,0 +1,470 @@
+/* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
+/*
+ * shim.c
+ *
+ * The part of the backend runtime median_engine.c uses, for driving its
+ * engines outside PostgreSQL (see engines.h): memory contexts on
+ * `malloc()`, `elog()` printing to `stderr` (and aborting, for errors),
+ * string buffers and their wire format, and temporary files on
+ * `tmpfile()`.
+ *
+ * Only the headers of `postgres.h` are included, so the rest is defined
+ * without (checking against) the server's declarations, which change
+ * between versions in ways that don't matter to the ABI.
+ */
+#include <postgres.h>
+#include <lib/stringinfo.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* the C library's, not libpgport's */
+#undef fprintf
+#undef vsnprintf
+#undef qsort
+
+void		shim_init(void);
+
+/*
+ * Memory contexts: each allocation is a chunk of the (doubly linked)
+ * list of its context, which is freed with it.
+ */
+struct ShimChunk
+{
+	struct ShimChunk *prev;
+	struct ShimChunk *next;
+	/* keeps the data after the header MAXALIGNed */
+	double		align_[2];
+};
+
+struct ShimContext
+{
+	struct ShimChunk chunks;
+};
+
+MemoryContext TopMemoryContext = NULL;
+MemoryContext CurrentMemoryContext = NULL;
+int			work_mem = 4096;
+
+static MemoryContext
+shim_context_create(void)
+{
+	struct ShimContext *c = malloc(sizeof *c);
+
+	if (NULL == c)
+	{
+		elog(ERROR, "out of memory");
+		return NULL;
+	}
+	c->chunks.prev = c->chunks.next = &c->chunks;
+	return (MemoryContext) c;
+}
+
+void
+shim_init(void)
+{
+	if (NULL == TopMemoryContext)
+	{
+		TopMemoryContext = shim_context_create();
+	}
+	CurrentMemoryContext = TopMemoryContext;
+}
+
+static void *
+shim_alloc(MemoryContext context, Size size, bool zero)
+{
+	struct ShimContext *c = (struct ShimContext *) context;
+	struct ShimChunk *ch;
+
+	if (NULL == c)
+	{
+		shim_init();
+		c = (struct ShimContext *) TopMemoryContext;
+	}
+	ch = zero ? calloc(1, sizeof *ch + size) : malloc(sizeof *ch + size);
+	if (NULL == ch)
+	{
+		elog(ERROR, "out of memory (requesting %zu bytes)", (size_t) size);
+		return NULL;
+	}
+	ch->next = c->chunks.next;
+	ch->prev = &c->chunks;
+	ch->next->prev = ch;
+	c->chunks.next = ch;
+
+	return ch + 1;
+}
+
+void *
+MemoryContextAlloc(MemoryContext context, Size size)
+{
+	return shim_alloc(context, size, false);
+}
+
+void *
+MemoryContextAllocZero(MemoryContext context, Size size)
+{
+	return shim_alloc(context, size, true);
+}
+
+void *
+MemoryContextAllocHuge(MemoryContext context, Size size)
+{
+	return shim_alloc(context, size, false);
+}
+
+void *
+palloc(Size size)
+{
+	return shim_alloc(CurrentMemoryContext, size, false);
+}
+
+void *
+palloc0(Size size)
+{
+	return shim_alloc(CurrentMemoryContext, size, true);
+}
+
+void
+pfree(void *pointer)
+{
+	struct ShimChunk *ch = (struct ShimChunk *) pointer - 1;
+
+	ch->prev->next = ch->next;
+	ch->next->prev = ch->prev;
+	free(ch);
+}
+
+void *
+repalloc(void *pointer, Size size)
+{
+	struct ShimChunk *ch = realloc((struct ShimChunk *) pointer - 1, sizeof *ch + size);
+
+	if (NULL == ch)
+	{
+		elog(ERROR, "out of memory (requesting %zu bytes)", (size_t) size);
+		return NULL;
+	}
+	ch->prev->next = ch;
+	ch->next->prev = ch;
+
+	return ch + 1;
+}
+
+void *
+repalloc_huge(void *pointer, Size size)
+{
+	return repalloc(pointer, size);
+}
+
+MemoryContext
+AllocSetContextCreateInternal(MemoryContext parent, const char *name,
+							  Size minContextSize, Size initBlockSize, Size maxBlockSize)
+{
+	return shim_context_create();
+}
+
+void
+MemoryContextReset(MemoryContext context)
+{
+	struct ShimContext *c = (struct ShimContext *) context;
+
+	while (c->chunks.next != &c->chunks)
+	{
+		pfree(c->chunks.next + 1);
+	}
+}
+
+void
+MemoryContextDelete(MemoryContext context)
+{
+	MemoryContextReset(context);
+	if (CurrentMemoryContext == context)
+	{
+		CurrentMemoryContext = TopMemoryContext;
+	}
+	free(context);
+}
+
+/*
+ * Errors and messages: from `WARNING` up printed, errors (the engines
+ * only raise ones which are bugs, outside SQL) abort.
+ */
+static int	shim_elevel;
+static char shim_message[1024];
+
+bool
+errstart(int elevel, const char *domain)
+{
+	shim_elevel = elevel;
+	shim_message[0] = '\0';
+	return elevel >= WARNING;
+}
+
+#if PG_VERSION_NUM >= 140000
+bool
+errstart_cold(int elevel, const char *domain)
+{
+	return errstart(elevel, domain);
+}
+#endif
+
+int
+errmsg_internal(const char *fmt,...)
+{
+	va_list		args;
+
+	va_start(args, fmt);
+	vsnprintf(shim_message, sizeof shim_message, fmt, args);
+	va_end(args);
+	return 0;
+}
+
+void
+errfinish(const char *filename, int lineno, const char *funcname)
+{
+	fprintf(stderr, "%s: %s (%s:%d)\n", (shim_elevel >= ERROR) ? "ERROR" : "WARNING",
+			shim_message, filename, lineno);
+	if (shim_elevel >= ERROR)
+	{
+		abort();
+	}
+}
+
+#if PG_VERSION_NUM >= 160000
+void
+ExceptionalCondition(const char *conditionName, const char *fileName, int lineNumber)
+#else
+void
+ExceptionalCondition(const char *conditionName, const char *errorType,
+					 const char *fileName, int lineNumber)
+#endif
+{
+	fprintf(stderr, "TRAP: failed Assert(\"%s\") (%s:%d)\n", conditionName, fileName, lineNumber);
+	abort();
+}
+
+void
+pg_qsort(void *base, size_t nel, size_t elsize, int (*cmp) (const void *, const void *))
+{
+	qsort(base, nel, elsize, cmp);
+}
+
+/* String buffers, as in stringinfo.c */
+
+void
+initStringInfo(StringInfo str)
+{
+	str->maxlen = 1024;
+	str->data = palloc(str->maxlen);
+	resetStringInfo(str);
+}
+
+void
+resetStringInfo(StringInfo str)
+{
+	str->data[0] = '\0';
+	str->len = 0;
+	str->cursor = 0;
+}
+
+void
+enlargeStringInfo(StringInfo str, int needed)
+{
+	int			newlen = str->maxlen;
+
+	if (str->len + needed + 1 <= str->maxlen)
+	{
+		return;
+	}
+	while (str->len + needed + 1 > newlen)
+	{
+		newlen *= 2;
+	}
+	str->data = repalloc(str->data, newlen);
+	str->maxlen = newlen;
+}
+
+#if PG_VERSION_NUM >= 160000
+void
+appendBinaryStringInfo(StringInfo str, const void *data, int datalen)
+#else
+void
+appendBinaryStringInfo(StringInfo str, const char *data, int datalen)
+#endif
+{
+	enlargeStringInfo(str, datalen);
+	memcpy(str->data + str->len, data, datalen);
+	str->len += datalen;
+	str->data[str->len] = '\0';
+}
+
+/* The wire format, as in pqformat.c */
+
+void
+pq_sendbytes(StringInfo buf, const void *data, int datalen)
+{
+	appendBinaryStringInfo(buf, data, datalen);
+}
+
+void
+pq_sendbyte(StringInfo buf, int byt)
+{
+	char		c = (char) byt;
+
+	appendBinaryStringInfo(buf, &c, 1);
+}
+
+const char *
+pq_getmsgbytes(StringInfo msg, int datalen)
+{
+	const char *result;
+
+	if ((datalen < 0) || (datalen > msg->len - msg->cursor))
+	{
+		elog(ERROR, "insufficient data left in message");
+		return NULL;
+	}
+	result = &msg->data[msg->cursor];
+	msg->cursor += datalen;
+	return result;
+}
+
+int
+pq_getmsgbyte(StringInfo msg)
+{
+	return (unsigned char) *pq_getmsgbytes(msg, 1);
+}
+
+unsigned int
+pq_getmsgint(StringInfo msg, int b)
+{
+	const unsigned char *p = (const unsigned char *) pq_getmsgbytes(msg, b);
+	unsigned int result = 0;
+	int			i;
+
+	for (i = 0; i < b; ++i)
+	{
+		result = (result << 8) | p[i];
+	}
+	return result;
+}
+
+int64
+pq_getmsgint64(StringInfo msg)
+{
+	const unsigned char *p = (const unsigned char *) pq_getmsgbytes(msg, 8);
+	uint64		result = 0;
+	int			i;
+
+	for (i = 0; i < 8; ++i)
+	{
+		result = (result << 8) | p[i];
+	}
+	return (int64) result;
+}
+
+void
+pq_sendfloat8(StringInfo buf, float8 f)
+{
+	union
+	{
+		float8		f;
+		int64		i;
+	}			swap;
+
+	int			i;
+
+	swap.f = f;
+	for (i = 56; i >= 0; i -= 8)
+	{
+		pq_sendbyte(buf, (int) ((uint64) swap.i >> i) & 0xFF);
+	}
+}
+
+float8
+pq_getmsgfloat8(StringInfo msg)
+{
+	union
+	{
+		float8		f;
+		int64		i;
+	}			swap;
+
+	swap.i = pq_getmsgint64(msg);
+	return swap.f;
+}
+
+void
+pq_getmsgend(StringInfo msg)
+{
+	if (msg->cursor != msg->len)
+	{
+		elog(ERROR, "invalid message format");
+	}
+}
+
+/* Temporary files, for spilling */
+
+struct BufFile
+{
+	FILE	   *f;
+};
+
+struct BufFile *
+BufFileCreateTemp(bool interXact)
+{
+	struct BufFile *file = malloc(sizeof *file);
+
+	if ((NULL == file) || (NULL == (file->f = tmpfile())))
+	{
+		elog(ERROR, "could not create temporary file");
+		return NULL;
+	}
+	return file;
+}
+
+void
+BufFileClose(struct BufFile *file)
+{
+	fclose(file->f);
+	free(file);
+}
+
+size_t
+BufFileRead(struct BufFile *file, void *ptr, size_t size)
+{
+	return fread(ptr, 1, size, file->f);
+}
+
+void
+BufFileReadExact(struct BufFile *file, void *ptr, size_t size)
+{
+	if (fread(ptr, 1, size, file->f) != size)
+	{
+		elog(ERROR, "could not read from temporary file");
+	}
+}
+
+void
+BufFileWrite(struct BufFile *file, const void *ptr, size_t size)
+{
+	if (fwrite(ptr, 1, size, file->f) != size)
+	{
+		elog(ERROR, "could not write to temporary file");
+	}
+}
+
+int
+BufFileSeek(struct BufFile *file, int fileno, off_t offset, int whence)
+{
+	return ((fileno == 0) && (fseeko(file->f, offset, whence) == 0)) ? 0 : EOF;
+}
+
+void
+BufFileTell(struct BufFile *file, int *fileno, off_t *offset)
+{
+	*fileno = 0;
+	*offset = ftello(file->f);
+}
@@ -1,28 +1,347 @@
 CREATE OR REPLACE FUNCTION _median_transfn(state internal, val anyelement)
 RETURNS internal
 AS '$libdir/median', 'median_transfn'
-LANGUAGE C IMMUTABLE;
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_mtransfn(state internal, val anyelement)
+RETURNS internal
+AS '$libdir/median', 'median_mtransfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
 
 CREATE OR REPLACE FUNCTION _median_inv_transfn(state internal, val anyelement)
 RETURNS internal
 AS '$libdir/median', 'median_inv_transfn'
-LANGUAGE C IMMUTABLE;
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
 
 CREATE OR REPLACE FUNCTION _median_finalfn(state internal, val anyelement)
 RETURNS anyelement
 AS '$libdir/median', 'median_finalfn'
-LANGUAGE C IMMUTABLE;
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_combinefn(state1 internal, state2 internal)
+RETURNS internal
+AS '$libdir/median', 'median_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_serialfn(state internal)
+RETURNS bytea
+AS '$libdir/median', 'median_serialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_deserialfn(state bytea, dummy internal)
+RETURNS internal
+AS '$libdir/median', 'median_deserialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
 DROP AGGREGATE IF EXISTS median (ANYELEMENT);
 CREATE AGGREGATE median (ANYELEMENT)
 (
     sfunc = _median_transfn,
     stype = internal,
+    -- the state (sizeof(struct MedianState), 248 bytes on 64-bit platforms,
+    -- which includes its first MEDIAN_INLINE_SIZE bytes of values) is
+    -- allocated as a 256-byte chunk, MEDIAN_STATE_CHUNK
+    sspace = 256,
     finalfunc = _median_finalfn,
     finalfunc_extra,
-    msfunc = _median_transfn,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serialfn,
+    deserialfunc = _median_deserialfn,
+    msfunc = _median_mtransfn,
     mstype = internal,
     minvfunc = _median_inv_transfn,
     mfinalfunc = _median_finalfn,
-    mfinalfunc_extra
+    mfinalfunc_extra,
+    parallel = safe
+);
+
+CREATE OR REPLACE FUNCTION _approx_median_transfn(state internal, val anyelement)
+RETURNS internal
+AS '$libdir/median', 'approx_median_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_transfn(state internal, val anyelement, accuracy float8)
+RETURNS internal
+AS '$libdir/median', 'approx_median_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_finalfn(state internal, val anyelement, accuracy float8)
+RETURNS anyelement
+AS '$libdir/median', 'median_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS approx_median (ANYELEMENT);
+CREATE AGGREGATE approx_median (ANYELEMENT)
+(
+    sfunc = _approx_median_transfn,
+    stype = internal,
+    finalfunc = _median_finalfn,
+    finalfunc_extra,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serialfn,
+    deserialfunc = _median_deserialfn,
+    parallel = safe
+);
+
+DROP AGGREGATE IF EXISTS approx_median (ANYELEMENT, float8);
+CREATE AGGREGATE approx_median (ANYELEMENT, float8)
+(
+    sfunc = _approx_median_transfn,
+    stype = internal,
+    finalfunc = _median_finalfn,
+    finalfunc_extra,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serialfn,
+    deserialfunc = _median_deserialfn,
+    parallel = safe
+);
+
+CREATE TYPE median_sketch;
+
+CREATE OR REPLACE FUNCTION median_sketch_in(cstring)
+RETURNS median_sketch
+AS '$libdir/median', 'median_sketch_in'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_sketch_out(median_sketch)
+RETURNS cstring
+AS '$libdir/median', 'median_sketch_out'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_sketch_recv(internal)
+RETURNS median_sketch
+AS '$libdir/median', 'median_sketch_recv'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_sketch_send(median_sketch)
+RETURNS bytea
+AS '$libdir/median', 'median_sketch_send'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE median_sketch
+(
+    input = median_sketch_in,
+    output = median_sketch_out,
+    receive = median_sketch_recv,
+    send = median_sketch_send,
+    internallength = variable,
+    storage = extended
+);
+
+CREATE OR REPLACE FUNCTION _median_sketch_finalfn(state internal)
+RETURNS median_sketch
+AS '$libdir/median', 'median_sketch_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_merge_transfn(state internal, sketch median_sketch)
+RETURNS internal
+AS '$libdir/median', 'median_merge_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_value(sketch median_sketch, type anyelement)
+RETURNS anyelement
+AS '$libdir/median', 'median_value'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS median_sketch (ANYELEMENT);
+CREATE AGGREGATE median_sketch (ANYELEMENT)
+(
+    sfunc = _approx_median_transfn,
+    stype = internal,
+    finalfunc = _median_sketch_finalfn,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serialfn,
+    deserialfunc = _median_deserialfn,
+    parallel = safe
+);
+
+DROP AGGREGATE IF EXISTS median_sketch (ANYELEMENT, float8);
+CREATE AGGREGATE median_sketch (ANYELEMENT, float8)
+(
+    sfunc = _approx_median_transfn,
+    stype = internal,
+    finalfunc = _median_sketch_finalfn,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serialfn,
+    deserialfunc = _median_deserialfn,
+    parallel = safe
+);
+
+DROP AGGREGATE IF EXISTS median_merge (median_sketch);
+CREATE AGGREGATE median_merge (median_sketch)
+(
+    sfunc = _median_merge_transfn,
+    stype = internal,
+    finalfunc = _median_sketch_finalfn,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serialfn,
+    deserialfunc = _median_deserialfn,
+    parallel = safe
+);
+
+CREATE OR REPLACE FUNCTION _quantiles_transfn(state internal, val anyelement, fractions float8[])
+RETURNS internal
+AS '$libdir/median', 'quantiles_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _quantiles_finalfn(state internal, val anyelement, fractions float8[])
+RETURNS anyarray
+AS '$libdir/median', 'quantiles_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS quantiles (ANYELEMENT, float8[]);
+CREATE AGGREGATE quantiles (ANYELEMENT, float8[])
+(
+    sfunc = _quantiles_transfn,
+    stype = internal,
+    sspace = 256,
+    finalfunc = _quantiles_finalfn,
+    finalfunc_extra,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serialfn,
+    deserialfunc = _median_deserialfn,
+    parallel = safe
+);
+
+CREATE OR REPLACE FUNCTION _kth_smallest_transfn(state internal, val anyelement, k int)
+RETURNS internal
+AS '$libdir/median', 'kth_smallest_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _kth_largest_transfn(state internal, val anyelement, k int)
+RETURNS internal
+AS '$libdir/median', 'kth_largest_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _kth_finalfn(state internal, val anyelement, k int)
+RETURNS anyelement
+AS '$libdir/median', 'kth_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _top_k_finalfn(state internal, val anyelement, k int)
+RETURNS anyarray
+AS '$libdir/median', 'top_k_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS kth_smallest (ANYELEMENT, int);
+CREATE AGGREGATE kth_smallest (ANYELEMENT, int)
+(
+    sfunc = _kth_smallest_transfn,
+    stype = internal,
+    finalfunc = _kth_finalfn,
+    finalfunc_extra,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serialfn,
+    deserialfunc = _median_deserialfn,
+    parallel = safe
+);
+
+DROP AGGREGATE IF EXISTS kth_largest (ANYELEMENT, int);
+CREATE AGGREGATE kth_largest (ANYELEMENT, int)
+(
+    sfunc = _kth_largest_transfn,
+    stype = internal,
+    finalfunc = _kth_finalfn,
+    finalfunc_extra,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serialfn,
+    deserialfunc = _median_deserialfn,
+    parallel = safe
+);
+
+DROP AGGREGATE IF EXISTS top_k (ANYELEMENT, int);
+CREATE AGGREGATE top_k (ANYELEMENT, int)
+(
+    sfunc = _kth_largest_transfn,
+    stype = internal,
+    finalfunc = _top_k_finalfn,
+    finalfunc_extra,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serialfn,
+    deserialfunc = _median_deserialfn,
+    parallel = safe
 );
+
+CREATE OR REPLACE FUNCTION _medians_transfn(state internal, vals anyarray)
+RETURNS internal
+AS '$libdir/median', 'medians_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _medians_finalfn(state internal, vals anyarray)
+RETURNS anyarray
+AS '$libdir/median', 'medians_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _medians_combinefn(state1 internal, state2 internal)
+RETURNS internal
+AS '$libdir/median', 'medians_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _medians_serialfn(state internal)
+RETURNS bytea
+AS '$libdir/median', 'medians_serialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _medians_deserialfn(state bytea, dummy internal)
+RETURNS internal
+AS '$libdir/median', 'medians_deserialfn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS medians (VARIADIC ANYARRAY);
+CREATE AGGREGATE medians (VARIADIC ANYARRAY)
+(
+    sfunc = _medians_transfn,
+    stype = internal,
+    finalfunc = _medians_finalfn,
+    finalfunc_extra,
+    combinefunc = _medians_combinefn,
+    serialfunc = _medians_serialfn,
+    deserialfunc = _medians_deserialfn,
+    parallel = safe
+);
+
+CREATE OR REPLACE FUNCTION _median_os_transfn(state internal, val anyelement)
+RETURNS internal
+AS '$libdir/median', 'median_os_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_os_finalfn(state internal, val anyelement)
+RETURNS anyelement
+AS '$libdir/median', 'median_os_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS median_os (ORDER BY ANYELEMENT);
+CREATE AGGREGATE median_os (ORDER BY ANYELEMENT)
+(
+    sfunc = _median_os_transfn,
+    stype = internal,
+    finalfunc = _median_os_finalfn,
+    finalfunc_extra,
+    finalfunc_modify = shareable,
+    parallel = safe
+);
+
+CREATE OR REPLACE FUNCTION median_stats(OUT results int8, OUT added int8, OUT comparisons int8,
+                                        OUT bytes_moved int8, OUT reallocations int8,
+                                        OUT peak_bytes int8, OUT engine_switches int8,
+                                        OUT spilled_runs int8, OUT sort_keys int8,
+                                        OUT select_ms float8, OUT cache_hits int8,
+                                        OUT cache_misses int8)
+RETURNS record
+AS '$libdir/median', 'median_stats'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
+
+CREATE OR REPLACE FUNCTION median_stats_reset()
+RETURNS void
+AS '$libdir/median', 'median_stats_reset'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
+
+CREATE OR REPLACE FUNCTION median_cache_invalidate()
+RETURNS trigger
+AS '$libdir/median', 'median_cache_invalidate'
+LANGUAGE C VOLATILE PARALLEL UNSAFE;
+
+CREATE OR REPLACE FUNCTION median_cached(rel regclass, col name, pred text, typ anyelement)
+RETURNS anyelement
+AS '$libdir/median', 'median_cached'
+LANGUAGE C VOLATILE PARALLEL UNSAFE;
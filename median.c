@@ -1,445 +1,2641 @@
 /* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
 #include <postgres.h>
+#include <math.h>
 #include <fmgr.h>
+#include <funcapi.h>
+#include <access/genam.h>
+#include <access/htup_details.h>
+#include <access/table.h>
+#include <access/tupmacs.h>
+#include <catalog/namespace.h>
+#include <catalog/pg_aggregate.h>
+#include <catalog/pg_collation.h>
+#include <catalog/pg_extension.h>
+#include <catalog/pg_proc.h>
 #include <catalog/pg_type.h>
-#include <utils/varlena.h>
+#include <commands/extension.h>
+#include <lib/stringinfo.h>
+#include <libpq/pqformat.h>
+#include <mb/pg_wchar.h>
+#include <nodes/nodeFuncs.h>
+#include <nodes/parsenodes.h>
+#include <nodes/value.h>
+#include <optimizer/planner.h>
+#include <port/pg_bitutils.h>
+#include <port/pg_bswap.h>
+#include <portability/instr_time.h>
+#include <storage/buffile.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/datum.h>
+#include <utils/fmgroids.h>
+#include <utils/guc.h>
+#include <utils/inval.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/pg_locale.h>
+#include <utils/sortsupport.h>
+#include <utils/syscache.h>
+#include <utils/tuplesort.h>
+#include <utils/typcache.h>
+
+#include "median_cache.h"
+#include "median_engine.h"
+#include "median_simd.h"
 
 #ifdef PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
 #endif
 
-/** There probably is a way to do this in a more generic way, but
-    PostgreSQL `Datum` and friends are not very well documented, so,
-    we're doing it "by hand", handling "classes" of values - meaning
-    oids that can be handled in a same ("generic") way. Currently,
-    obviously the floating point types are missing, handling of string
-    types other than `text` and date/time other than `timestamp` is
-    not "researched" (though might probably require very little code
-    changes to support), but many other types also.
-*/
-enum ValueClass
-{
-	/** Which can be handled like integers */
-	vcNumeral,
-	/** Which can be handled like "Pascal" strings */
-	vcText
-};
+void		_PG_init(void);
+
+/** Whether to compare text (of a non-C collation) by sort keys */
+static bool median_text_sort_keys = false;
+
+static const struct config_enum_entry median_select_options[] = {
+	{"quickselect", msQuick, false},
+	{"radix", msRadix, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry median_engine_options[] = {
+	{"auto", -1, false},
+	{"sorted", meSorted, false},
+	{"append", meAppend, false},
+	{"counts", meCounts, false},
+	{"tree", meTree, false},
+	{"flat", meFlat, false},
+	{NULL, 0, false}
+};
+
+/** Version of the `median_sketch` format: the version (a byte), then
+    the type and collation, by (schema and) name, the number of values,
+    and the sketch itself (see `MT_SERIALIZE`), its elements encoded
+    portably (see `MT_WRITE_ARRAY`) */
+#define MEDIAN_SKETCH_VERSION 2
+
+/** The stats of all the results of this backend, see `median_stats` */
+static struct MedianStats median_stats_total;
+
+
+static planner_hook_type median_prev_planner_hook = NULL;
+
+static PlannedStmt *median_planner(Query *parse, const char *query_string, int cursorOptions,
+								   ParamListInfo boundParams);
+static void spill_transfns_invalidate(Datum arg, int cacheid, uint32 hashvalue);
+
+/*
+ * Module load callback
+ */
+void
+_PG_init(void)
+{
+	median_simd_init();
+
+	DefineCustomIntVariable("median.small_window_threshold",
+							"Max number of elements of a median window kept in a flat sorted array.",
+							"Bigger windows are kept in an order-statistic tree. "
+							"0 means to always use the tree.",
+							&median_small_window_threshold,
+							512,
+							0, INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomBoolVariable("median.spill",
+							 "Spill aggregates bigger than work_mem to disk.",
+							 "The values are written, in sorted runs, to a temporary "
+							 "file, which is merged to find the median. "
+							 "Doesn't apply to windows. Turns off parallel plans "
+							 "for the whole query of such an aggregate, not just "
+							 "for the aggregate.",
+							 &median_spill,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomEnumVariable("median.select",
+							 "How the median of unsorted values is selected.",
+							 "quickselect compares the values, radix (which applies "
+							 "to integer and date/time values) selects by histograms "
+							 "of their bits, without comparing them.",
+							 &median_select,
+							 msQuick,
+							 median_select_options,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomBoolVariable("median.track_stats",
+							 "Count the work done for each median.",
+							 "The counts (of values, comparisons, bytes moved, "
+							 "allocations, engine switches, spilled runs and sort keys, "
+							 "and the "
+							 "time to select) are reported at DEBUG1 for every result, "
+							 "and summed up by median_stats().",
+							 &median_track_stats,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomEnumVariable("median.engine",
+							 "Forces how the values of a median are kept.",
+							 "auto picks it, and switches it, by the values; "
+							 "sorted, append or counts force it for aggregates, "
+							 "tree, flat or counts for (moving) windows. Others "
+							 "don't apply, nor to approx_median. For benchmarking.",
+							 &median_engine,
+							 -1,
+							 median_engine_options,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+	DefineCustomBoolVariable("median.text_sort_keys",
+							 "Compare text by (cached) collation sort keys.",
+							 "The sort key of each value is made once, as it's added, "
+							 "instead of comparing by the collation each time. "
+							 "Takes more memory. Only applies where PostgreSQL trusts "
+							 "sort keys: ICU collations from PostgreSQL 16, and libc "
+							 "ones (such as en_US.UTF-8) only if it's built with "
+							 "TRUST_STRXFRM, so, by default, none before 16.",
+							 &median_text_sort_keys,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+	median_cache_init();
+	CacheRegisterSyscacheCallback(PROCOID, spill_transfns_invalidate, (Datum) 0);
+	median_prev_planner_hook = planner_hook;
+	planner_hook = median_planner;
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("median");
+#else
+	EmitWarningsOnPlaceholders("median");
+#endif
+}
+
+
+static inline Datum
+text_key(struct MedianState *pms, text *t)
+{
+	SortSupport ssup = &pms->ti->ssup;
+
+	return (NULL != ssup->abbrev_converter) ? ssup->abbrev_converter(PointerGetDatum(t), ssup) : 0;
+}
+
+static struct MedianText
+arena_text(struct MedianState *pms, char const *data, uint32 len)
+{
+	struct MedianText x;
+
+	x.ptr = median_arena_store(pms, data, len, NULL, 0);
+	x.len = len;
+	x.key = text_key(pms, x.ptr);
+
+	return x;
+}
+
+/* The argument is in a short-lived memory context, so we copy it */
+static struct MedianText
+text_from_datum(struct MedianState *pms, Datum d)
+{
+	text	   *t = DatumGetTextPP(d);
+
+	if (unlikely(pms->arena->dead > Max(pms->arena->live, MEDIAN_MAX_CHUNK_SIZE)))
+	{
+		median_arena_compact(pms);
+	}
+	return arena_text(pms, VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t));
+}
+
+/* The argument as is, to compare to (to remove) */
+static struct MedianText
+text_peek(struct MedianState *pms, Datum d)
+{
+	struct MedianText x;
+
+	x.ptr = DatumGetTextPP(d);
+	x.len = VARSIZE_ANY_EXHDR(x.ptr);
+	x.key = text_key(pms, x.ptr);
+
+	return x;
+}
+
+static inline void
+text_release(struct MedianText x, struct MedianState *pms)
+{
+	size_t const size = VARSIZE_ANY(x.ptr);
+
+	pms->arena->live -= size;
+	pms->arena->dead += size;
+}
+
+static inline int
+text_cmp(struct MedianText a, struct MedianText b, SortSupport ssup)
+{
+	if (NULL != ssup->abbrev_converter)
+	{
+		int			c = ssup->comparator(a.key, b.key, ssup);
+
+		if (c != 0)
+		{
+			return c;
+		}
+		return ssup->abbrev_full_comparator(PointerGetDatum(a.ptr), PointerGetDatum(b.ptr), ssup);
+	}
+	return ssup->comparator(PointerGetDatum(a.ptr), PointerGetDatum(b.ptr), ssup);
+}
+
+/* Strings are serialized with the length first and then the content */
+static void
+send_text_array(StringInfo buf, struct MedianText const *v, size_t n)
+{
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		pq_sendint32(buf, v[i].len);
+		pq_sendbytes(buf, VARDATA_ANY(v[i].ptr), v[i].len);
+	}
+}
+
+static void
+recv_text_array(StringInfo buf, struct MedianText *v, size_t n, struct MedianState *pms,
+				struct MedianText (*store) (struct MedianState *pms, char const *data, uint32 len))
+{
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		int const	len = pq_getmsgint(buf, 4);
+
+		v[i] = store(pms, pq_getmsgbytes(buf, len), len);
+	}
+}
+
+/*
+ * As `recv_text_array`, for a `median_sketch`, which may come from the
+ * outside, so the strings are checked to be valid in the server encoding.
+ * Their lengths are checked against what's left by `pq_getmsgbytes`.
+ */
+static void
+read_text_array(StringInfo buf, struct MedianText *v, size_t n, struct MedianState *pms,
+				struct MedianText (*store) (struct MedianState *pms, char const *data, uint32 len))
+{
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		int const	len = pq_getmsgint(buf, 4);
+		char const *data = pq_getmsgbytes(buf, len);
+
+		pg_verifymbstr(data, len, false);
+		v[i] = store(pms, data, len);
+	}
+}
+
+/*
+ * Whether to (and can we) compare text of the collation of `ti` by sort
+ * keys, setting up the locale to make them by, if so. They're only made
+ * where PostgreSQL itself trusts them to order as the collation does
+ * (`pg_strxfrm_enabled()`, or, before 16, which has no API for ICU sort
+ * keys, a libc locale, if built with `TRUST_STRXFRM`), as elsewhere they
+ * could give a different median than comparing by the collation does.
+ */
+static bool
+setup_sort_keys(struct MedianTypeInfo *ti)
+{
+	pg_locale_t locale;
+
+	if (!median_text_sort_keys || !OidIsValid(ti->collation))
+	{
+		return false;
+	}
+#if PG_VERSION_NUM >= 180000
+	locale = pg_newlocale_from_collation(ti->collation);
+	if (locale->collate_is_c)
+	{
+		return false;
+	}
+#else
+	if (lc_collate_is_c(ti->collation))
+	{
+		return false;
+	}
+	locale = pg_newlocale_from_collation(ti->collation);
+#endif
+#if PG_VERSION_NUM >= 160000
+	if (!pg_strxfrm_enabled(locale))
+	{
+		return false;
+	}
+#elif defined(TRUST_STRXFRM)
+	if ((NULL != locale) && (locale->provider != COLLPROVIDER_LIBC))
+	{
+		return false;
+	}
+#if PG_VERSION_NUM >= 150000
+	/* the default collation's locale is NULL for libc, but not for ICU */
+	if ((NULL == locale) && (default_locale.provider != COLLPROVIDER_LIBC))
+	{
+		return false;
+	}
+#endif
+#else
+	return false;
+#endif
+	ti->locale = locale;
+	ti->deterministic = (NULL == locale) || locale->deterministic;
+
+	return true;
+}
+
+/*
+ * Makes the sort key of the `len` bytes of string `data` in `ti->keybuf`,
+ * returning its size.
+ */
+static size_t
+make_sort_key(struct MedianTypeInfo *ti, char const *data, size_t len)
+{
+	size_t		keylen;
+
+#if PG_VERSION_NUM < 160000
+	if (len + 1 > ti->srcbufsize)
+	{
+		ti->srcbufsize = Max(len + 1, 2 * ti->srcbufsize);
+		ti->srcbuf = (NULL == ti->srcbuf) ?
+			MemoryContextAlloc(ti->ssup.ssup_cxt, ti->srcbufsize) :
+			repalloc(ti->srcbuf, ti->srcbufsize);
+	}
+	memcpy(ti->srcbuf, data, len);
+	ti->srcbuf[len] = '\0';
+#endif
+	for (;;)
+	{
+#if PG_VERSION_NUM >= 160000
+		keylen = pg_strnxfrm(ti->keybuf, ti->keybufsize, data, len, ti->locale);
+#else
+		keylen = (NULL == ti->locale) ?
+			strxfrm(ti->keybuf, ti->srcbuf, ti->keybufsize) :
+			strxfrm_l(ti->keybuf, ti->srcbuf, ti->keybufsize, ti->locale->info.lt);
+#endif
+		if (keylen < ti->keybufsize)
+		{
+			return keylen;
+		}
+		ti->keybufsize = Max(keylen + 1, 2 * ti->keybufsize);
+		ti->keybuf = (NULL == ti->keybuf) ?
+			MemoryContextAlloc(ti->ssup.ssup_cxt, ti->keybufsize) :
+			repalloc(ti->keybuf, ti->keybufsize);
+	}
+}
+
+/* The first bytes of the sort key, as a (unsigned, comparable) `Datum` */
+static inline Datum
+sort_key_prefix(char const *key, size_t keylen)
+{
+	Datum		res = 0;
+
+	memcpy(&res, key, Min(keylen, sizeof res));
+#ifndef WORDS_BIGENDIAN
+	res = pg_bswap64(res);
+#endif
+	return res;
+}
+
+static struct MedianText
+sort_key_text(struct MedianState *pms, char const *data, uint32 len)
+{
+	struct MedianTypeInfo *ti = pms->ti;
+	size_t const keylen = make_sort_key(ti, data, len);
+	struct MedianText x;
+
+	x.ptr = median_arena_store(pms, data, len, ti->keybuf, keylen);
+	x.len = len;
+	x.key = sort_key_prefix(ti->keybuf, keylen);
+	MEDIAN_STAT(pms, sort_keys, 1);
+
+	return x;
+}
+
+static struct MedianText
+sort_key_from_datum(struct MedianState *pms, Datum d)
+{
+	text	   *t = DatumGetTextPP(d);
+
+	if (unlikely(pms->arena->dead > Max(pms->arena->live, MEDIAN_MAX_CHUNK_SIZE)))
+	{
+		median_arena_compact(pms);
+	}
+	return sort_key_text(pms, VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t));
+}
+
+/* The argument, with its sort key, in a short-lived memory context */
+static struct MedianText
+sort_key_peek(struct MedianState *pms, Datum d)
+{
+	struct MedianTypeInfo *ti = pms->ti;
+	text	   *t = DatumGetTextPP(d);
+	uint32 const len = VARSIZE_ANY_EXHDR(t);
+	size_t const keylen = make_sort_key(ti, VARDATA_ANY(t), len);
+	struct MedianText x;
+
+	x.ptr = palloc(VARHDRSZ + len + keylen);
+	SET_VARSIZE(x.ptr, VARHDRSZ + len + keylen);
+	memcpy(VARDATA(x.ptr), VARDATA_ANY(t), len);
+	memcpy(VARDATA(x.ptr) + len, ti->keybuf, keylen);
+	x.len = len;
+	x.key = sort_key_prefix(ti->keybuf, keylen);
+	MEDIAN_STAT(pms, sort_keys, 1);
+
+	return x;
+}
+
+/*
+ * Compares by the sort keys and then, if the collation is deterministic, by
+ * the strings themselves, like `varstr_cmp()` does.
+ */
+static inline int
+sort_key_cmp(struct MedianText a, struct MedianText b, struct MedianTypeInfo *ti)
+{
+	char const *pa;
+	char const *pb;
+	size_t		la;
+	size_t		lb;
+	int			c;
+
+	if (a.key != b.key)
+	{
+		return (a.key > b.key) ? 1 : -1;
+	}
+	pa = VARDATA_ANY(a.ptr);
+	pb = VARDATA_ANY(b.ptr);
+	la = VARSIZE_ANY_EXHDR(a.ptr) - a.len;
+	lb = VARSIZE_ANY_EXHDR(b.ptr) - b.len;
+	c = memcmp(pa + a.len, pb + b.len, Min(la, lb));
+	if (c == 0)
+	{
+		c = (la > lb) - (la < lb);
+	}
+	if ((c == 0) && ti->deterministic)
+	{
+		c = memcmp(pa, pb, Min(a.len, b.len));
+		if (c == 0)
+		{
+			c = (a.len > b.len) - (a.len < b.len);
+		}
+	}
+	return c;
+}
+
+static inline int
+datum_cmp(struct MedianDatum a, struct MedianDatum b, SortSupport ssup)
+{
+	int			c = ssup->comparator(a.key, b.key, ssup);
+
+	if ((c == 0) && (NULL != ssup->abbrev_converter))
+	{
+		c = ssup->abbrev_full_comparator(a.val, b.val, ssup);
+	}
+	return c;
+}
+
+/*
+ * The element for the value `d`. Varlena values are detoasted, so that
+ * comparisons don't detoast them again and again. If `copy`, the value is
+ * copied to the context of the state. The abbreviated key is always made
+ * by the sort support of `pms`, as keys made by different sort supports
+ * are not to be compared.
+ */
+static inline struct MedianDatum
+make_datum(struct MedianState *pms, Datum d, bool copy)
+{
+	struct MedianTypeInfo *ti = pms->ti;
+	struct MedianDatum x;
+
+	if (!ti->typbyval)
+	{
+		MemoryContext old = MemoryContextSwitchTo(copy ? pms->ctx : CurrentMemoryContext);
+
+		if (ti->typlen == -1)
+		{
+			struct varlena *v = PG_DETOAST_DATUM(d);
+
+			d = (copy && (PointerGetDatum(v) == d)) ? datumCopy(d, false, -1) : PointerGetDatum(v);
+		}
+		else if (copy)
+		{
+			d = datumCopy(d, false, ti->typlen);
+		}
+		MemoryContextSwitchTo(old);
+		if (copy)
+		{
+			pms->datamem += datumGetSize(d, false, ti->typlen);
+		}
+	}
+	x.val = d;
+	x.key = (NULL != ti->ssup.abbrev_converter) ? ti->ssup.abbrev_converter(d, &ti->ssup) : d;
+
+	return x;
+}
+
+static inline void
+free_datum(struct MedianDatum x, struct MedianState *pms)
+{
+	if (!pms->ti->typbyval)
+	{
+		pms->datamem -= datumGetSize(x.val, false, pms->ti->typlen);
+		pfree(DatumGetPointer(x.val));
+	}
+}
+
+/*
+ * Generic values are serialized as they are in memory (with the length
+ * first, for by-reference types), as the other side is the same server
+ * (the deserialfn takes `internal`, so only the executor calls it). The
+ * abbreviated keys are not, as they are made again on the other side.
+ * The lengths are still checked, against the type and the value.
+ */
+static void
+send_datum_array(StringInfo buf, struct MedianDatum const *v, size_t n, struct MedianState *pms)
+{
+	struct MedianTypeInfo *ti = pms->ti;
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		if (ti->typbyval)
+		{
+			pq_sendint64(buf, v[i].val);
+		}
+		else
+		{
+			int const	len = datumGetSize(v[i].val, false, ti->typlen);
+
+			pq_sendint32(buf, len);
+			pq_sendbytes(buf, DatumGetPointer(v[i].val), len);
+		}
+	}
+}
+
+static void
+recv_datum_array(StringInfo buf, struct MedianDatum *v, size_t n, struct MedianState *pms)
+{
+	struct MedianTypeInfo *ti = pms->ti;
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		Datum		d;
+
+		if (ti->typbyval)
+		{
+			d = (Datum) pq_getmsgint64(buf);
+		}
+		else
+		{
+			int const	len = pq_getmsgint(buf, 4);
+			char const *data = pq_getmsgbytes(buf, len);
+			void	   *p;
+			bool		valid;
+
+			if (ti->typlen > 0)
+			{
+				valid = (len == ti->typlen);
+			}
+			else if (ti->typlen == -2)
+			{
+				valid = (len > 0) && (memchr(data, '\0', len) == data + len - 1);
+			}
+			else
+			{
+				valid = (len >= VARHDRSZ_SHORT) && (VARATT_IS_1B(data) || (len >= VARHDRSZ)) &&
+					(VARSIZE_ANY(data) == len);
+			}
+			if (!valid)
+			{
+				elog(ERROR, "invalid median state value of %d bytes", len);
+				return;
+			}
+			p = MemoryContextAlloc(pms->ctx, len);
+			memcpy(p, data, len);
+			d = PointerGetDatum(p);
+			pms->datamem += len;
+		}
+		v[i] = make_datum(pms, d, false);
+	}
+}
+
+/*
+ * Generic values of a `median_sketch` are encoded by the binary send
+ * function of their type, with the length first, and decoded by its
+ * receive function, which checks them, as they may come from the outside.
+ */
+static void
+write_datum_array(StringInfo buf, struct MedianDatum const *v, size_t n, struct MedianState *pms)
+{
+	Oid			typsend;
+	bool		isvarlena;
+	FmgrInfo	flinfo;
+	size_t		i;
+
+	getTypeBinaryOutputInfo(pms->ti->typid, &typsend, &isvarlena);
+	fmgr_info(typsend, &flinfo);
+	for (i = 0; i < n; ++i)
+	{
+		bytea	   *b = SendFunctionCall(&flinfo, v[i].val);
+
+		pq_sendint32(buf, VARSIZE(b) - VARHDRSZ);
+		pq_sendbytes(buf, VARDATA(b), VARSIZE(b) - VARHDRSZ);
+		pfree(b);
+	}
+}
+
+static void
+read_datum_array(StringInfo buf, struct MedianDatum *v, size_t n, struct MedianState *pms)
+{
+	Oid			typreceive;
+	Oid			typioparam;
+	FmgrInfo	flinfo;
+	StringInfoData elem;
+	size_t		i;
+
+	getTypeBinaryInputInfo(pms->ti->typid, &typreceive, &typioparam);
+	fmgr_info(typreceive, &flinfo);
+	initStringInfo(&elem);
+	for (i = 0; i < n; ++i)
+	{
+		int const	len = pq_getmsgint(buf, 4);
+		Datum		d;
+
+		/* a copy, as receive functions may expect it to end with a '\0' */
+		resetStringInfo(&elem);
+		appendBinaryStringInfo(&elem, pq_getmsgbytes(buf, len), len);
+		d = ReceiveFunctionCall(&flinfo, &elem, typioparam, -1);
+		if (elem.cursor != elem.len)
+		{
+			elog(ERROR, "invalid median_sketch value of type %s", format_type_be(pms->ti->typid));
+			return;
+		}
+		v[i] = make_datum(pms, d, true);
+	}
+	pfree(elem.data);
+}
+
+static inline void
+spill_register(FunctionCallInfo fcinfo, struct MedianState *pms)
+{
+	if (unlikely((NULL != pms->spill) && (NULL != pms->spill->file)) && !pms->spill->registered)
+	{
+		AggRegisterCallback(fcinfo, median_spill_shutdown, PointerGetDatum(pms));
+		pms->spill->registered = true;
+	}
+}
+
+/* Adds the staged values to the state, which is to be done before any use */
+static void
+stage_flush(FunctionCallInfo fcinfo, struct MedianState *pms)
+{
+	if (pms->stage.n > 0)
+	{
+		pms->ti->ops->add_batch[pms->engine] (pms, pms->stage.d, pms->stage.n);
+		pms->stage.n = 0;
+		spill_register(fcinfo, pms);
+	}
+}
+
+/*
+ * Adds the value `d` to the state, staging it if the state has a stage,
+ * and giving it one if it has enough elements to be worth it. Moving
+ * states aren't staged, as their values are removed as well as added,
+ * and their counts may turn into a tree, which has no batch to add to.
+ */
+static inline struct MedianState *
+stage_add(FunctionCallInfo fcinfo, struct MedianState *pms, Datum d)
+{
+	if (NULL != pms->stage.d)
+	{
+		pms->stage.d[pms->stage.n++] = d;
+		if (pms->stage.n == MEDIAN_STAGE_CAP)
+		{
+			stage_flush(fcinfo, pms);
+		}
+		return pms;
+	}
+	pms = pms->add(pms, d);
+	spill_register(fcinfo, pms);
+	if (unlikely(pms->dim == MEDIAN_STAGE_CAP) && pms->ti->typbyval &&
+		((NULL == pms->counts) || !pms->counts->moving) &&
+		(NULL != pms->ti->ops->add_batch[pms->engine]))
+	{
+		pms->stage.d = MemoryContextAlloc(pms->ctx, MEDIAN_STAGE_CAP * sizeof(Datum));
+	}
+	return pms;
+}
+
+#define MT_PREFIX median_text
+#define MT_ELEM struct MedianText
+#define MT_FIELD t
+#define MT_CMP(a, b, pms) (MEDIAN_STAT_CMP(pms), text_cmp((a), (b), &(pms)->ti->ssup))
+#define MT_COPY(x, pms) arena_text((pms), VARDATA_ANY((x).ptr), (x).len)
+#define MT_FREE(x, pms) text_release((x), (pms))
+#define MT_FROM_DATUM(d, pms) text_from_datum((pms), (d))
+#define MT_PEEK_DATUM(d, pms) text_peek((pms), (d))
+#define MT_TO_DATUM(x, pms) PointerGetDatum((x).ptr)
+#define MT_SEND_ARRAY(buf, v, n, pms) send_text_array((buf), (v), (n))
+#define MT_RECV_ARRAY(buf, v, n, pms) recv_text_array((buf), (v), (n), (pms), arena_text)
+#define MT_WRITE_ARRAY(buf, v, n, pms) send_text_array((buf), (v), (n))
+#define MT_READ_ARRAY(buf, v, n, pms) read_text_array((buf), (v), (n), (pms), arena_text)
+#include "median_template.h"
+
+#define MT_PREFIX median_sort_key
+#define MT_ELEM struct MedianText
+#define MT_FIELD t
+#define MT_CMP(a, b, pms) (MEDIAN_STAT_CMP(pms), sort_key_cmp((a), (b), (pms)->ti))
+#define MT_COPY(x, pms) sort_key_text((pms), VARDATA_ANY((x).ptr), (x).len)
+#define MT_FREE(x, pms) text_release((x), (pms))
+#define MT_FROM_DATUM(d, pms) sort_key_from_datum((pms), (d))
+#define MT_PEEK_DATUM(d, pms) sort_key_peek((pms), (d))
+/* the sort key follows the string, so the result is a copy */
+#define MT_TO_DATUM(x, pms) PointerGetDatum(cstring_to_text_with_len(VARDATA_ANY((x).ptr), (x).len))
+#define MT_SEND_ARRAY(buf, v, n, pms) send_text_array((buf), (v), (n))
+#define MT_RECV_ARRAY(buf, v, n, pms) recv_text_array((buf), (v), (n), (pms), sort_key_text)
+#define MT_WRITE_ARRAY(buf, v, n, pms) send_text_array((buf), (v), (n))
+#define MT_READ_ARRAY(buf, v, n, pms) read_text_array((buf), (v), (n), (pms), sort_key_text)
+#include "median_template.h"
+
+#define MT_PREFIX median_generic
+#define MT_ELEM struct MedianDatum
+#define MT_FIELD d
+#define MT_CMP(a, b, pms) (MEDIAN_STAT_CMP(pms), datum_cmp((a), (b), &(pms)->ti->ssup))
+#define MT_COPY(x, pms) make_datum((pms), (x).val, true)
+#define MT_FREE(x, pms) free_datum((x), (pms))
+/* the argument is in a short-lived memory context, so we copy it */
+#define MT_FROM_DATUM(d, pms) make_datum((pms), (d), true)
+#define MT_PEEK_DATUM(d, pms) make_datum((pms), (d), false)
+#define MT_TO_DATUM(x, pms) ((x).val)
+#define MT_SEND_ARRAY(buf, v, n, pms) send_datum_array((buf), (v), (n), (pms))
+#define MT_RECV_ARRAY(buf, v, n, pms) recv_datum_array((buf), (v), (n), (pms))
+#define MT_WRITE_ARRAY(buf, v, n, pms) write_datum_array((buf), (v), (n), (pms))
+#define MT_READ_ARRAY(buf, v, n, pms) read_datum_array((buf), (v), (n), (pms))
+#include "median_template.h"
+
+
+static enum ValueClass
+value_class_of(Oid typ)
+{
+	switch (typ)
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case DATEOID:
+		case TIMEOID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+		case CASHOID:
+			return vcNumeral;
+		case FLOAT4OID:
+		case FLOAT8OID:
+			return vcFloat;
+		case TEXTOID:
+		case VARCHAROID:
+			return vcText;
+		default:
+			return vcGeneric;
+	}
+}
+
+/*
+ * The type info for `typid` (and `collation`), cached in the `fn_extra` of
+ * `flinfo`.
+ */
+static struct MedianTypeInfo *
+median_type_info(FmgrInfo *flinfo, Oid typid, Oid collation)
+{
+	struct MedianTypeInfo *ti = flinfo->fn_extra;
+
+	if ((NULL == ti) || (ti->typid != typid) || (ti->collation != collation))
+	{
+		ti = MemoryContextAllocZero(flinfo->fn_mcxt, sizeof *ti);
+		ti->typid = typid;
+		ti->collation = collation;
+		get_typlenbyvalalign(typid, &ti->typlen, &ti->typbyval, &ti->typalign);
+		ti->valclass = value_class_of(typid);
+		switch (ti->valclass)
+		{
+			case vcNumeral:
+				ti->ops = &median_numeral_ops;
+				ti->shift = 64 - 8 * ti->typlen;
+				break;
+			case vcFloat:
+				ti->ops = &median_float_ops;
+				break;
+			case vcText:
+			case vcGeneric:
+				{
+					TypeCacheEntry *tce = lookup_type_cache(typid, TYPECACHE_LT_OPR);
+
+					if (!OidIsValid(tce->lt_opr))
+					{
+						elog(ERROR, "parameter type oid=%u not supported", typid);
+						return NULL;
+					}
+					ti->ssup.ssup_cxt = flinfo->fn_mcxt;
+					if ((ti->valclass == vcText) && setup_sort_keys(ti))
+					{
+						ti->ops = &median_sort_key_ops;
+					}
+					else
+					{
+						ti->ops = (ti->valclass == vcText) ? &median_text_ops : &median_generic_ops;
+						ti->ssup.ssup_collation = collation;
+						ti->ssup.ssup_nulls_first = false;
+						ti->ssup.abbreviate = true;
+						PrepareSortSupportFromOrderingOp(tce->lt_opr, &ti->ssup);
+					}
+				}
+				break;
+		}
+		flinfo->fn_extra = ti;
+	}
+	return ti;
+}
+
+/*
+ * The engine of a new state, `engine`, unless `median.engine` forces one
+ * that can do what it's for: remove values, for a moving-aggregate one, or
+ * be combined and serialized, otherwise. A sketch, or a heap, is
+ * never replaced.
+ */
+static enum MedianEngine
+pick_engine(enum MedianEngine engine)
+{
+	bool const	moving = (engine >= meTree);
+
+	if ((median_engine < 0) || (engine == meSketch) || (engine == meHeap))
+	{
+		return engine;
+	}
+	switch ((enum MedianEngine) median_engine)
+	{
+		case meCounts:
+			return meCounts;
+		case meTree:
+		case meFlat:
+			return moving ? (enum MedianEngine) median_engine : engine;
+		default:
+			return moving ? engine : (enum MedianEngine) median_engine;
+	}
+}
+
+/*
+ * A new state, for the first (non NULL) value of the second argument, of
+ * `engine` (unless `median.engine` forces another). For `meSketch`, the
+ * (optional) third argument is the accuracy.
+ */
+static struct MedianState *
+new_state(FunctionCallInfo fcinfo, MemoryContext agg_context, enum MedianEngine engine)
+{
+	struct MedianTypeInfo *ti = fcinfo->flinfo->fn_extra;
+	struct MedianState *state;
+
+	if (NULL == ti)
+	{
+		ti = median_type_info(fcinfo->flinfo,
+							  get_fn_expr_argtype(fcinfo->flinfo, 1),
+							  PG_GET_COLLATION());
+	}
+	state = create_MedianState(agg_context, ti, pick_engine(engine));
+	if (state->engine == meCounts)
+	{
+		state->counts->moving = (engine >= meTree);
+	}
+	if ((engine == meSketch) && (PG_NARGS() > 2) && !PG_ARGISNULL(2))
+	{
+		median_sketch_set_k(state, median_sketch_k(PG_GETARG_FLOAT8(2)));
+	}
+	return state;
+}
+
+/*
+ * The common part of the transfer functions, `engine` being the one to use
+ * for a new state (see `new_state`), of whose extra arguments only the
+ * first ones matter.
+ */
+static Datum
+median_transfn_common(FunctionCallInfo fcinfo, MemoryContext agg_context, enum MedianEngine engine)
+{
+	struct MedianState *state;
+
+	if (PG_ARGISNULL(0))
+	{
+		state = NULL;			/* first element */
+	}
+	else
+	{
+		state = (struct MedianState *) PG_GETARG_POINTER(0);
+	}
+	if (PG_ARGISNULL(1))
+	{
+		/* discard NULL input values */
+	}
+	else
+	{
+		if (NULL == state)
+		{
+			state = new_state(fcinfo, agg_context, engine);
+		}
+		state = stage_add(fcinfo, state, PG_GETARG_DATUM(1));
+		MEDIAN_STAT(state, rows, 1);
+	}
+
+	if (state == NULL)
+	{
+		PG_RETURN_NULL();
+	}
+	else
+	{
+		PG_RETURN_POINTER(state);
+	}
+}
+
+PG_FUNCTION_INFO_V1(median_transfn);
+
+/*
+ * Median state transfer function.
+ *
+ * This function is called for every value in the set that we are calculating
+ * the median for. On first call, the aggregate state, if any, needs to be
+ * initialized.
+ *
+ * It's also used for a window whose frame only grows (which PostgreSQL
+ * doesn't run as a moving-aggregate), so we keep the data sorted, as the
+ * finalfn is called for every row, which finds the median a step from the
+ * one of the previous row (see `mid` in `struct MedianState`). Otherwise,
+ * values are just appended and the finalfn selects the median.
+ */
+Datum
+median_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	int			agg_kind = AggCheckCallContext(fcinfo, &agg_context);
+
+	if (!agg_kind)
+	{
+		elog(ERROR, "median_transfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	return median_transfn_common(fcinfo, agg_context,
+								 (agg_kind == AGG_CONTEXT_WINDOW) ? meSorted : meAppend);
+}
+
+
+PG_FUNCTION_INFO_V1(median_mtransfn);
+
+/*
+ * Median moving-aggregate state transfer function.
+ *
+ * Same as `median_transfn`, but keeps the data in an order-statistic tree,
+ * so that values can also be removed (by the inverse transfer function),
+ * in O(log n). Though, a new state starts as a flat sorted array, which is
+ * faster for small windows, and is switched to a tree once the window
+ * turns out not to be small.
+ */
+Datum
+median_mtransfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+	{
+		elog(ERROR, "median_mtransfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	return median_transfn_common(fcinfo, agg_context,
+								 (median_small_window_threshold > 0) ? meFlat : meTree);
+}
+
+
+PG_FUNCTION_INFO_V1(approx_median_transfn);
+
+/*
+ * Approximate median state transfer function.
+ *
+ * Adds values to a KLL sketch, so that memory is bounded by the accuracy,
+ * not the number of values, and the finalfn gives an element whose rank is
+ * within the accuracy from the middle. It's not a moving aggregate, as
+ * values can't be removed from a sketch.
+ */
+Datum
+approx_median_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+	{
+		elog(ERROR, "approx_median_transfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	return median_transfn_common(fcinfo, agg_context, meSketch);
+}
+
+
+/* Sets the `quantiles` fractions of the state to a copy of `a` */
+static void
+set_fractions(struct MedianState *pms, ArrayType *a)
+{
+	pms->fractions = MemoryContextAlloc(pms->ctx, VARSIZE(a));
+	memcpy(pms->fractions, a, VARSIZE(a));
+}
+
+PG_FUNCTION_INFO_V1(quantiles_transfn);
+
+/*
+ * Quantiles state transfer function.
+ *
+ * The state is the same as for the median, with the fractions of the
+ * quantiles kept in it, as the finalfn doesn't get them. Like for
+ * `percentile_disc`, only the ones given with the first value count.
+ */
+Datum
+quantiles_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	int			agg_kind = AggCheckCallContext(fcinfo, &agg_context);
+	Datum		result;
+
+	if (!agg_kind)
+	{
+		elog(ERROR, "quantiles_transfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	result = median_transfn_common(fcinfo, agg_context,
+								   (agg_kind == AGG_CONTEXT_WINDOW) ? meSorted : meAppend);
+	if (!fcinfo->isnull && !PG_ARGISNULL(2))
+	{
+		struct MedianState *state = (struct MedianState *) DatumGetPointer(result);
+
+		if (NULL == state->fractions)
+		{
+			set_fractions(state, PG_GETARG_ARRAYTYPE_P(2));
+		}
+	}
+
+	return result;
+}
+
+
+/*
+ * The common part of the `kth_smallest` and `kth_largest` (and `top_k`)
+ * transfer functions, whose state is a heap (`meHeap`) of the `k` (the
+ * third argument, of the first value) smallest, or `largest`, values.
+ */
+static Datum
+heap_transfn_common(FunctionCallInfo fcinfo, bool largest)
+{
+	MemoryContext agg_context;
+	struct MedianState *state;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+	{
+		elog(ERROR, "heap_transfn_common called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	state = PG_ARGISNULL(0) ? NULL : (struct MedianState *) PG_GETARG_POINTER(0);
+	if (PG_ARGISNULL(1))
+	{
+		if (NULL == state)
+		{
+			PG_RETURN_NULL();
+		}
+		PG_RETURN_POINTER(state);
+	}
+	if (NULL == state)
+	{
+		if (PG_ARGISNULL(2) || (PG_GETARG_INT32(2) < 1))
+		{
+			elog(ERROR, "k is not a positive number");
+			PG_RETURN_NULL();
+		}
+		state = new_state(fcinfo, agg_context, meHeap);
+		state->heap.k = PG_GETARG_INT32(2);
+		state->heap.largest = largest;
+	}
+	state = stage_add(fcinfo, state, PG_GETARG_DATUM(1));
+	MEDIAN_STAT(state, rows, 1);
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(kth_smallest_transfn);
+
+/* The state transfer function of `kth_smallest` */
+Datum
+kth_smallest_transfn(PG_FUNCTION_ARGS)
+{
+	return heap_transfn_common(fcinfo, false);
+}
+
+PG_FUNCTION_INFO_V1(kth_largest_transfn);
+
+/* The state transfer function of `kth_largest` and `top_k` */
+Datum
+kth_largest_transfn(PG_FUNCTION_ARGS)
+{
+	return heap_transfn_common(fcinfo, true);
+}
+
+PG_FUNCTION_INFO_V1(median_inv_transfn);
+
+/*
+ * Median inverse state transfer function.
+ *
+ * This function is called for "moving average" (window) aggregate and is
+ * designed to "remove a value from aggregate calculation". Values are
+ * removed only after they were added, so there is always a state, with
+ * the order-statistic tree (or the flat sorted array).
+ *
+ */
+Datum
+median_inv_transfn(PG_FUNCTION_ARGS)
+{
+	struct MedianState *state;
+
+	MemoryContext agg_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+	{
+		elog(ERROR, "median_inv_transfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	if (PG_ARGISNULL(0))
+	{
+		elog(ERROR, "median_inv_transfn called without a state");
+		PG_RETURN_NULL();
+	}
+	state = (struct MedianState *) PG_GETARG_POINTER(0);
+	Assert((state->engine == meTree) || (state->engine == meFlat) || (state->engine == meCounts));
+	if (PG_ARGISNULL(1))
+	{
+		/*
+		 * discard NULL input values, as the transfer function did.
+		 */
+	}
+	else if (!state->ti->ops->remove[state->engine](state, PG_GETARG_DATUM(1)))
+	{
+		elog(ERROR, "median_inv_transfn() value to remove not found");
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+
+/* Adds the stats `b` to `a` */
+static void
+stats_add(struct MedianStats *a, struct MedianStats const *b)
+{
+	a->results += b->results;
+	a->rows += b->rows;
+	a->comparisons += b->comparisons;
+	a->moved += b->moved;
+	a->reallocs += b->reallocs;
+	a->peak = Max(a->peak, b->peak);
+	a->switches += b->switches;
+	a->spill_runs += b->spill_runs;
+	a->sort_keys += b->sort_keys;
+	INSTR_TIME_ADD(a->select_time, b->select_time);
+}
+
+/*
+ * Counts a result of the state, found from `start` on, reports its stats
+ * at DEBUG1, and adds them to the totals of the backend. They are then
+ * reset (but for the peak), as a window gives a result for every row, so
+ * each report is of the work done since the previous one.
+ */
+static void
+stats_report(struct MedianState *pms, instr_time start)
+{
+	struct MedianStats *st = MEDIAN_PART(pms, stats);
+	instr_time	end;
+	uint64		peak;
+
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(st->select_time, end, start);
+	++st->results;
+	st->peak = Max(st->peak, median_state_size(pms));
+	elog(DEBUG1, "median of %s (%s): " UINT64_FORMAT " values (%zu now), "
+		 UINT64_FORMAT " comparisons, " UINT64_FORMAT " bytes moved, "
+		 UINT64_FORMAT " reallocations, " UINT64_FORMAT " bytes at peak, "
+		 UINT64_FORMAT " engine switches, " UINT64_FORMAT " spilled runs, "
+		 UINT64_FORMAT " sort keys, %.3f ms to select",
+		 format_type_be(pms->ti->typid), median_engine_names[pms->engine],
+		 st->rows, state_count(pms), st->comparisons, st->moved,
+		 st->reallocs, st->peak, st->switches, st->spill_runs, st->sort_keys,
+		 INSTR_TIME_GET_MILLISEC(st->select_time));
+	stats_add(&median_stats_total, st);
+	peak = st->peak;
+	memset(st, 0, sizeof *st);
+	st->peak = peak;
+}
+
+PG_FUNCTION_INFO_V1(median_finalfn);
+
+/*
+ * Median final function.
+ *
+ * This function is called after all values in the median set has been
+ * processed by the state transfer function(s). It should perform any
+ * necessary post processing and clean up any temporary state.
+ *
+ * For a window, the data is sorted, so it only needs to walk the page
+ * directory, or the order-statistic tree, to find the middle element.
+ * Otherwise, the data was not sorted while inserting and we use "Intro
+ * Select" (see `median_template.h`) to find the middle element, in linear
+ * time, even in the worst case. This reorders elements in the buffer, but
+ * that doesn't change the state, as far as the transfn (or another call of
+ * the finalfn) is concerned. For a sketch, the levels are merged, by their
+ * weights, up to the middle one.
+ *
+ * It's used as the moving-aggregate final function, too, and for
+ * `approx_median`.
+ */
+Datum
+median_finalfn(PG_FUNCTION_ARGS)
+{
+	struct MedianState *state;
+	MemoryContext agg_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+	{
+		elog(ERROR, "median_finalfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+
+	if (PG_ARGISNULL(0))
+	{
+		state = NULL;			/* had no elements! */
+	}
+	else
+	{
+		state = (struct MedianState *) PG_GETARG_POINTER(0);
+	}
+	if (NULL == state)
+	{
+		PG_RETURN_NULL();
+	}
+	else
+	{
+		size_t		n;
+
+		stage_flush(fcinfo, state);
+		n = state_count(state);
+		if (n > 0)
+		{
+			instr_time	start;
+			Datum		result;
+
+			INSTR_TIME_SET_ZERO(start);
+			if (unlikely(median_track_stats))
+			{
+				INSTR_TIME_SET_CURRENT(start);
+			}
+			result = state->ti->ops->rank(state, n / 2);
+			if (unlikely(median_track_stats))
+			{
+				stats_report(state, start);
+			}
+			PG_RETURN_DATUM(result);
+		}
+
+		PG_RETURN_NULL();
+	}
+}
+
+static int
+size_cmp(void const *a, void const *b)
+{
+	size_t const x = *(size_t const *) a;
+	size_t const y = *(size_t const *) b;
+
+	return (x > y) - (x < y);
+}
+
+PG_FUNCTION_INFO_V1(quantiles_finalfn);
+
+/*
+ * Quantiles final function.
+ *
+ * The quantile of a fraction p is the value at position ceil(p * n), as
+ * for `percentile_disc`, so for 0.5 and an even number of values, it's
+ * the lower of the middle two (where `median` gives the upper one). All
+ * the positions are got at once, from the state, which, for an aggregate,
+ * is a multi-select in the unsorted buffer. The result has the shape of
+ * the array of fractions, with NULL for a NULL fraction.
+ */
+Datum
+quantiles_finalfn(PG_FUNCTION_ARGS)
+{
+	struct MedianState *state;
+	struct MedianTypeInfo *ti;
+	size_t		n;
+	Datum	   *fracs;
+	bool	   *nulls;
+	int			nfracs;
+	size_t	   *pos;
+	size_t	   *ranks;
+	size_t		nranks = 0;
+	Datum	   *values;
+	Datum	   *result;
+	int			i;
+	instr_time	start;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		elog(ERROR, "quantiles_finalfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	state = (struct MedianState *) PG_GETARG_POINTER(0);
+	stage_flush(fcinfo, state);
+	n = state_count(state);
+	if ((NULL == state->fractions) || (n == 0))
+	{
+		PG_RETURN_NULL();
+	}
+	ti = state->ti;
+	deconstruct_array(state->fractions, FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL, 'd',
+					  &fracs, &nulls, &nfracs);
+	pos = palloc(Max(nfracs, 1) * sizeof *pos);
+	ranks = palloc(Max(nfracs, 1) * sizeof *ranks);
+	for (i = 0; i < nfracs; ++i)
+	{
+		float8 const p = DatumGetFloat8(fracs[i]);
+
+		if (nulls[i])
+		{
+			continue;
+		}
+		if (!(p >= 0) || (p > 1))
+		{
+			elog(ERROR, "quantile fraction %g is not between 0 and 1", p);
+			PG_RETURN_NULL();
+		}
+		pos[i] = (size_t) ceil(p * n);
+		pos[i] = (pos[i] > 0) ? Min(pos[i], n) - 1 : 0;
+		ranks[nranks++] = pos[i];
+	}
+	if (nranks > 0)
+	{
+		size_t		j = 0;
+		size_t		k;
+
+		qsort(ranks, nranks, sizeof ranks[0], size_cmp);
+		for (k = 1; k < nranks; ++k)
+		{
+			if (ranks[k] != ranks[j])
+			{
+				ranks[++j] = ranks[k];
+			}
+		}
+		nranks = j + 1;
+	}
+	values = palloc(Max(nranks, 1) * sizeof *values);
+	INSTR_TIME_SET_ZERO(start);
+	if (unlikely(median_track_stats))
+	{
+		INSTR_TIME_SET_CURRENT(start);
+	}
+	ti->ops->ranks(state, ranks, nranks, values);
+	if (unlikely(median_track_stats))
+	{
+		stats_report(state, start);
+	}
+	result = palloc(Max(nfracs, 1) * sizeof *result);
+	for (i = 0; i < nfracs; ++i)
+	{
+		if (!nulls[i])
+		{
+			size_t	   *at = bsearch(&pos[i], ranks, nranks, sizeof ranks[0], size_cmp);
+
+			result[i] = values[at - ranks];
+		}
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(result, nulls,
+											 ARR_NDIM(state->fractions),
+											 ARR_DIMS(state->fractions),
+											 ARR_LBOUND(state->fractions),
+											 ti->typid, ti->typlen, ti->typbyval, ti->typalign));
+}
+
+PG_FUNCTION_INFO_V1(kth_finalfn);
+
+/*
+ * The final function of `kth_smallest` and `kth_largest`: the root of the
+ * heap, once it has `k` values, or NULL if there were fewer.
+ */
+Datum
+kth_finalfn(PG_FUNCTION_ARGS)
+{
+	struct MedianState *state;
+	Datum		result;
+	instr_time	start;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		elog(ERROR, "kth_finalfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	state = (struct MedianState *) PG_GETARG_POINTER(0);
+	if (state->dim < state->heap.k)
+	{
+		PG_RETURN_NULL();
+	}
+	INSTR_TIME_SET_ZERO(start);
+	if (unlikely(median_track_stats))
+	{
+		INSTR_TIME_SET_CURRENT(start);
+	}
+	result = state->ti->ops->rank(state, state->heap.largest ? 0 : state->dim - 1);
+	if (unlikely(median_track_stats))
+	{
+		stats_report(state, start);
+	}
+
+	PG_RETURN_DATUM(result);
+}
+
+PG_FUNCTION_INFO_V1(top_k_finalfn);
+
+/*
+ * The final function of `top_k`: the array of the (up to) `k` largest
+ * values, from the largest one down.
+ */
+Datum
+top_k_finalfn(PG_FUNCTION_ARGS)
+{
+	struct MedianState *state;
+	struct MedianTypeInfo *ti;
+	size_t	   *ranks;
+	Datum	   *values;
+	Datum	   *result;
+	int			dims[1];
+	int			lbs[1] = {1};
+	size_t		i;
+	instr_time	start;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		elog(ERROR, "top_k_finalfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	state = (struct MedianState *) PG_GETARG_POINTER(0);
+	ti = state->ti;
+	ranks = palloc(Max(state->dim, 1) * sizeof *ranks);
+	values = palloc(Max(state->dim, 1) * sizeof *values);
+	result = palloc(Max(state->dim, 1) * sizeof *result);
+	for (i = 0; i < state->dim; ++i)
+	{
+		ranks[i] = i;
+	}
+	INSTR_TIME_SET_ZERO(start);
+	if (unlikely(median_track_stats))
+	{
+		INSTR_TIME_SET_CURRENT(start);
+	}
+	ti->ops->ranks(state, ranks, state->dim, values);
+	if (unlikely(median_track_stats))
+	{
+		stats_report(state, start);
+	}
+	for (i = 0; i < state->dim; ++i)
+	{
+		result[i] = values[state->dim - 1 - i];
+	}
+	dims[0] = state->dim;
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(result, NULL, 1, dims, lbs,
+											 ti->typid, ti->typlen, ti->typbyval, ti->typalign));
+}
+
+/**
+ * The state of `median_os`, an ordered-set aggregate: the values are
+ * sorted by a tuplesort of the executor (which spills to disk, and uses
+ * abbreviated keys), by the `ORDER BY` of the aggregate.
+ */
+struct MedianOsState
+{
+	Tuplesortstate *sort;
+	/** Number of (non NULL) values put into the sort */
+	int64		n;
+	/** Whether the sort was done (by an earlier call of the final function) */
+	bool		sorted;
+	/** Whether the state is shared by aggregates, so the sort is to be
+	    read more than once */
+	bool		rescan;
+};
+
+/* The sort (and its temporary files) ends when the aggregate context is reset */
+static void
+median_os_shutdown(Datum arg)
+{
+	struct MedianOsState *state = (struct MedianOsState *) DatumGetPointer(arg);
+
+	if (NULL != state->sort)
+	{
+		tuplesort_end(state->sort);
+		state->sort = NULL;
+	}
+}
+
+PG_FUNCTION_INFO_V1(median_os_transfn);
+
+/*
+ * Ordered-set median state transfer function.
+ *
+ * Puts the (non NULL) values into a tuplesort, which is made, on the
+ * first value of the group, by the sort operator, and the placement of
+ * NULLs, of the `ORDER BY` of the aggregate, as `percentile_disc` does.
+ */
+Datum
+median_os_transfn(PG_FUNCTION_ARGS)
+{
+	struct MedianOsState *state;
+	MemoryContext agg_context;
+
+	if (AggCheckCallContext(fcinfo, &agg_context) != AGG_CONTEXT_AGGREGATE)
+	{
+		elog(ERROR, "median_os_transfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	if (PG_ARGISNULL(0))
+	{
+		Aggref	   *aggref = AggGetAggref(fcinfo);
+		SortGroupClause *sortcl;
+		MemoryContext old_context;
+
+		if ((NULL == aggref) || (list_length(aggref->aggorder) != 1))
+		{
+			elog(ERROR, "median_os_transfn called without an ORDER BY of one value");
+			PG_RETURN_NULL();
+		}
+		sortcl = (SortGroupClause *) linitial(aggref->aggorder);
+
+		old_context = MemoryContextSwitchTo(agg_context);
+		state = palloc0(sizeof *state);
+		state->rescan = AggStateIsShared(fcinfo);
+		state->sort = tuplesort_begin_datum(get_fn_expr_argtype(fcinfo->flinfo, 1),
+											sortcl->sortop, PG_GET_COLLATION(),
+											sortcl->nulls_first, work_mem, NULL,
+#if PG_VERSION_NUM >= 150000
+											state->rescan ? TUPLESORT_RANDOMACCESS : TUPLESORT_NONE);
+#else
+											state->rescan);
+#endif
+		MemoryContextSwitchTo(old_context);
+		AggRegisterCallback(fcinfo, median_os_shutdown, PointerGetDatum(state));
+	}
+	else
+	{
+		state = (struct MedianOsState *) PG_GETARG_POINTER(0);
+	}
+	if (!PG_ARGISNULL(1))
+	{
+		tuplesort_putdatum(state->sort, PG_GETARG_DATUM(1), false);
+		++state->n;
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(median_os_finalfn);
+
+/*
+ * Ordered-set median final function.
+ *
+ * Sorts the values, and reads only the middle one, skipping the ones
+ * before it without copying them, and never fetching the ones after it.
+ * As for `median`, of an even number of values, it's the upper of the
+ * middle two (in the order of the `ORDER BY`).
+ */
+Datum
+median_os_finalfn(PG_FUNCTION_ARGS)
+{
+	struct MedianOsState *state;
+	Datum		result;
+	bool		isnull;
+
+	if (AggCheckCallContext(fcinfo, NULL) != AGG_CONTEXT_AGGREGATE)
+	{
+		elog(ERROR, "median_os_finalfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	state = (struct MedianOsState *) PG_GETARG_POINTER(0);
+	if (state->n == 0)
+	{
+		PG_RETURN_NULL();
+	}
+	if (state->sorted)
+	{
+		tuplesort_rescan(state->sort);
+	}
+	else
+	{
+		tuplesort_performsort(state->sort);
+		state->sorted = true;
+	}
+	if (!tuplesort_skiptuples(state->sort, state->n / 2, true) ||
+#if PG_VERSION_NUM >= 160000
+		!tuplesort_getdatum(state->sort, true, true, &result, &isnull, NULL))
+#else
+		!tuplesort_getdatum(state->sort, true, &result, &isnull, NULL))
+#endif
+	{
+		elog(ERROR, "median_os_finalfn missing the middle of " INT64_FORMAT " values", state->n);
+		PG_RETURN_NULL();
+	}
+
+	PG_RETURN_DATUM(result);
+}
+
+/**
+ * The state of `medians`: one state per column (element of the arrays),
+ * all of the same type info, made on the first row. It's a convenience
+ * for a `median` of each column, which is kept, staged, spilled (with an
+ * even share of `work_mem`) and selected as by `median`.
+ */
+struct MedianColumns
+{
+	struct MedianTypeInfo *ti;
+	int			ncols;
+	struct MedianState *cols[FLEXIBLE_ARRAY_MEMBER];
+};
+
+/*
+ * A new state of `ncols` columns, whose own states are then (each) made by
+ * the caller.
+ */
+static struct MedianColumns *
+create_MedianColumns(MemoryContext ctx, struct MedianTypeInfo *ti, int ncols)
+{
+	struct MedianColumns *pmc = MemoryContextAllocZero(ctx, offsetof(struct MedianColumns, cols) +
+													   Max(ncols, 1) * sizeof(struct MedianState *));
+
+	pmc->ti = ti;
+	pmc->ncols = ncols;
+	return pmc;
+}
+
+PG_FUNCTION_INFO_V1(medians_transfn);
+
+/*
+ * Medians state transfer function.
+ *
+ * Adds the (non NULL) elements of the array of a row to the states of
+ * their columns, reading them in place, without deconstructing the array.
+ * All the rows are to have the same number of columns.
+ */
+Datum
+medians_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+	int			agg_kind = AggCheckCallContext(fcinfo, &agg_context);
+	struct MedianColumns *state;
+	struct MedianTypeInfo *ti;
+	ArrayType  *a;
+	int			ncols;
+	char	   *p;
+	bits8	   *nulls;
+	int			i;
+
+	if (!agg_kind)
+	{
+		elog(ERROR, "medians_transfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	state = PG_ARGISNULL(0) ? NULL : (struct MedianColumns *) PG_GETARG_POINTER(0);
+	if (PG_ARGISNULL(1))
+	{
+		if (NULL == state)
+		{
+			PG_RETURN_NULL();
+		}
+		PG_RETURN_POINTER(state);
+	}
+	a = PG_GETARG_ARRAYTYPE_P(1);
+	if (ARR_NDIM(a) > 1)
+	{
+		elog(ERROR, "medians of a multidimensional array");
+		PG_RETURN_NULL();
+	}
+	ncols = ArrayGetNItems(ARR_NDIM(a), ARR_DIMS(a));
+	if (NULL == state)
+	{
+		enum MedianEngine engine = pick_engine((agg_kind == AGG_CONTEXT_WINDOW) ? meSorted : meAppend);
+
+		ti = median_type_info(fcinfo->flinfo, ARR_ELEMTYPE(a), PG_GET_COLLATION());
+		state = create_MedianColumns(agg_context, ti, ncols);
+		for (i = 0; i < ncols; ++i)
+		{
+			state->cols[i] = create_MedianState(agg_context, ti, engine);
+			/* the columns share the `work_mem` of the aggregate */
+			if (NULL != state->cols[i]->spill)
+			{
+				state->cols[i]->spill->limit /= ncols;
+			}
+		}
+	}
+	else if (ncols != state->ncols)
+	{
+		elog(ERROR, "medians of %d values, after rows of %d", ncols, state->ncols);
+		PG_RETURN_NULL();
+	}
+	ti = state->ti;
+	p = ARR_DATA_PTR(a);
+	nulls = ARR_NULLBITMAP(a);
+	for (i = 0; i < ncols; ++i)
+	{
+		if ((NULL == nulls) || (nulls[i / 8] & (1 << (i % 8))))
+		{
+			state->cols[i] = stage_add(fcinfo, state->cols[i], fetch_att(p, ti->typbyval, ti->typlen));
+			MEDIAN_STAT(state->cols[i], rows, 1);
+			p = att_addlength_pointer(p, ti->typlen, p);
+			p = (char *) att_align_nominal(p, ti->typalign);
+		}
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(medians_finalfn);
+
+/*
+ * Medians final function: the array of the medians of the columns, as
+ * `median` gives them, with NULL for a column of only NULLs.
+ */
+Datum
+medians_finalfn(PG_FUNCTION_ARGS)
+{
+	struct MedianColumns *state;
+	struct MedianTypeInfo *ti;
+	Datum	   *values;
+	bool	   *nulls;
+	int			dims[1];
+	int			lbs[1] = {1};
+	int			i;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		elog(ERROR, "medians_finalfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	state = (struct MedianColumns *) PG_GETARG_POINTER(0);
+	ti = state->ti;
+	if (state->ncols == 0)
+	{
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(ti->typid));
+	}
+	values = palloc(state->ncols * sizeof *values);
+	nulls = palloc(state->ncols * sizeof *nulls);
+	for (i = 0; i < state->ncols; ++i)
+	{
+		struct MedianState *col = state->cols[i];
+		size_t		n;
+
+		stage_flush(fcinfo, col);
+		n = state_count(col);
+		nulls[i] = (n == 0);
+		if (n > 0)
+		{
+			instr_time	start;
+
+			INSTR_TIME_SET_ZERO(start);
+			if (unlikely(median_track_stats))
+			{
+				INSTR_TIME_SET_CURRENT(start);
+			}
+			values[i] = ti->ops->rank(col, n / 2);
+			if (unlikely(median_track_stats))
+			{
+				stats_report(col, start);
+			}
+		}
+	}
+	dims[0] = state->ncols;
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(values, nulls, 1, dims, lbs,
+											 ti->typid, ti->typlen, ti->typbyval, ti->typalign));
+}
+
+PG_FUNCTION_INFO_V1(medians_combinefn);
+
+/*
+ * Medians combine function: the columns of the second state are merged
+ * into those of the first, as by `median_combinefn`.
+ */
+Datum
+medians_combinefn(PG_FUNCTION_ARGS)
+{
+	struct MedianColumns *state1;
+	struct MedianColumns *state2;
+	MemoryContext agg_context;
+	int			i;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+	{
+		elog(ERROR, "medians_combinefn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	state1 = PG_ARGISNULL(0) ? NULL : (struct MedianColumns *) PG_GETARG_POINTER(0);
+	state2 = PG_ARGISNULL(1) ? NULL : (struct MedianColumns *) PG_GETARG_POINTER(1);
+	if (NULL == state2)
+	{
+		if (NULL == state1)
+		{
+			PG_RETURN_NULL();
+		}
+		PG_RETURN_POINTER(state1);
+	}
+	if (NULL == state1)
+	{
+		/* as for `median_combinefn`, state2 is not in the aggregate context */
+		state1 = create_MedianColumns(agg_context, state2->ti, state2->ncols);
+		for (i = 0; i < state2->ncols; ++i)
+		{
+			state1->cols[i] = create_MedianState(agg_context, state2->ti, state2->cols[i]->engine);
+			if (NULL != state1->cols[i]->spill)
+			{
+				state1->cols[i]->spill->limit /= state2->ncols;
+			}
+		}
+	}
+	else if (state1->ncols != state2->ncols)
+	{
+		elog(ERROR, "medians of %d values, and of %d", state2->ncols, state1->ncols);
+		PG_RETURN_NULL();
+	}
+	for (i = 0; i < state1->ncols; ++i)
+	{
+		struct MedianState *col1 = state1->cols[i];
+		struct MedianState *col2 = state2->cols[i];
+
+		stage_flush(fcinfo, col2);
+		stage_flush(fcinfo, col1);
+		col1->ti->ops->combine(col1, col2);
+		spill_register(fcinfo, col1);
+		if (unlikely(median_track_stats) && (NULL != col2->stats))
+		{
+			stats_add(MEDIAN_PART(col1, stats), col2->stats);
+		}
+	}
+
+	PG_RETURN_POINTER(state1);
+}
+
+PG_FUNCTION_INFO_V1(medians_serialfn);
+
+/*
+ * Medians serialization function: the type, collation and number of
+ * columns, then, for each column, its engine, number of elements, and
+ * elements, as `median_serialfn` sends them.
+ */
+Datum
+medians_serialfn(PG_FUNCTION_ARGS)
+{
+	struct MedianColumns *state;
+	struct MedianTypeInfo *ti;
+	StringInfoData buf;
+	int			i;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		elog(ERROR, "medians_serialfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	state = (struct MedianColumns *) PG_GETARG_POINTER(0);
+	ti = state->ti;
+
+	pq_begintypsend(&buf);
+	pq_sendint32(&buf, ti->typid);
+	pq_sendint32(&buf, ti->collation);
+	pq_sendint32(&buf, state->ncols);
+	for (i = 0; i < state->ncols; ++i)
+	{
+		struct MedianState *col = state->cols[i];
+
+		stage_flush(fcinfo, col);
+		pq_sendint32(&buf, col->engine);
+		pq_sendint64(&buf, state_count(col));
+		ti->ops->serialize(col, &buf);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(medians_deserialfn);
+
+/*
+ * Medians deserialization function, the inverse of `medians_serialfn`.
+ * The new state is created in the current memory context.
+ */
+Datum
+medians_deserialfn(PG_FUNCTION_ARGS)
+{
+	bytea	   *sstate;
+	struct MedianColumns *state;
+	struct MedianTypeInfo *ti;
+	StringInfoData buf;
+	Oid			typid;
+	Oid			collation;
+	int			ncols;
+	int			i;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		elog(ERROR, "medians_deserialfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	sstate = PG_GETARG_BYTEA_PP(0);
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(sstate), VARSIZE_ANY_EXHDR(sstate));
+
+	typid = (Oid) pq_getmsgint(&buf, 4);
+	collation = (Oid) pq_getmsgint(&buf, 4);
+	ncols = pq_getmsgint(&buf, 4);
+	ti = median_type_info(fcinfo->flinfo, typid, collation);
+	state = create_MedianColumns(CurrentMemoryContext, ti, ncols);
+	for (i = 0; i < ncols; ++i)
+	{
+		enum MedianEngine engine = (enum MedianEngine) pq_getmsgint(&buf, 4);
+		size_t		dim = pq_getmsgint64(&buf);
+
+		state->cols[i] = create_MedianState(CurrentMemoryContext, ti, engine);
+		ti->ops->deserialize(state->cols[i], &buf, dim);
+	}
+	pq_getmsgend(&buf);
+	pfree(buf.data);
+
+	PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(median_combinefn);
+
+/*
+ * Median combine function, for parallel (and partial) aggregates.
+ *
+ * Merges the second state into the first. The elements are appended, and
+ * the finalfn will select the median, or, if all the states are sorted,
+ * search the sorted runs they're kept as, without merging them.
+ */
+Datum
+median_combinefn(PG_FUNCTION_ARGS)
+{
+	struct MedianState *state1;
+	struct MedianState *state2;
+	MemoryContext agg_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+	{
+		elog(ERROR, "median_combinefn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	state1 = PG_ARGISNULL(0) ? NULL : (struct MedianState *) PG_GETARG_POINTER(0);
+	state2 = PG_ARGISNULL(1) ? NULL : (struct MedianState *) PG_GETARG_POINTER(1);
+	if (NULL == state2)
+	{
+		if (NULL == state1)
+		{
+			PG_RETURN_NULL();
+		}
+		PG_RETURN_POINTER(state1);
+	}
+	stage_flush(fcinfo, state2);
+	if (NULL == state1)
+	{
+		/*
+		 * state2 is not in the aggregate context, so we can't just return
+		 * it, but have to make a copy.
+		 */
+		state1 = create_MedianState(agg_context, state2->ti, state2->engine);
+	}
+	stage_flush(fcinfo, state1);
+	if ((NULL == state1->fractions) && (NULL != state2->fractions))
+	{
+		set_fractions(state1, state2->fractions);
+	}
+	if (state1->heap.k == 0)
+	{
+		state1->heap = state2->heap;
+	}
+	state1->ti->ops->combine(state1, state2);
+	spill_register(fcinfo, state1);
+	if (unlikely(median_track_stats) && (NULL != state2->stats))
+	{
+		stats_add(MEDIAN_PART(state1, stats), state2->stats);
+	}
+
+	PG_RETURN_POINTER(state1);
+}
+
+
+PG_FUNCTION_INFO_V1(median_serialfn);
+
+/*
+ * Median serialization function.
+ *
+ * The header (type, engine, collation, number of elements, then the
+ * `quantiles` fractions, if any) is followed by the elements themselves.
+ * Numbers are just copied, as parallel workers run on the same machine
+ * as the leader.
+ */
+Datum
+median_serialfn(PG_FUNCTION_ARGS)
+{
+	struct MedianState *state;
+	StringInfoData buf;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		elog(ERROR, "median_serialfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	state = (struct MedianState *) PG_GETARG_POINTER(0);
+	stage_flush(fcinfo, state);
+
+	pq_begintypsend(&buf);
+	pq_sendint32(&buf, state->ti->typid);
+	pq_sendint32(&buf, state->engine);
+	pq_sendint32(&buf, state->ti->collation);
+	pq_sendint64(&buf, state_count(state));
+	if (NULL == state->fractions)
+	{
+		pq_sendint32(&buf, 0);
+	}
+	else
+	{
+		pq_sendint32(&buf, VARSIZE(state->fractions));
+		pq_sendbytes(&buf, (char *) state->fractions, VARSIZE(state->fractions));
+	}
+	state->ti->ops->serialize(state, &buf);
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
 
-/** We keep a sorted array, instead of a node-based approach
-    (such as an AWL or red-black-tree), because it's actually
-    faster for a lot of use cases when array can fit into CPU
-    cache (which is pretty large these days), while being much
-    easier to implement and maintain.
-
-    This is a straight-forward implementation that scales poorly as
-    the size of  `data` goes "beyond cache". To solve that, we should
-    provide an array of "pages", each being an array of at most 100000
-    or so elements (that can fit into a cache of an "everyday" CPU),
-    and insert into them pages, adding new one if the last is full and
-    element needs to be inserted after it and breaking them up when
-    they are full yet a new element needs to be inserted. It would
-    slow down iteration a little, but would speed up insertion _much_,
-    making it possible to handle large amounts of data.
-*/
-struct MedianState
-{
-	int8		varlen_hdr_[VARHDRSZ];
-	size_t		cap;
-	size_t		dim;
-	enum ValueClass valclass;
-	union
-	{
-		int64		i[1];
-		text	   *t[1];
-	}			data;
-};
 
+PG_FUNCTION_INFO_V1(median_deserialfn);
 
-static struct MedianState *
-expand_if_need_be(struct MedianState *pms)
+/*
+ * Median deserialization function, the inverse of `median_serialfn`.
+ * The new state is created in the current memory context.
+ */
+Datum
+median_deserialfn(PG_FUNCTION_ARGS)
 {
-	if (pms->dim >= pms->cap)
-	{
-		size_t		ncap = (pms->cap * 3) / 2;
-		size_t		to_alloc;
-		struct MedianState *npms;
+	bytea	   *sstate;
+	struct MedianState *state;
+	StringInfoData buf;
+	Oid			typid;
+	enum MedianEngine engine;
+	Oid			collation;
+	size_t		dim;
+	int			fractionslen;
 
-		if (ncap < pms->cap)
-		{
-			elog(ERROR, "Overflow while expanding array for median");
-			return pms;
-		}
-		/* elog(WARNING, "pms->cap = %lu, ncap = %lu", pms->cap, ncap); */
-		to_alloc = sizeof *pms + sizeof pms->data * ncap;
-		/* elog(WARNING, "toalloc = %lu", to_alloc); */
-		npms = repalloc(pms, to_alloc);
-		if (NULL == npms)
-		{
-			elog(ERROR, "No memory while expanding array for median");
-			return pms;
-		}
-		pms = npms;
-		SET_VARSIZE(pms, to_alloc);
-		pms->cap = ncap;
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		elog(ERROR, "median_deserialfn called in non-aggregate context");
+		PG_RETURN_NULL();
 	}
-	return pms;
-}
+	sstate = PG_GETARG_BYTEA_PP(0);
 
-static struct MedianState *
-insert_median_numeral(struct MedianState *pms, int64 x)
-{
-	size_t		i;
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(sstate), VARSIZE_ANY_EXHDR(sstate));
 
-	for (i = 0; i < pms->dim; ++i)
+	typid = (Oid) pq_getmsgint(&buf, 4);
+	engine = (enum MedianEngine) pq_getmsgint(&buf, 4);
+	collation = (Oid) pq_getmsgint(&buf, 4);
+	dim = pq_getmsgint64(&buf);
+	state = create_MedianState(CurrentMemoryContext,
+							   median_type_info(fcinfo->flinfo, typid, collation),
+							   engine);
+	fractionslen = pq_getmsgint(&buf, 4);
+	if (fractionslen > 0)
 	{
-		if (x >= pms->data.i[i])
-		{
-			memmove(pms->data.i + i + 1, pms->data.i + i, (pms->dim - i) * sizeof pms->data.i[0]);
-			break;
-		}
+		state->fractions = palloc(fractionslen);
+		memcpy(state->fractions, pq_getmsgbytes(&buf, fractionslen), fractionslen);
 	}
-	pms->data.i[i] = x;
-	++pms->dim;
-	return pms;
-}
+	state->ti->ops->deserialize(state, &buf, dim);
+	pq_getmsgend(&buf);
+	pfree(buf.data);
 
-static int
-text_cmp(text *arg1, text *arg2, Oid collid)
-{
-	char	   *a1p;
-	char	   *a2p;
-	int			len1,
-				len2;
+	PG_RETURN_POINTER(state);
+}
 
-	a1p = VARDATA_ANY(arg1);
-	a2p = VARDATA_ANY(arg2);
 
-	len1 = VARSIZE_ANY_EXHDR(arg1);
-	len2 = VARSIZE_ANY_EXHDR(arg2);
+/*
+ * Sends the schema `nsp` and `name` of an object of a `median_sketch`, as
+ * null-terminated strings, with no encoding conversion. Both are empty if
+ * there's no object (collation).
+ */
+static void
+sketch_send_name(StringInfo buf, Oid nsp, char const *name)
+{
+	char const *nspname = OidIsValid(nsp) ? get_namespace_name(nsp) : "";
 
-	return varstr_cmp(a1p, len1, a2p, len2, collid);
+	pq_sendbytes(buf, nspname, strlen(nspname) + 1);
+	pq_sendbytes(buf, name, strlen(name) + 1);
 }
 
-static struct MedianState *
-insert_median_text(struct MedianState *pms, text *x, Oid collation)
+/*
+ * The `median_sketch` of the (sketch) state, see `MEDIAN_SKETCH_VERSION`.
+ * The type and collation are kept by name, as their OIDs are those of
+ * this server only.
+ */
+static bytea *
+sketch_flatten(struct MedianState *state)
 {
-	size_t		i;
+	StringInfoData buf;
+	HeapTuple	tp;
 
-	for (i = 0; i < pms->dim; ++i)
+	Assert(state->engine == meSketch);
+	pq_begintypsend(&buf);
+	pq_sendbyte(&buf, MEDIAN_SKETCH_VERSION);
+	tp = SearchSysCache1(TYPEOID, ObjectIdGetDatum(state->ti->typid));
+	if (!HeapTupleIsValid(tp))
+	{
+		elog(ERROR, "cache lookup failed for type %u", state->ti->typid);
+		return NULL;
+	}
+	sketch_send_name(&buf, ((Form_pg_type) GETSTRUCT(tp))->typnamespace,
+					 NameStr(((Form_pg_type) GETSTRUCT(tp))->typname));
+	ReleaseSysCache(tp);
+	if (OidIsValid(state->ti->collation))
 	{
-		if (text_cmp(x, pms->data.t[i], collation) < 0)
+		tp = SearchSysCache1(COLLOID, ObjectIdGetDatum(state->ti->collation));
+		if (!HeapTupleIsValid(tp))
 		{
-			memmove(pms->data.t + i + 1, pms->data.t + i, (pms->dim - i) * sizeof pms->data.t[0]);
-			break;
+			elog(ERROR, "cache lookup failed for collation %u", state->ti->collation);
+			return NULL;
 		}
+		sketch_send_name(&buf, ((Form_pg_collation) GETSTRUCT(tp))->collnamespace,
+						 NameStr(((Form_pg_collation) GETSTRUCT(tp))->collname));
+		ReleaseSysCache(tp);
 	}
-	pms->data.t[i] = x;
-	++pms->dim;
-	return pms;
-}
+	else
+	{
+		sketch_send_name(&buf, InvalidOid, "");
+	}
+	pq_sendint64(&buf, state->dim);
+	state->ti->ops->serialize(state, &buf);
 
+	return pq_endtypsend(&buf);
+}
 
-static struct MedianState *
-create_MedianState(MemoryContext ctx)
+/*
+ * The type of a `median_sketch`, by its schema and name, which must exist
+ * (and be usable) on this server.
+ */
+static Oid
+sketch_recv_type(StringInfo buf)
 {
-	struct MedianState *pms;
-	size_t const ncap = 64;
-	size_t const to_alloc = sizeof *pms + sizeof pms->data * ncap;
+	char const *nspname = pq_getmsgrawstring(buf);
+	char const *name = pq_getmsgrawstring(buf);
+	Oid			typid;
 
-	/*
-	 * elog(WARNING, "create_MedianState() NULL == pms, to_alloc = %lu",
-	 * to_alloc);
-	 */
-	pms = MemoryContextAllocZero(ctx, to_alloc);
-	if (NULL == pms)
+	typid = GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid, CStringGetDatum(name),
+							ObjectIdGetDatum(LookupExplicitNamespace(nspname, false)));
+	if (!OidIsValid(typid))
 	{
-		elog(ERROR, "create_MedianState() no memory");
-		return NULL;
+		elog(ERROR, "median_sketch of type %s.%s, which does not exist", nspname, name);
+		return InvalidOid;
 	}
-	SET_VARSIZE(pms, to_alloc);
-	pms->dim = 0;
-	pms->cap = ncap;
-
-	return pms;
+	return typid;
 }
 
-static struct MedianState *
-do_median_numeral(struct MedianState *pms, int64 x)
+/* The collation of a `median_sketch`, if any, by its schema and name */
+static Oid
+sketch_recv_collation(StringInfo buf)
 {
-	return insert_median_numeral(expand_if_need_be(pms), x);
-}
+	char const *nspname = pq_getmsgrawstring(buf);
+	char const *name = pq_getmsgrawstring(buf);
 
-
-static struct MedianState *
-do_median_text(struct MedianState *pms, text *x, Oid collation)
-{
-	return insert_median_text(expand_if_need_be(pms), x, collation);
+	if ('\0' == *nspname)
+	{
+		return InvalidOid;
+	}
+	return get_collation_oid(list_make2(makeString(pstrdup(nspname)), makeString(pstrdup(name))), false);
 }
 
-PG_FUNCTION_INFO_V1(median_transfn);
-
 /*
- * Median state transfer function.
- *
- * This function is called for every value in the set that we are calculating
- * the median for. On first call, the aggregate state, if any, needs to be
- * initialized.
- *
- * It's also used for a moving-aggregate ("window"), though there might
- * possibly be scenarios where it should be different. Right now, we're not
- * 100% sure, as PostgreSQL docs are not very precise on this matter.
+ * The (sketch) state of the `median_sketch`, in `ctx`, with its type info
+ * cached in the `fn_extra` of `flinfo`. As the sketch may come from the
+ * outside, its elements are checked as they're read (see `MT_DESERIALIZE`),
+ * and then that the weights of its levels add up to its number of values,
+ * which the finalfn relies on.
  */
-Datum
-median_transfn(PG_FUNCTION_ARGS)
+static struct MedianState *
+sketch_expand(FmgrInfo *flinfo, MemoryContext ctx, bytea *sketch)
 {
+	StringInfoData buf;
+	int			version;
+	Oid			typid;
+	Oid			collation;
+	uint64		dim;
 	struct MedianState *state;
+	uint64		weight = 0;
+	size_t		h;
 
-	MemoryContext agg_context;
-
-	if (!AggCheckCallContext(fcinfo, &agg_context))
-	{
-		elog(ERROR, "median_transfn called in non-aggregate context");
-		PG_RETURN_NULL();
-	}
-	if (PG_ARGISNULL(0))
-	{
-		state = NULL;			/* first element */
-	}
-	else
-	{
-		state = (struct MedianState *) PG_GETARG_BYTEA_P(0);
-	}
-	if (PG_ARGISNULL(1))
+	/* a copy, so that it ends with a '\0', as its names are read up to one */
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(sketch), VARSIZE_ANY_EXHDR(sketch));
+	version = pq_getmsgbyte(&buf);
+	if (version != MEDIAN_SKETCH_VERSION)
 	{
-		/* discard NULL input values */
+		elog(ERROR, "median_sketch version %d not supported", version);
+		return NULL;
 	}
-	else
+	typid = sketch_recv_type(&buf);
+	collation = sketch_recv_collation(&buf);
+	dim = pq_getmsgint64(&buf);
+	state = create_MedianState(ctx, median_type_info(flinfo, typid, collation), meSketch);
+	state->ti->ops->deserialize(state, &buf, dim);
+	pq_getmsgend(&buf);
+	pfree(buf.data);
+	for (h = 0; h < state->npages; ++h)
 	{
-		Oid			partyp;
+		uint64 const n = state->pages[h]->dim;
 
-		if (NULL == state)
-		{
-			state = create_MedianState(agg_context);
-		}
-		partyp = get_fn_expr_argtype(fcinfo->flinfo, 1);
-		switch (partyp)
+		/* checked first, so that the sum can't overflow */
+		if (n > ((dim - weight) >> h))
 		{
-			case INT2OID:
-				state = do_median_numeral(state, PG_GETARG_INT16(1));
-				break;
-			case INT4OID:
-				state = do_median_numeral(state, PG_GETARG_INT32(1));
-				break;
-			case INT8OID:
-			case TIMESTAMPOID:
-			case TIMESTAMPTZOID:
-				state = do_median_numeral(state, PG_GETARG_INT64(1));
-				break;
-			case TEXTOID:
-				state = do_median_text(state, PG_GETARG_TEXT_P_COPY(1), PG_GET_COLLATION());
-				break;
-			default:
-				elog(ERROR, "parameter type oid=%u not supported", partyp);
+			elog(ERROR, "invalid median_sketch");
+			return NULL;
 		}
+		weight += n << h;
 	}
-
-	if (state == NULL)
-	{
-		PG_RETURN_NULL();
-	}
-	else
+	if (weight != dim)
 	{
-		PG_RETURN_BYTEA_P(state);
+		elog(ERROR, "invalid median_sketch");
+		return NULL;
 	}
+
+	return state;
 }
 
+PG_FUNCTION_INFO_V1(median_sketch_in);
 
-static struct MedianState *
-remove_median_numeral(struct MedianState *pms, int64 x)
+/*
+ * Input function of `median_sketch`. The text form is that of `bytea`, of
+ * the (binary) format, which is checked to be a valid sketch.
+ */
+Datum
+median_sketch_in(PG_FUNCTION_ARGS)
 {
-	size_t		i;
+	bytea	   *sketch = DatumGetByteaPP(DirectFunctionCall1(byteain, PG_GETARG_DATUM(0)));
 
-	/* Should do binary search here */
-	for (i = 0; i < pms->dim; ++i)
-	{
-		if (x == pms->data.i[i])
-		{
-			memmove(pms->data.i + i, pms->data.i + i + 1, sizeof pms->data.i[0]);
-			return pms;
-		}
-	}
-	elog(ERROR, "remove_median_numeral(%ld) not found", x);
-	return pms;
+	sketch_expand(fcinfo->flinfo, CurrentMemoryContext, sketch);
+
+	PG_RETURN_BYTEA_P(sketch);
 }
 
-static struct MedianState *
-remove_median_text(struct MedianState *pms, text *x, Oid collation)
-{
-	size_t		i;
+PG_FUNCTION_INFO_V1(median_sketch_out);
 
-	/* Should do binary search here */
-	for (i = 0; i < pms->dim; ++i)
-	{
-		if (0 == text_cmp(x, pms->data.t[i], collation))
-		{
-			memmove(pms->data.t + i, pms->data.t + i + 1, sizeof pms->data.t[0]);
-			return pms;
-		}
-	}
-	elog(ERROR, "remove_median_text() not found");
-	return pms;
+Datum
+median_sketch_out(PG_FUNCTION_ARGS)
+{
+	return DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0));
 }
 
-static struct MedianState *
-undo_median_numeral(struct MedianState *pms, int64 x)
+PG_FUNCTION_INFO_V1(median_sketch_recv);
+
+Datum
+median_sketch_recv(PG_FUNCTION_ARGS)
 {
-	elog(WARNING, "undo_median_numeral(%ld)", x);
-	return remove_median_numeral(expand_if_need_be(pms), x);
+	bytea	   *sketch = DatumGetByteaPP(DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0)));
+
+	sketch_expand(fcinfo->flinfo, CurrentMemoryContext, sketch);
+
+	PG_RETURN_BYTEA_P(sketch);
 }
 
+PG_FUNCTION_INFO_V1(median_sketch_send);
 
-static struct MedianState *
-undo_median_text(struct MedianState *pms, text *x, Oid collation)
+Datum
+median_sketch_send(PG_FUNCTION_ARGS)
 {
-	return remove_median_text(expand_if_need_be(pms), x, collation);
+	return DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0));
 }
 
-PG_FUNCTION_INFO_V1(median_inv_transfn);
+
+PG_FUNCTION_INFO_V1(median_sketch_finalfn);
 
 /*
- * Median inverse state transfer function.
- *
- * This function is called for "moving average" (window) aggregate and is
- * designed to "remove a value from aggregate calculation".
- *
+ * Final function of the `median_sketch` and `median_merge` aggregates,
+ * which flattens the (sketch) state into a `median_sketch`.
  */
 Datum
-median_inv_transfn(PG_FUNCTION_ARGS)
+median_sketch_finalfn(PG_FUNCTION_ARGS)
 {
 	struct MedianState *state;
 
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		elog(ERROR, "median_sketch_finalfn called in non-aggregate context");
+		PG_RETURN_NULL();
+	}
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	state = (struct MedianState *) PG_GETARG_POINTER(0);
+	stage_flush(fcinfo, state);
+	PG_RETURN_BYTEA_P(sketch_flatten(state));
+}
+
+
+PG_FUNCTION_INFO_V1(median_merge_transfn);
+
+/*
+ * State transfer function of `median_merge`, which combines the sketches
+ * it gets into one. They must all be of the same type (and collation).
+ */
+Datum
+median_merge_transfn(PG_FUNCTION_ARGS)
+{
+	struct MedianState *state;
 	MemoryContext agg_context;
 
 	if (!AggCheckCallContext(fcinfo, &agg_context))
 	{
-		elog(ERROR, "median_transfn called in non-aggregate context");
+		elog(ERROR, "median_merge_transfn called in non-aggregate context");
 		PG_RETURN_NULL();
 	}
-	Assert(PG_ARGISNULL(0));
-	state = (struct MedianState *) PG_GETARG_BYTEA_P(0);
-	if (PG_ARGISNULL(1))
-	{
-		/*
-		 * discard NULL input values - though I'm not sure it's possible to
-		 * get a NULL for the inverse transfer function.
-		 */
-	}
-	else
+	state = PG_ARGISNULL(0) ? NULL : (struct MedianState *) PG_GETARG_POINTER(0);
+	if (!PG_ARGISNULL(1))
 	{
-		Oid			partyp;
+		struct MedianState *other = sketch_expand(fcinfo->flinfo, CurrentMemoryContext,
+												  PG_GETARG_BYTEA_PP(1));
 
 		if (NULL == state)
 		{
-			state = create_MedianState(agg_context);
+			state = create_MedianState(agg_context, other->ti, meSketch);
 		}
-		partyp = get_fn_expr_argtype(fcinfo->flinfo, 1);
-		switch (partyp)
+		else if ((state->ti->typid != other->ti->typid) ||
+				 (state->ti->collation != other->ti->collation))
 		{
-			case INT2OID:
-				state = undo_median_numeral(state, PG_GETARG_INT16(1));
-				break;
-			case INT4OID:
-				state = undo_median_numeral(state, PG_GETARG_INT32(1));
-				break;
-			case INT8OID:
-			case TIMESTAMPOID:
-			case TIMESTAMPTZOID:
-				state = undo_median_numeral(state, PG_GETARG_INT64(1));
-				break;
-			case TEXTOID:
-				state = undo_median_text(state, PG_GETARG_TEXT_P_COPY(1), PG_GET_COLLATION());
-				break;
-			default:
-				elog(ERROR, "parameter type oid=%u not supported", partyp);
+			elog(ERROR, "median_sketch of %s can't be merged with one of %s",
+				 format_type_be(state->ti->typid), format_type_be(other->ti->typid));
+			PG_RETURN_NULL();
 		}
+		state->ti->ops->combine(state, other);
 	}
 
-	if (state == NULL)
+	if (NULL == state)
 	{
 		PG_RETURN_NULL();
 	}
-	else
+	PG_RETURN_POINTER(state);
+}
+
+
+PG_FUNCTION_INFO_V1(median_value);
+
+/*
+ * The (approximate) median of a `median_sketch`. The second argument is
+ * only there to give the type of the result, which must be the type of
+ * the sketch.
+ */
+Datum
+median_value(PG_FUNCTION_ARGS)
+{
+	struct MedianState *state;
+	Oid const	typid = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	state = sketch_expand(fcinfo->flinfo, CurrentMemoryContext, PG_GETARG_BYTEA_PP(0));
+	if (state->ti->typid != typid)
+	{
+		elog(ERROR, "median_sketch is of %s, not %s",
+			 format_type_be(state->ti->typid), format_type_be(typid));
+		PG_RETURN_NULL();
+	}
+	if (state->dim == 0)
 	{
-		PG_RETURN_BYTEA_P(state);
+		PG_RETURN_NULL();
 	}
+	PG_RETURN_DATUM(state->ti->ops->rank(state, state->dim / 2));
 }
 
 
-PG_FUNCTION_INFO_V1(median_finalfn);
+PG_FUNCTION_INFO_V1(median_stats);
 
 /*
- * Median final function.
- *
- * This function is called after all values in the median set has been
- * processed by the state transfer function(s). It should perform any
- * necessary post processing and clean up any temporary state.
- *
- * This assumes that, by now, the data is sorted. An alternative
- * approach would be to use "Quick Select", probably improved, like
- * "Intro Select" and _not_ sort the data while inserting. That would
- * probably be faster on average, but, writing a good Intro (or
- * similar) Select is hard and error prone - it's very easy to end up
- * with something that's actually slower than this implementation for
- * some inputs that are of interest to a particular implementation.
+ * The stats of all the results of this backend, with `median.track_stats`,
+ * since it started or they were reset, see `struct MedianStats`. The work
+ * of parallel workers isn't counted, as their (partial) states give no
+ * results, but their combining is. The calls of `median_cached()` answered
+ * from its cache, and by a query, are counted whether or not it's on.
  */
 Datum
-median_finalfn(PG_FUNCTION_ARGS)
+median_stats(PG_FUNCTION_ARGS)
 {
-	struct MedianState *state;
-	MemoryContext agg_context;
+	struct MedianStats const *st = &median_stats_total;
+	TupleDesc	tupdesc;
+	Datum		values[12];
+	bool		nulls[12];
 
-	if (!AggCheckCallContext(fcinfo, &agg_context))
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
 	{
-		elog(ERROR, "median_finalfn called in non-aggregate context");
+		elog(ERROR, "median_stats called in a context that doesn't take a record");
 		PG_RETURN_NULL();
 	}
+	tupdesc = BlessTupleDesc(tupdesc);
+	memset(nulls, 0, sizeof nulls);
+	values[0] = Int64GetDatum(st->results);
+	values[1] = Int64GetDatum(st->rows);
+	values[2] = Int64GetDatum(st->comparisons);
+	values[3] = Int64GetDatum(st->moved);
+	values[4] = Int64GetDatum(st->reallocs);
+	values[5] = Int64GetDatum(st->peak);
+	values[6] = Int64GetDatum(st->switches);
+	values[7] = Int64GetDatum(st->spill_runs);
+	values[8] = Int64GetDatum(st->sort_keys);
+	values[9] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(st->select_time));
+	values[10] = Int64GetDatum(median_cache_hits);
+	values[11] = Int64GetDatum(median_cache_misses);
 
-	if (PG_ARGISNULL(0))
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+
+PG_FUNCTION_INFO_V1(median_stats_reset);
+
+/* Resets the stats of this backend, that `median_stats` gives */
+Datum
+median_stats_reset(PG_FUNCTION_ARGS)
+{
+	memset(&median_stats_total, 0, sizeof median_stats_total);
+	median_cache_hits = 0;
+	median_cache_misses = 0;
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * The transition functions of the aggregates whose state may spill, that
+ * is `_median_transfn`, `_quantiles_transfn` and `_medians_transfn` of the
+ * extension, looked up once and kept until `pg_proc` changes (see
+ * `spill_transfns_invalidate`). They're `InvalidOid` while the extension
+ * isn't created (in this database).
+ */
+static Oid	median_spill_transfns[3];
+static bool median_spill_transfns_valid = false;
+
+static void
+spill_transfns_invalidate(Datum arg, int cacheid, uint32 hashvalue)
+{
+	median_spill_transfns_valid = false;
+}
+
+/* The function `name(argtypes)` of the schema `nsp`, or `InvalidOid` */
+static Oid
+spill_transfn_oid(Oid nsp, char const *name, Oid const *argtypes, int nargs)
+{
+	return GetSysCacheOid3(PROCNAMEARGSNSP, Anum_pg_proc_oid, CStringGetDatum(name),
+						   PointerGetDatum(buildoidvector(argtypes, nargs)),
+						   ObjectIdGetDatum(nsp));
+}
+
+#if PG_VERSION_NUM < 160000
+/* `get_extension_schema()`, which is only exported from 16 on */
+static Oid
+get_extension_schema(Oid ext)
+{
+	Relation	rel = table_open(ExtensionRelationId, AccessShareLock);
+	ScanKeyData key;
+	SysScanDesc scan;
+	HeapTuple	tuple;
+	Oid			nsp = InvalidOid;
+
+	ScanKeyInit(&key, Anum_pg_extension_oid, BTEqualStrategyNumber, F_OIDEQ, ObjectIdGetDatum(ext));
+	scan = systable_beginscan(rel, ExtensionOidIndexId, true, NULL, 1, &key);
+	tuple = systable_getnext(scan);
+	if (HeapTupleIsValid(tuple))
 	{
-		state = NULL;			/* had no elements! */
+		nsp = ((Form_pg_extension) GETSTRUCT(tuple))->extnamespace;
 	}
-	else
+	systable_endscan(scan);
+	table_close(rel, AccessShareLock);
+
+	return nsp;
+}
+#endif
+
+static void
+spill_transfns_lookup(void)
+{
+	static Oid const median_args[] = {INTERNALOID, ANYELEMENTOID};
+	static Oid const quantiles_args[] = {INTERNALOID, ANYELEMENTOID, FLOAT8ARRAYOID};
+	static Oid const medians_args[] = {INTERNALOID, ANYARRAYOID};
+	Oid const	ext = get_extension_oid("median", true);
+	Oid const	nsp = OidIsValid(ext) ? get_extension_schema(ext) : InvalidOid;
+
+	memset(median_spill_transfns, 0, sizeof median_spill_transfns);
+	if (OidIsValid(nsp))
 	{
-		state = (struct MedianState *) PG_GETARG_BYTEA_P(0);
+		median_spill_transfns[0] = spill_transfn_oid(nsp, "_median_transfn", median_args,
+													 lengthof(median_args));
+		median_spill_transfns[1] = spill_transfn_oid(nsp, "_quantiles_transfn", quantiles_args,
+													 lengthof(quantiles_args));
+		median_spill_transfns[2] = spill_transfn_oid(nsp, "_medians_transfn", medians_args,
+													 lengthof(medians_args));
 	}
-	if (NULL == state)
+	median_spill_transfns_valid = true;
+}
+
+/*
+ * Whether the query (or expression) `node` has an aggregate whose state
+ * may spill, that is of `median_transfn`, `quantiles_transfn` or
+ * `medians_transfn`.
+ */
+static bool
+has_spilling_agg(Node *node, void *context)
+{
+	if (NULL == node)
 	{
-		PG_RETURN_NULL();
+		return false;
 	}
-	else
+	if (IsA(node, Aggref))
 	{
-		if (state->dim > 0)
+		HeapTuple	tuple = SearchSysCache1(AGGFNOID, ObjectIdGetDatum(((Aggref *) node)->aggfnoid));
+
+		if (HeapTupleIsValid(tuple))
 		{
-			switch (state->valclass)
-			{
-				case vcNumeral:
-					{
-						int64		rslt = state->data.i[state->dim / 2];
+			Oid const	transfn = ((Form_pg_aggregate) GETSTRUCT(tuple))->aggtransfn;
 
-						PG_RETURN_DATUM(Int64GetDatum(rslt));
-					}
-				case vcText:
-					PG_RETURN_TEXT_P(state->data.t[state->dim / 2]);
+			ReleaseSysCache(tuple);
+			if ((transfn == median_spill_transfns[0]) || (transfn == median_spill_transfns[1]) ||
+				(transfn == median_spill_transfns[2]))
+			{
+				return true;
 			}
 		}
-
-		PG_RETURN_NULL();
 	}
+	if (IsA(node, Query))
+	{
+		return query_tree_walker((Query *) node, has_spilling_agg, context, 0);
+	}
+	return expression_tree_walker(node, has_spilling_agg, context);
 }
 
-/* For parallel aggregates, one would need to write a few more
-   functions. A "combine", essentially implementing a "merge" of
-   sorted arrays and "serialze" and "de-serialize", which are trivial
-   for numbers, but require some work for strings, writing each one
-   with the length first and then the actual content.
+/*
+ * With `median.spill`, queries of the aggregates whose states may spill
+ * aren't planned parallel. The state of a parallel worker is serialized
+ * (into a `bytea`) for the leader with all of its elements, spilled or
+ * not, which would take (at least) as much memory as they would have
+ * without spilling, in the worker and then in the leader.
  */
+static PlannedStmt *
+median_planner(Query *parse, const char *query_string, int cursorOptions,
+			   ParamListInfo boundParams)
+{
+	if (median_spill && (cursorOptions & CURSOR_OPT_PARALLEL_OK))
+	{
+		if (!median_spill_transfns_valid)
+		{
+			spill_transfns_lookup();
+		}
+		if (has_spilling_agg((Node *) parse, NULL))
+		{
+			cursorOptions &= ~CURSOR_OPT_PARALLEL_OK;
+		}
+	}
+	if (NULL != median_prev_planner_hook)
+	{
+		return median_prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+	}
+	return standard_planner(parse, query_string, cursorOptions, boundParams);
+}
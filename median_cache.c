@@ -0,0 +1,642 @@
+/* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
+/*
+ * median_cache.c
+ *
+ * `median_cached(rel, column, predicate, NULL::type)` is the median of
+ * `column` of the rows of `rel` matching `predicate`, run (by SPI) as
+ * `SELECT median(column) FROM rel WHERE predicate`, and kept in a cache
+ * in shared memory, so that the next same query, of any backend, is
+ * answered from the cache for as long as `rel` hasn't changed.
+ *
+ * Changes are counted by relation, in shared memory, by the (statement)
+ * trigger `median_cache_invalidate()`, which the relation must have, for
+ * `INSERT`, `UPDATE`, `DELETE` and `TRUNCATE`, and by relcache
+ * invalidations (of its DDL, or a `VACUUM`). A median is cached with the
+ * change count of its relation, as read before its query, and found only
+ * while the relation still has that count. The trigger counts a change
+ * when a statement changes the relation, and again when the transaction
+ * commits (once its changes are visible), or aborts, so that a median
+ * found in between, without the changes, can't outlive them.
+ *
+ * The readers don't lock: each entry is a seqlock, whose sequence is odd
+ * while it's written, and a reader takes a copy of the entry only if
+ * the sequence was even and the same before and after copying it. A
+ * writer takes the entry by making its sequence odd, and gives up on
+ * storing its median if another writer has it. The entries are direct
+ * mapped, by a hash of the query (relation, column, predicate, type and
+ * collation), so that a new median replaces the one that was there.
+ *
+ * Medians are only taken from, and put into, the cache by a snapshot of
+ * its own (of a `READ COMMITTED` transaction), which sees all the changes
+ * committed before its query, and not by a transaction that changed the
+ * relation itself. As a cached median is given without its query, it's
+ * only given to a user who may select (all) the relation, and not for a
+ * relation with row-level security, whose medians depend on the user,
+ * nor of a partitioned relation, or one with inheritance children, whose
+ * rows the query reads, but whose triggers only count the changes made
+ * through the parent (a new child counts one, by the relcache).
+ *
+ * The predicate must be an expression (of the `WHERE` clause of the one
+ * query). Only medians of a predicate of nothing but `rel` (no subqueries,
+ * nor other relations, whose changes wouldn't invalidate them) and
+ * immutable functions are cached, and by the user, the search path (the
+ * schemas its names were found in) and the settings its date and time
+ * literals are read by, which are parts of the key. The whole key is kept
+ * in the entry, and compared, so that medians only collide on the entry,
+ * and one too long to keep isn't cached.
+ */
+#include <postgres.h>
+#include <fmgr.h>
+#include <miscadmin.h>
+#include <access/relation.h>
+#include <access/xact.h>
+#include <catalog/namespace.h>
+#include <catalog/pg_trigger.h>
+#include <commands/trigger.h>
+#include <common/hashfn.h>
+#include <executor/spi.h>
+#include <lib/stringinfo.h>
+#include <nodes/parsenodes.h>
+#include <nodes/pg_list.h>
+#include <nodes/value.h>
+#include <optimizer/optimizer.h>
+#include <parser/parse_func.h>
+#include <port/atomics.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <utils/acl.h>
+#include <utils/builtins.h>
+#include <utils/datum.h>
+#include <utils/guc.h>
+#include <utils/inval.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/plancache.h>
+#include <utils/rel.h>
+
+#include "median_cache.h"
+
+/** Max size of a (by-reference) median kept in the cache, bigger ones
+    aren't */
+#define MEDIAN_CACHE_VALUE_SIZE 128
+
+/** Max size of the key of a median kept in the cache, longer ones aren't */
+#define MEDIAN_CACHE_KEY_SIZE 256
+
+/** Number of change counters. Relations share them by a hash, which only
+    makes one's changes invalidate the cached medians of the others. */
+#define MEDIAN_CACHE_COUNTERS 4096
+
+/** Number of entries of the cache, by `median.cache_size` */
+static int	median_cache_size = 1024;
+
+/** A median of the cache */
+struct MedianCacheValue
+{
+	Oid			dbid;
+	Oid			relid;
+	/** Of the median */
+	Oid			typid;
+	/** Hash of the rest of the query, in `keydata` */
+	uint64		key;
+	/** The change count of the relation before the query */
+	uint64		changes;
+	bool		isnull;
+	/** Size of a by-reference median, in `data` */
+	uint32		len;
+	/** A by-value median */
+	Datum		value;
+	char		data[MEDIAN_CACHE_VALUE_SIZE];
+	/** Size of the key, in `keydata` */
+	uint32		keylen;
+	/** The rest of the query: the collation, user, search path, date and
+	    time settings, column and predicate */
+	char		keydata[MEDIAN_CACHE_KEY_SIZE];
+};
+
+struct MedianCacheEntry
+{
+	/** Odd while the `value` is being written */
+	pg_atomic_uint32 seq;
+	struct MedianCacheValue value;
+};
+
+/** The cache, in shared memory */
+struct MedianCache
+{
+	pg_atomic_uint64 changes[MEDIAN_CACHE_COUNTERS];
+	int			size;
+	struct MedianCacheEntry entries[FLEXIBLE_ARRAY_MEMBER];
+};
+
+/** The cache, once attached, if the module was preloaded, else NULL */
+static struct MedianCache *median_cache = NULL;
+
+int64		median_cache_hits = 0;
+int64		median_cache_misses = 0;
+
+/** The relations this transaction changed, to count a change of each at
+    its end, in `TopTransactionContext` */
+static List *median_cache_changed = NIL;
+
+static shmem_startup_hook_type median_prev_shmem_startup_hook = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type median_prev_shmem_request_hook = NULL;
+#endif
+
+static Size
+median_cache_shmem_size(void)
+{
+	return add_size(offsetof(struct MedianCache, entries),
+					mul_size(median_cache_size, sizeof(struct MedianCacheEntry)));
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+median_cache_shmem_request(void)
+{
+	if (median_prev_shmem_request_hook)
+	{
+		median_prev_shmem_request_hook();
+	}
+	RequestAddinShmemSpace(median_cache_shmem_size());
+}
+#endif
+
+static void
+median_cache_shmem_startup(void)
+{
+	bool		found;
+	int			i;
+
+	if (median_prev_shmem_startup_hook)
+	{
+		median_prev_shmem_startup_hook();
+	}
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	median_cache = ShmemInitStruct("median cache", median_cache_shmem_size(), &found);
+	if (!found)
+	{
+		for (i = 0; i < MEDIAN_CACHE_COUNTERS; ++i)
+		{
+			pg_atomic_init_u64(&median_cache->changes[i], 0);
+		}
+		median_cache->size = median_cache_size;
+		for (i = 0; i < median_cache_size; ++i)
+		{
+			pg_atomic_init_u32(&median_cache->entries[i].seq, 0);
+			memset(&median_cache->entries[i].value, 0, sizeof median_cache->entries[i].value);
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/* The change counter of the relation `relid` (of this database) */
+static inline pg_atomic_uint64 *
+median_cache_counter(Oid relid)
+{
+	uint32		h = hash_combine(murmurhash32(MyDatabaseId), murmurhash32(relid));
+
+	return &median_cache->changes[h % MEDIAN_CACHE_COUNTERS];
+}
+
+/* Counts a change of the relation `relid`, or, if invalid, of all of them */
+static void
+median_cache_count_change(Oid relid)
+{
+	int			i;
+
+	if (OidIsValid(relid))
+	{
+		pg_atomic_fetch_add_u64(median_cache_counter(relid), 1);
+		return;
+	}
+	for (i = 0; i < MEDIAN_CACHE_COUNTERS; ++i)
+	{
+		pg_atomic_fetch_add_u64(&median_cache->changes[i], 1);
+	}
+}
+
+/*
+ * Counts a change of the relations changed by the transaction, at its
+ * end. Its changes, if it commits, are then visible to new snapshots.
+ * A prepared transaction would commit elsewhere, without counting them.
+ */
+static void
+median_cache_xact_callback(XactEvent event, void *arg)
+{
+	ListCell   *lc;
+
+	switch (event)
+	{
+		case XACT_EVENT_PRE_PREPARE:
+			if (median_cache_changed != NIL)
+			{
+				elog(ERROR, "can't prepare a transaction which changed a relation of median_cached()");
+			}
+			break;
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			foreach(lc, median_cache_changed)
+			{
+				median_cache_count_change(lfirst_oid(lc));
+			}
+			median_cache_changed = NIL;
+			break;
+		default:
+			break;
+	}
+}
+
+/* A relation (or, if `relid` is invalid, any) was altered, or vacuumed */
+static void
+median_cache_relcache_callback(Datum arg, Oid relid)
+{
+	if (NULL != median_cache)
+	{
+		median_cache_count_change(relid);
+	}
+}
+
+void
+median_cache_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+	{
+		return;
+	}
+	DefineCustomIntVariable("median.cache_size",
+							"Number of medians of median_cached() kept in shared memory.",
+							"0 turns the cache off. Only applies to a module "
+							"loaded by shared_preload_libraries.",
+							&median_cache_size,
+							1024,
+							0, 1024 * 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+	if (median_cache_size == 0)
+	{
+		return;
+	}
+#if PG_VERSION_NUM >= 150000
+	median_prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = median_cache_shmem_request;
+#else
+	RequestAddinShmemSpace(median_cache_shmem_size());
+#endif
+	median_prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = median_cache_shmem_startup;
+	RegisterXactCallback(median_cache_xact_callback, NULL);
+	CacheRegisterRelcacheCallback(median_cache_relcache_callback, (Datum) 0);
+}
+
+/*
+ * Copies the entry `e` into `v`, unless it's being written, or was
+ * while it was copied.
+ */
+static bool
+median_cache_read(struct MedianCacheEntry *e, struct MedianCacheValue *v)
+{
+	uint32		seq = pg_atomic_read_u32(&e->seq);
+
+	if (seq & 1)
+	{
+		return false;
+	}
+	pg_read_barrier();
+	memcpy(v, &e->value, sizeof *v);
+	pg_read_barrier();
+	return pg_atomic_read_u32(&e->seq) == seq;
+}
+
+/* Writes `v` into the entry `e`, unless another backend is writing it */
+static void
+median_cache_write(struct MedianCacheEntry *e, struct MedianCacheValue const *v)
+{
+	uint32		seq = pg_atomic_read_u32(&e->seq);
+
+	if ((seq & 1) || !pg_atomic_compare_exchange_u32(&e->seq, &seq, seq + 1))
+	{
+		return;
+	}
+	memcpy(&e->value, v, sizeof *v);
+	pg_write_barrier();
+	pg_atomic_write_u32(&e->seq, seq + 2);
+}
+
+/*
+ * Checks that the relation has (enabled) `median_cache_invalidate()`
+ * triggers, of the schema `nsp`, after each of the changes that can make
+ * a cached median of it stale.
+ */
+static void
+median_cache_check_triggers(Relation rel, Oid nsp)
+{
+	int16 const all = TRIGGER_TYPE_INSERT | TRIGGER_TYPE_UPDATE | TRIGGER_TYPE_DELETE |
+		TRIGGER_TYPE_TRUNCATE;
+	Oid			fn = LookupFuncName(list_make2(makeString(get_namespace_name(nsp)),
+											   makeString("median_cache_invalidate")),
+									0, NULL, true);
+	int16		events = 0;
+	int			i;
+
+	for (i = 0; (NULL != rel->trigdesc) && (i < rel->trigdesc->numtriggers); ++i)
+	{
+		Trigger    *t = &rel->trigdesc->triggers[i];
+
+		if ((t->tgfoid == fn) && (t->tgenabled != TRIGGER_DISABLED) && TRIGGER_FOR_AFTER(t->tgtype))
+		{
+			events |= t->tgtype;
+		}
+	}
+	if ((events & all) != all)
+	{
+		elog(ERROR, "relation \"%s\" has no median_cache_invalidate() trigger "
+			 "after each of INSERT, UPDATE, DELETE and TRUNCATE",
+			 RelationGetRelationName(rel));
+	}
+}
+
+/*
+ * The entry of the cache for the median of `column` of the relation
+ * `relid`, of the rows matching `pred` (if not NULL), of type `typid` and
+ * by the collation `collid`, for the current user, search path and date
+ * and time settings, setting the key of `v` to it, or NULL if the key is
+ * too long to keep.
+ */
+static struct MedianCacheEntry *
+median_cache_entry(Oid relid, char const *column, char const *pred, Oid typid, Oid collid,
+				   struct MedianCacheValue *v)
+{
+	StringInfoData key;
+
+	Oid const	userid = GetUserId();
+	List	   *path = fetch_search_path(true);
+	ListCell   *lc;
+
+	initStringInfo(&key);
+	appendBinaryStringInfo(&key, (char const *) &collid, sizeof collid);
+	appendBinaryStringInfo(&key, (char const *) &userid, sizeof userid);
+	foreach(lc, path)
+	{
+		Oid const	nspid = lfirst_oid(lc);
+
+		appendBinaryStringInfo(&key, (char const *) &nspid, sizeof nspid);
+	}
+	list_free(path);
+	appendStringInfoChar(&key, '\0');
+	/* by which the literals of the predicate were read */
+	appendStringInfo(&key, "%s%c%s%c%s%c", GetConfigOption("TimeZone", false, false), '\0',
+					 GetConfigOption("DateStyle", false, false), '\0',
+					 GetConfigOption("IntervalStyle", false, false), '\0');
+	appendStringInfoString(&key, column);
+	appendStringInfoChar(&key, '\0');
+	if (NULL != pred)
+	{
+		appendStringInfoString(&key, pred);
+	}
+	if (key.len > MEDIAN_CACHE_KEY_SIZE)
+	{
+		pfree(key.data);
+		return NULL;
+	}
+	memset(v, 0, sizeof *v);
+	v->dbid = MyDatabaseId;
+	v->relid = relid;
+	v->typid = typid;
+	v->key = hash_bytes_extended((unsigned char const *) key.data, key.len, 0);
+	v->keylen = key.len;
+	memcpy(v->keydata, key.data, key.len);
+	pfree(key.data);
+
+	return &median_cache->entries[hash_combine64(v->key, hash_combine(hash_combine(MyDatabaseId, relid), typid)) %
+								  median_cache->size];
+}
+
+/*
+ * Checks that the query of `median_cached()` prepared as `plan` is the one
+ * `SELECT` of `relid` it's made as, so that the predicate was only an
+ * expression, returning whether its median may be cached: if the
+ * predicate, and the cast of the median, are of nothing but the relation,
+ * by immutable functions.
+ */
+static bool
+median_cache_check_query(SPIPlanPtr plan, Oid relid)
+{
+	List	   *sources = SPI_plan_get_plan_sources(plan);
+	CachedPlanSource *source;
+	Query	   *q;
+	RangeTblEntry *rte;
+
+	if (list_length(sources) != 1)
+	{
+		elog(ERROR, "median_cached predicate is not an expression");
+		return false;
+	}
+	source = (CachedPlanSource *) linitial(sources);
+	if (list_length(source->query_list) != 1)
+	{
+		elog(ERROR, "median_cached predicate is not an expression");
+		return false;
+	}
+	q = (Query *) linitial(source->query_list);
+	if ((q->commandType != CMD_SELECT) || (NULL != q->utilityStmt) || (NULL != q->setOperations) ||
+		(q->cteList != NIL) || (q->sortClause != NIL) || (q->groupClause != NIL) ||
+		(q->groupingSets != NIL) || (NULL != q->havingQual) || (q->windowClause != NIL) ||
+		(q->distinctClause != NIL) || (NULL != q->limitOffset) || (NULL != q->limitCount) ||
+		(q->rowMarks != NIL) || q->hasWindowFuncs || q->hasTargetSRFs ||
+		(list_length(q->targetList) != 1) || (list_length(q->jointree->fromlist) != 1))
+	{
+		elog(ERROR, "median_cached predicate is not an expression");
+		return false;
+	}
+	if (q->hasSubLinks || (list_length(q->rtable) != 1) ||
+		contain_mutable_functions(q->jointree->quals) ||
+		contain_mutable_functions((Node *) q->targetList))
+	{
+		return false;
+	}
+	rte = (RangeTblEntry *) linitial(q->rtable);
+
+	return (rte->rtekind == RTE_RELATION) && (rte->relid == relid);
+}
+
+PG_FUNCTION_INFO_V1(median_cached);
+
+/*
+ * The median of the column (the second argument) of the relation (the
+ * first one), of its rows that match the predicate (the third one, NULL
+ * for all of them), of the type of the fourth argument, from the cache,
+ * or else by a query, whose result is then cached.
+ */
+Datum
+median_cached(PG_FUNCTION_ARGS)
+{
+	Oid const	typid = get_fn_expr_argtype(fcinfo->flinfo, 3);
+	Oid const	nsp = get_func_namespace(fcinfo->flinfo->fn_oid);
+	Oid			relid;
+	char	   *column;
+	char	   *pred;
+	Relation	rel;
+	bool		cacheable;
+	SPIPlanPtr	plan;
+	int16		typlen;
+	bool		typbyval;
+	StringInfoData query;
+	struct MedianCacheEntry *e = NULL;
+	struct MedianCacheValue v;
+	struct MedianCacheValue hit;
+	uint64		changes = 0;
+	Datum		result;
+	bool		isnull;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+	{
+		elog(ERROR, "median_cached of a NULL relation or column");
+		PG_RETURN_NULL();
+	}
+	relid = PG_GETARG_OID(0);
+	column = NameStr(*PG_GETARG_NAME(1));
+	pred = PG_ARGISNULL(2) ? NULL : text_to_cstring(PG_GETARG_TEXT_PP(2));
+	get_typlenbyval(typid, &typlen, &typbyval);
+
+	/* the lock is kept until the end of the transaction */
+	rel = relation_open(relid, AccessShareLock);
+	median_cache_check_triggers(rel, nsp);
+	cacheable = (NULL != median_cache) && !IsolationUsesXactSnapshot() &&
+		!list_member_oid(median_cache_changed, relid) && !rel->rd_rel->relrowsecurity &&
+		(rel->rd_rel->relkind != RELKIND_PARTITIONED_TABLE) && !rel->rd_rel->relhassubclass &&
+		(pg_class_aclcheck(relid, GetUserId(), ACL_SELECT) == ACLCHECK_OK);
+	relation_close(rel, NoLock);
+
+	initStringInfo(&query);
+	appendStringInfo(&query, "SELECT %s.median(%s)::%s FROM %s",
+					 quote_identifier(get_namespace_name(nsp)),
+					 quote_identifier(column),
+					 format_type_be_qualified(typid),
+					 quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+												get_rel_name(relid)));
+	if (NULL != pred)
+	{
+		appendStringInfo(&query, " WHERE (%s)", pred);
+	}
+	if (SPI_connect() != SPI_OK_CONNECT)
+	{
+		elog(ERROR, "median_cached couldn't connect to SPI");
+		PG_RETURN_NULL();
+	}
+	plan = SPI_prepare(query.data, 0, NULL);
+	if (NULL == plan)
+	{
+		elog(ERROR, "median_cached query failed: %s", query.data);
+		PG_RETURN_NULL();
+	}
+	if (!median_cache_check_query(plan, relid))
+	{
+		cacheable = false;
+	}
+
+	if (cacheable)
+	{
+		e = median_cache_entry(relid, column, pred, typid, PG_GET_COLLATION(), &v);
+	}
+	if (NULL != e)
+	{
+		changes = pg_atomic_read_u64(median_cache_counter(relid));
+		if (median_cache_read(e, &hit) && (hit.dbid == v.dbid) && (hit.relid == v.relid) &&
+			(hit.typid == v.typid) && (hit.key == v.key) && (hit.changes == changes) &&
+			(hit.keylen == v.keylen) && (memcmp(hit.keydata, v.keydata, v.keylen) == 0))
+		{
+			SPI_finish();
+			++median_cache_hits;
+			if (hit.isnull)
+			{
+				PG_RETURN_NULL();
+			}
+			if (typbyval)
+			{
+				PG_RETURN_DATUM(hit.value);
+			}
+			result = PointerGetDatum(palloc(hit.len));
+			memcpy(DatumGetPointer(result), hit.data, hit.len);
+			PG_RETURN_DATUM(result);
+		}
+		/* the snapshot of the query is taken after the count was read */
+		pg_read_barrier();
+	}
+	++median_cache_misses;
+
+	if ((SPI_execute_plan(plan, NULL, NULL, false, 1) != SPI_OK_SELECT) || (SPI_processed != 1))
+	{
+		elog(ERROR, "median_cached query failed: %s", query.data);
+		PG_RETURN_NULL();
+	}
+	result = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+	if (!isnull)
+	{
+		result = SPI_datumTransfer(result, typbyval, typlen);
+	}
+	SPI_finish();
+	if (!isnull && (typlen == -1))
+	{
+		result = PointerGetDatum(PG_DETOAST_DATUM_PACKED(result));
+	}
+
+	if (NULL != e)
+	{
+		v.changes = changes;
+		v.isnull = isnull;
+		if (isnull || typbyval)
+		{
+			v.value = isnull ? (Datum) 0 : result;
+			median_cache_write(e, &v);
+		}
+		else if (datumGetSize(result, typbyval, typlen) <= MEDIAN_CACHE_VALUE_SIZE)
+		{
+			v.len = datumGetSize(result, typbyval, typlen);
+			memcpy(v.data, DatumGetPointer(result), v.len);
+			median_cache_write(e, &v);
+		}
+	}
+
+	if (isnull)
+	{
+		PG_RETURN_NULL();
+	}
+	PG_RETURN_DATUM(result);
+}
+
+PG_FUNCTION_INFO_V1(median_cache_invalidate);
+
+/*
+ * The trigger of the relations of `median_cached()`: counts a change of
+ * the relation, now, for the snapshots of this transaction, and at its
+ * end, for the others.
+ */
+Datum
+median_cache_invalidate(PG_FUNCTION_ARGS)
+{
+	Oid			relid;
+	MemoryContext old;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+	{
+		elog(ERROR, "median_cache_invalidate not called as a trigger");
+		PG_RETURN_NULL();
+	}
+	if (NULL != median_cache)
+	{
+		relid = RelationGetRelid(((TriggerData *) fcinfo->context)->tg_relation);
+		median_cache_count_change(relid);
+		old = MemoryContextSwitchTo(TopTransactionContext);
+		median_cache_changed = list_append_unique_oid(median_cache_changed, relid);
+		MemoryContextSwitchTo(old);
+	}
+
+	PG_RETURN_POINTER(NULL);
+}
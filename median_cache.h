@@ -0,0 +1,21 @@
+/* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
+/*
+ * median_cache.h
+ *
+ * The cache of `median_cached()` results, in shared memory, for the same
+ * medians queried over and over on data that seldom changes. It's only
+ * there if the module is in `shared_preload_libraries`.
+ */
+#ifndef MEDIAN_CACHE_H
+#define MEDIAN_CACHE_H
+
+/** The calls of `median_cached()` of this backend answered from the
+    cache, and by a query (whether or not its median could be cached),
+    since they were reset, see `median_stats` */
+extern int64 median_cache_hits;
+extern int64 median_cache_misses;
+
+/** Defines `median.cache_size` and, when preloaded, asks for the memory */
+extern void median_cache_init(void);
+
+#endif							/* MEDIAN_CACHE_H */
@@ -0,0 +1,1243 @@
+/* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
+/*
+ * median_engine.c
+ *
+ * The helpers of the engines that don't depend on the value class (the
+ * pages, the tree, the sketch, the text arena and the spilled runs), and
+ * the engines of the by-value classes, integers and floats, with their
+ * radix select and packing, see median_engine.h.
+ */
+#include <postgres.h>
+#include <math.h>
+#include <miscadmin.h>
+#include <libpq/pqformat.h>
+#include <port/pg_bitutils.h>
+#include <storage/buffile.h>
+#include <utils/memutils.h>
+
+#include "median_engine.h"
+#include "median_simd.h"
+
+/* The settings of the engines, defined (with the same defaults) by `_PG_init` */
+int			median_small_window_threshold = 512;
+bool		median_spill = false;
+int			median_select = msQuick;
+bool		median_track_stats = false;
+int			median_engine = -1;
+
+const char *const median_engine_names[] = {
+	[meSorted] = "sorted",
+	[meAppend] = "append",
+	[meSketch] = "sketch",
+	[meCounts] = "counts",
+	[meHeap] = "heap",
+	[meTree] = "tree",
+	[meFlat] = "flat"
+};
+
+/** The (arena) size of a text value of `len` bytes */
+#define MEDIAN_TEXT_SIZE(len) \
+	((((len) + VARHDRSZ_SHORT) <= VARATT_SHORT_MAX) ? ((len) + VARHDRSZ_SHORT) : ((len) + VARHDRSZ))
+
+/* The memory taken by the state and its elements */
+size_t
+median_state_size(struct MedianState *pms)
+{
+	size_t		size = sizeof *pms + pms->datamem;
+	size_t		i;
+
+	if ((NULL != pms->buf.i) && (pms->buf.i != pms->inl.i))
+	{
+		size += pms->cap * MEDIAN_ELEM_SIZE(pms);
+	}
+	for (i = 0; i < pms->npages; ++i)
+	{
+		size += MEDIAN_PAGE_SIZE(pms, pms->pages[i]->cap);
+	}
+	size += pms->pagescap * sizeof pms->pages[0];
+	if (NULL != pms->stage.d)
+	{
+		size += MEDIAN_STAGE_CAP * sizeof(Datum);
+	}
+	if (NULL != pms->mid)
+	{
+		size += sizeof *pms->mid;
+	}
+	if (NULL != pms->runs)
+	{
+		size += sizeof *pms->runs + pms->runs->cap * sizeof pms->runs->at[0];
+	}
+	if (NULL != pms->tree)
+	{
+		size += sizeof *pms->tree + pms->tree->cap * sizeof pms->tree->nodes[0];
+	}
+	if (NULL != pms->arena)
+	{
+		size += sizeof *pms->arena + pms->arena->live + pms->arena->dead;
+	}
+	if (NULL != pms->counts)
+	{
+		size += sizeof *pms->counts + ((NULL != pms->counts->n) ? pms->cap * sizeof(uint64) : 0);
+	}
+	if (NULL != pms->sketch)
+	{
+		size += sizeof *pms->sketch;
+	}
+	if (NULL != pms->spill)
+	{
+		size += sizeof *pms->spill + pms->spill->mem.maxlen;
+	}
+	if (NULL != pms->stats)
+	{
+		size += sizeof *pms->stats;
+	}
+	return size;
+}
+
+/*
+ * Resizes the unsorted buffer to `ncap` elements, moving them out of the
+ * state, if they are still kept in it.
+ */
+void
+median_resize_buf(struct MedianState *pms, size_t ncap)
+{
+	size_t const to_alloc = ncap * MEDIAN_ELEM_SIZE(pms);
+
+	if (pms->buf.i == pms->inl.i)
+	{
+		pms->buf.i = MemoryContextAllocHuge(pms->ctx, to_alloc);
+		memcpy(pms->buf.i, pms->inl.i, pms->dim * MEDIAN_ELEM_SIZE(pms));
+	}
+	else
+	{
+		pms->buf.i = (NULL == pms->buf.i) ?
+			MemoryContextAllocHuge(pms->ctx, to_alloc) :
+			repalloc_huge(pms->buf.i, to_alloc);
+	}
+	pms->cap = ncap;
+	stats_grown(pms);
+}
+
+/* Makes sure the unsorted buffer has room for (at least) `n` elements */
+void
+median_reserve_buf(struct MedianState *pms, size_t n)
+{
+	if (n > pms->cap)
+	{
+		median_resize_buf(pms, Max(n, MEDIAN_FIRST_BUF_CAP));
+	}
+}
+
+/*
+ * Makes sure the unsorted buffer has room for (at least) `n` elements,
+ * growing it by half, at least, as `median_expand_if_need_be` does, so that the
+ * states of many partitions, appended one after the other by the combine
+ * function, aren't all copied again for every one of them.
+ */
+void
+median_grow_buf(struct MedianState *pms, size_t n)
+{
+	if (n > pms->cap)
+	{
+		median_resize_buf(pms, Max(n, Max((pms->cap * 3) / 2, MEDIAN_FIRST_BUF_CAP)));
+	}
+}
+
+/* Records that a sorted run of the buffer starts at `at` (see `runs`) */
+void
+median_runs_add(struct MedianState *pms, size_t at)
+{
+	struct MedianRuns *runs = MEDIAN_PART(pms, runs);
+
+	if (runs->n == runs->cap)
+	{
+		size_t const ncap = Max(runs->cap * 2, 16);
+
+		runs->at = (NULL == runs->at) ?
+			MemoryContextAlloc(pms->ctx, ncap * sizeof runs->at[0]) :
+			repalloc(runs->at, ncap * sizeof runs->at[0]);
+		runs->cap = ncap;
+	}
+	runs->at[runs->n++] = at;
+}
+
+struct MedianState *
+median_expand_if_need_be(struct MedianState *pms)
+{
+	if (pms->dim >= pms->cap)
+	{
+		size_t		ncap = Max((pms->cap * 3) / 2, MEDIAN_FIRST_BUF_CAP);
+
+		if (ncap < pms->cap)
+		{
+			elog(ERROR, "Overflow while expanding array for median");
+			return pms;
+		}
+		median_resize_buf(pms, ncap);
+	}
+	return pms;
+}
+
+struct MedianPage *
+create_MedianPage(struct MedianState *pms, size_t ncap)
+{
+	struct MedianPage *pg = MemoryContextAlloc(pms->ctx, MEDIAN_PAGE_SIZE(pms, ncap));
+
+	if (NULL == pg)
+	{
+		elog(ERROR, "create_MedianPage() no memory");
+		return NULL;
+	}
+	pg->cap = ncap;
+	pg->dim = 0;
+
+	return pg;
+}
+
+/* Grows the (not yet full-sized) page `ipg` by 1.5x */
+struct MedianPage *
+median_expand_page(struct MedianState *pms, size_t ipg)
+{
+	struct MedianPage *pg = pms->pages[ipg];
+	size_t		ncap = (pg->cap * 3) / 2;
+
+	if (ncap > MEDIAN_PAGE_CAP)
+	{
+		ncap = MEDIAN_PAGE_CAP;
+	}
+	pg = repalloc(pg, MEDIAN_PAGE_SIZE(pms, ncap));
+	if (NULL == pg)
+	{
+		elog(ERROR, "No memory while expanding page for median");
+		return pms->pages[ipg];
+	}
+	pg->cap = ncap;
+	pms->pages[ipg] = pg;
+	stats_grown(pms);
+
+	return pg;
+}
+
+/*
+ * Inserts a new (full-sized) page at position `at` of the directory,
+ * holding a copy of the `n` elements at `src`.
+ */
+struct MedianPage *
+median_insert_page(struct MedianState *pms, size_t at, void const *src, size_t n)
+{
+	struct MedianPage *pg;
+
+	if (pms->npages >= pms->pagescap)
+	{
+		size_t		ncap = pms->pagescap * 2;
+
+		if (ncap < pms->pagescap)
+		{
+			elog(ERROR, "Overflow while expanding page directory for median");
+			return NULL;
+		}
+		pms->pages = repalloc(pms->pages, ncap * sizeof pms->pages[0]);
+		pms->pagescap = ncap;
+	}
+	pg = create_MedianPage(pms, MEDIAN_PAGE_CAP);
+	if (n > 0)
+	{
+		memcpy(&pg->data, src, n * MEDIAN_ELEM_SIZE(pms));
+		pg->dim = n;
+	}
+	MEDIAN_STAT(pms, moved, (pms->npages - at) * sizeof pms->pages[0]);
+	memmove(pms->pages + at + 1, pms->pages + at, (pms->npages - at) * sizeof pms->pages[0]);
+	pms->pages[at] = pg;
+	++pms->npages;
+	stats_grown(pms);
+
+	return pg;
+}
+
+/*
+ * Moves the upper half of the (full) page `ipg` to a new next page, and the
+ * `mid` element along with it.
+ */
+void
+median_split_page(struct MedianState *pms, size_t ipg)
+{
+	struct MedianPage *pg = pms->pages[ipg];
+	size_t		keep = pg->dim / 2;
+
+	median_insert_page(pms, ipg + 1, (char *) &pg->data + keep * MEDIAN_ELEM_SIZE(pms), pg->dim - keep);
+	pg->dim = keep;
+	if (NULL == pms->mid)
+	{
+		return;
+	}
+	if (pms->mid->ipg > ipg)
+	{
+		++pms->mid->ipg;
+	}
+	else if ((pms->mid->ipg == ipg) && (pms->mid->i >= keep))
+	{
+		++pms->mid->ipg;
+		pms->mid->i -= keep;
+	}
+}
+
+/*
+ * Finds the page holding the element at position `*rank`, setting
+ * `*rank` to the position within that page. That's by stepping from the
+ * `mid` element, when it's valid, over the pages in between, else by
+ * walking the pages from the first one. It's then the `mid` element.
+ */
+size_t
+median_page_of_rank(struct MedianState *pms, size_t *rank)
+{
+	struct MedianMid *mid = MEDIAN_PART(pms, mid);
+	size_t		ipg;
+	size_t		i;
+
+	Assert(*rank < pms->dim);
+	if (mid->dim == pms->dim)
+	{
+		ipg = mid->ipg;
+		if (*rank >= mid->rank)
+		{
+			for (i = mid->i + (*rank - mid->rank); i >= pms->pages[ipg]->dim; ++ipg)
+			{
+				i -= pms->pages[ipg]->dim;
+			}
+		}
+		else
+		{
+			size_t		back = mid->rank - *rank;
+
+			/* from past the end of the page before, when it's not in this one */
+			for (i = mid->i; back > i; i = pms->pages[--ipg]->dim)
+			{
+				back -= i;
+			}
+			i -= back;
+		}
+	}
+	else
+	{
+		for (ipg = 0, i = *rank; i >= pms->pages[ipg]->dim; ++ipg)
+		{
+			i -= pms->pages[ipg]->dim;
+		}
+	}
+	mid->ipg = ipg;
+	mid->i = i;
+	mid->rank = *rank;
+	mid->dim = pms->dim;
+	*rank = i;
+	return ipg;
+}
+
+/* Sets up an empty tree, with room for (at least) `n` elements */
+void
+median_init_tree(struct MedianState *pms, size_t n)
+{
+	struct MedianTree *tree = MEDIAN_PART(pms, tree);
+	size_t		ncap = Max(n + 1, MEDIAN_FIRST_TREE_CAP);
+
+	tree->nodes = MemoryContextAllocHuge(pms->ctx, ncap * sizeof tree->nodes[0]);
+	/* the "nil" node */
+	memset(tree->nodes, 0, sizeof tree->nodes[0]);
+	tree->nnodes = 1;
+	tree->cap = ncap;
+	tree->root = 0;
+	tree->freelist = 0;
+	tree->seed = 2463534242u;
+}
+
+/*
+ * The `k` of a sketch whose ranks are to be within `accuracy`. This is the
+ * (empirical) error bound of a KLL sketch, eps = 2.296 / k^0.9723, for 99%
+ * confidence.
+ */
+uint32
+median_sketch_k(float8 accuracy)
+{
+	float8		k;
+
+	if (!(accuracy > 0) || !(accuracy < 1))
+	{
+		elog(ERROR, "approx_median accuracy must be between 0 and 1, not %g", accuracy);
+		return 0;
+	}
+	k = ceil(pow(2.296 / accuracy, 1 / 0.9723));
+
+	return (k > MEDIAN_SKETCH_MAX_K) ? MEDIAN_SKETCH_MAX_K : Max((uint32) k, MEDIAN_SKETCH_MIN_K);
+}
+
+/* Sets the `k` of the sketch, and its capacity, which depends on it */
+void
+median_sketch_set_k(struct MedianState *pms, uint32 k)
+{
+	size_t		h;
+
+	pms->sketch->k = k;
+	pms->sketch->capacity = 0;
+	for (h = 0; h < pms->npages; ++h)
+	{
+		pms->sketch->capacity += sketch_level_cap(pms, h);
+	}
+}
+
+/* Makes sure level `h` of the sketch exists and has room for `n` elements */
+struct MedianPage *
+median_sketch_reserve(struct MedianState *pms, size_t h, size_t n)
+{
+	struct MedianPage *pg;
+
+	if (h >= pms->npages)
+	{
+		if (h >= pms->pagescap)
+		{
+			pms->pagescap = Max(2 * pms->pagescap, h + 1);
+			pms->pages = repalloc(pms->pages, pms->pagescap * sizeof pms->pages[0]);
+		}
+		while (pms->npages <= h)
+		{
+			pms->pages[pms->npages++] = create_MedianPage(pms, Max(n, MEDIAN_SKETCH_MIN_CAP));
+		}
+		median_sketch_set_k(pms, pms->sketch->k);
+	}
+	pg = pms->pages[h];
+	if (n > pg->cap)
+	{
+		size_t const ncap = Max(n, (pg->cap * 3) / 2);
+
+		pg = repalloc_huge(pg, MEDIAN_PAGE_SIZE(pms, ncap));
+		pg->cap = ncap;
+		pms->pages[h] = pg;
+		stats_grown(pms);
+	}
+
+	return pg;
+}
+
+/* Adds a chunk to the text arena, with room for (at least) `need` bytes */
+static void
+arena_add_chunk(struct MedianState *pms, size_t need)
+{
+	struct MedianChunk *c;
+	size_t		size = Max(pms->arena->chunksize, MEDIAN_FIRST_CHUNK_SIZE);
+
+	pms->arena->chunksize = Min(size * 2, MEDIAN_MAX_CHUNK_SIZE);
+	size = Max(size, need);
+	c = MemoryContextAllocHuge(pms->ctx, offsetof(struct MedianChunk, data) + size);
+	c->next = pms->arena->chunks;
+	pms->arena->chunks = c;
+	pms->arena->free = c->data;
+	pms->arena->end = c->data + size;
+	stats_grown(pms);
+}
+
+/*
+ * Stores the `len` bytes of string `data`, followed by the `keylen` bytes of
+ * its sort key, in the arena, as a varlena, with a short header if it fits.
+ */
+text *
+median_arena_store(struct MedianState *pms, char const *data, uint32 len, char const *key, uint32 keylen)
+{
+	size_t const size = MEDIAN_TEXT_SIZE(len + keylen);
+	bool const	isshort = (size == len + keylen + VARHDRSZ_SHORT);
+	char	   *p = isshort ? pms->arena->free : (char *) INTALIGN(pms->arena->free);
+
+	if ((NULL == pms->arena->free) || (p > pms->arena->end) || ((size_t) (pms->arena->end - p) < size))
+	{
+		arena_add_chunk(pms, size);
+		p = pms->arena->free;
+	}
+	if (isshort)
+	{
+		SET_VARSIZE_SHORT(p, size);
+	}
+	else
+	{
+		SET_VARSIZE(p, size);
+	}
+	memcpy(p + (size - len - keylen), data, len);
+	if (keylen > 0)
+	{
+		memcpy(p + (size - keylen), key, keylen);
+	}
+	pms->arena->free = p + size;
+	pms->arena->live += size;
+
+	return (text *) p;
+}
+
+static void
+arena_move(struct MedianState *pms, struct MedianText *x)
+{
+	x->ptr = median_arena_store(pms, VARDATA_ANY(x->ptr), VARSIZE_ANY_EXHDR(x->ptr), NULL, 0);
+}
+
+static void
+arena_move_tree(struct MedianState *pms, uint32 t)
+{
+	while (t != 0)
+	{
+		struct MedianNode *nd = &pms->tree->nodes[t];
+
+		arena_move(pms, &nd->val.t);
+		arena_move_tree(pms, nd->left);
+		t = nd->right;
+	}
+}
+
+static void
+arena_free_chunks(struct MedianChunk *c)
+{
+	while (NULL != c)
+	{
+		struct MedianChunk *next = c->next;
+
+		pfree(c);
+		c = next;
+	}
+}
+
+/* Moves the live values to new chunks, freeing the old ones */
+void
+median_arena_compact(struct MedianState *pms)
+{
+	struct MedianChunk *old = pms->arena->chunks;
+	size_t		i;
+
+	pms->arena->chunks = NULL;
+	pms->arena->free = pms->arena->end = NULL;
+	pms->arena->live = pms->arena->dead = 0;
+	switch (pms->engine)
+	{
+		case meSorted:
+		case meSketch:
+			for (i = 0; i < pms->npages; ++i)
+			{
+				size_t		j;
+
+				for (j = 0; j < pms->pages[i]->dim; ++j)
+				{
+					arena_move(pms, &pms->pages[i]->data.t[j]);
+				}
+			}
+			break;
+		case meAppend:
+		case meHeap:
+		case meFlat:
+			for (i = 0; i < pms->dim; ++i)
+			{
+				arena_move(pms, &pms->buf.t[i]);
+			}
+			break;
+		case meCounts:
+			for (i = 0; i < pms->counts->size; ++i)
+			{
+				arena_move(pms, &pms->buf.t[i]);
+			}
+			break;
+		case meTree:
+			arena_move_tree(pms, pms->tree->root);
+			break;
+	}
+	arena_free_chunks(old);
+}
+
+/* Frees all the values in the arena, if there's one (of text) */
+void
+median_arena_reset(struct MedianState *pms)
+{
+	if (NULL == pms->arena)
+	{
+		return;
+	}
+	arena_free_chunks(pms->arena->chunks);
+	pms->arena->chunks = NULL;
+	pms->arena->free = pms->arena->end = NULL;
+	pms->arena->live = pms->arena->dead = 0;
+}
+
+/*
+ * Integers and floats of a `median_sketch` are in network byte order, as
+ * `int8` and `float8`, so that it can be moved to any other server.
+ * Integers are checked to be in the range of the type.
+ */
+static void
+write_int_array(StringInfo buf, int64 const *v, size_t n)
+{
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		pq_sendint64(buf, v[i]);
+	}
+}
+
+static void
+read_int_array(StringInfo buf, int64 *v, size_t n, struct MedianState *pms)
+{
+	int const	shift = pms->ti->shift;
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		int64 const x = pq_getmsgint64(buf);
+
+		if (((int64) ((uint64) x << shift) >> shift) != x)
+		{
+			elog(ERROR, "median_sketch value " INT64_FORMAT " out of range for type oid=%u",
+				 x, pms->ti->typid);
+			return;
+		}
+		v[i] = x;
+	}
+}
+
+static void
+write_float_array(StringInfo buf, float8 const *v, size_t n)
+{
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		pq_sendfloat8(buf, v[i]);
+	}
+}
+
+static void
+read_float_array(StringInfo buf, float8 *v, size_t n)
+{
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		v[i] = pq_getmsgfloat8(buf);
+	}
+}
+
+/*
+ * Integers of a block of a spilled run are packed, as the least of them
+ * and the width (`int64` and `uint64`) and then their differences from
+ * the least in that many bits, by `median_pack`. The elements of a block
+ * of a sorted run of integer or date/time values are close to each
+ * other, so that they usually take several times fewer bytes packed.
+ */
+static void
+pack_int_array(StringInfo buf, int64 const *v, size_t n)
+{
+	int64		lo = v[0];
+	int64		hi = v[0];
+	uint64		width = 0;
+	size_t		size;
+	size_t		i;
+
+	for (i = 1; i < n; ++i)
+	{
+		lo = Min(lo, v[i]);
+		hi = Max(hi, v[i]);
+	}
+	if (hi != lo)
+	{
+		width = pg_leftmost_one_pos64((uint64) hi - (uint64) lo) + 1;
+	}
+	size = MEDIAN_PACKED_WORDS(n, width) * sizeof(uint64);
+	appendBinaryStringInfo(buf, (char const *) &lo, sizeof lo);
+	appendBinaryStringInfo(buf, (char const *) &width, sizeof width);
+	enlargeStringInfo(buf, size);
+	memset(buf->data + buf->len, 0, size);
+	median_pack(v, n, width, lo, (uint64 *) (buf->data + buf->len));
+	buf->len += size;
+	buf->data[buf->len] = '\0';
+}
+
+/* The `n` integers packed by `pack_int_array` (at the start of `buf`) */
+static void
+unpack_int_array(StringInfo buf, int64 *v, size_t n)
+{
+	int64		lo;
+	uint64		width;
+
+	memcpy(&lo, pq_getmsgbytes(buf, sizeof lo), sizeof lo);
+	memcpy(&width, pq_getmsgbytes(buf, sizeof width), sizeof width);
+	median_simd.unpack((uint64 const *) pq_getmsgbytes(buf, MEDIAN_PACKED_WORDS(n, width) * sizeof(uint64)),
+					   width, lo, v, n);
+}
+
+/* Like `float8_cmp_internal()`: NaNs are equal, and greater than others */
+static inline int
+float_cmp(float8 a, float8 b)
+{
+	if (unlikely(isnan(a)))
+	{
+		return isnan(b) ? 0 : 1;
+	}
+	if (unlikely(isnan(b)))
+	{
+		return -1;
+	}
+	return (a > b) - (a < b);
+}
+
+/* Starts a new run, of `n` elements, after the ones kept in memory */
+void
+median_spill_begin_run(struct MedianState *pms, size_t n)
+{
+	struct MedianRun *run;
+
+	if (NULL == pms->spill->mem.data)
+	{
+		MemoryContext old = MemoryContextSwitchTo(pms->ctx);
+
+		initStringInfo(&pms->spill->mem);
+		MemoryContextSwitchTo(old);
+	}
+	if (pms->spill->nruns >= pms->spill->runscap)
+	{
+		pms->spill->runscap = Max(2 * pms->spill->runscap, 8);
+		pms->spill->runs = (NULL == pms->spill->runs) ?
+			MemoryContextAlloc(pms->ctx, pms->spill->runscap * sizeof pms->spill->runs[0]) :
+			repalloc(pms->spill->runs, pms->spill->runscap * sizeof pms->spill->runs[0]);
+	}
+	run = &pms->spill->runs[pms->spill->nruns++];
+	run->fileno = -1;
+	run->offset = pms->spill->mem.len;
+	run->left = n;
+	pms->spill->n += n;
+	MEDIAN_STAT(pms, spill_runs, 1);
+}
+
+/*
+ * Moves the runs kept in memory (which are the last ones) to the end of
+ * the temporary file, including the one being written, which goes on
+ * there.
+ */
+static void
+spill_flush(struct MedianState *pms)
+{
+	size_t		i;
+
+	if (NULL == pms->spill->file)
+	{
+		MemoryContext old = MemoryContextSwitchTo(pms->ctx);
+
+		pms->spill->file = BufFileCreateTemp(false);
+		MemoryContextSwitchTo(old);
+		pms->spill->endfile = 0;
+		pms->spill->endoff = 0;
+	}
+	if (BufFileSeek(pms->spill->file, pms->spill->endfile, pms->spill->endoff, SEEK_SET) != 0)
+	{
+		elog(ERROR, "median could not seek in temporary file");
+	}
+	for (i = 0; i < pms->spill->nruns; ++i)
+	{
+		struct MedianRun *run = &pms->spill->runs[i];
+		size_t const from = run->offset;
+		size_t const to = (i + 1 < pms->spill->nruns) ? pms->spill->runs[i + 1].offset : pms->spill->mem.len;
+
+		if (run->fileno < 0)
+		{
+			BufFileTell(pms->spill->file, &run->fileno, &run->offset);
+			BufFileWrite(pms->spill->file, pms->spill->mem.data + from, to - from);
+		}
+	}
+	BufFileTell(pms->spill->file, &pms->spill->endfile, &pms->spill->endoff);
+	resetStringInfo(&pms->spill->mem);
+}
+
+/*
+ * Writes a block to the run being written, in memory, if the runs kept
+ * there still take up to half the limit (and can be kept in a string),
+ * otherwise to the file.
+ */
+void
+median_spill_write_block(struct MedianState *pms, size_t n, StringInfo data)
+{
+	struct MedianRun const *run = &pms->spill->runs[pms->spill->nruns - 1];
+	uint32		hdr[2];
+
+	hdr[0] = n;
+	hdr[1] = data->len;
+	if ((run->fileno < 0) &&
+		(pms->spill->mem.len + sizeof hdr + data->len > Min(pms->spill->limit, MaxAllocSize) / 2))
+	{
+		spill_flush(pms);
+	}
+	if (run->fileno < 0)
+	{
+		appendBinaryStringInfo(&pms->spill->mem, (char const *) hdr, sizeof hdr);
+		appendBinaryStringInfo(&pms->spill->mem, data->data, data->len);
+	}
+	else
+	{
+		BufFileWrite(pms->spill->file, hdr, sizeof hdr);
+		BufFileWrite(pms->spill->file, data->data, data->len);
+	}
+}
+
+void
+median_spill_end_run(struct MedianState *pms)
+{
+	if (pms->spill->runs[pms->spill->nruns - 1].fileno >= 0)
+	{
+		BufFileTell(pms->spill->file, &pms->spill->endfile, &pms->spill->endoff);
+	}
+}
+
+static void
+spill_read(BufFile *file, void *ptr, size_t size)
+{
+#if PG_VERSION_NUM >= 160000
+	BufFileReadExact(file, ptr, size);
+#else
+	if (BufFileRead(file, ptr, size) != size)
+	{
+		elog(ERROR, "median could not read from temporary file");
+	}
+#endif
+}
+
+/*
+ * Reads the (serialized, or packed) elements of the next block of the run
+ * at `pos` of `pms` into `data`, returning their number.
+ */
+size_t
+median_spill_read_block(struct MedianState *pms, struct MedianRun *pos, StringInfo data)
+{
+	uint32		hdr[2];
+
+	resetStringInfo(data);
+	if (pos->fileno < 0)
+	{
+		memcpy(hdr, pms->spill->mem.data + pos->offset, sizeof hdr);
+		appendBinaryStringInfo(data, pms->spill->mem.data + pos->offset + sizeof hdr, hdr[1]);
+		pos->offset += sizeof hdr + hdr[1];
+		pos->left -= hdr[0];
+
+		return hdr[0];
+	}
+	if (BufFileSeek(pms->spill->file, pos->fileno, pos->offset, SEEK_SET) != 0)
+	{
+		elog(ERROR, "median could not seek in temporary file");
+	}
+	spill_read(pms->spill->file, hdr, sizeof hdr);
+	enlargeStringInfo(data, hdr[1]);
+	spill_read(pms->spill->file, data->data, hdr[1]);
+	data->len = hdr[1];
+	data->data[data->len] = '\0';
+	BufFileTell(pms->spill->file, &pos->fileno, &pos->offset);
+	pos->left -= hdr[0];
+
+	return hdr[0];
+}
+
+/* The temporary file is closed when the aggregate context is */
+void
+median_spill_shutdown(Datum arg)
+{
+	struct MedianState *pms = (struct MedianState *) DatumGetPointer(arg);
+
+	if (NULL == pms->spill)
+	{
+		return;
+	}
+	if (NULL != pms->spill->file)
+	{
+		BufFileClose(pms->spill->file);
+		pms->spill->file = NULL;
+	}
+	pms->spill->nruns = 0;
+	pms->spill->n = 0;
+}
+
+void
+median_reader_init(struct MedianRunReader *r, struct MedianRun const *run)
+{
+	r->pos = *run;
+	r->ctx = AllocSetContextCreate(CurrentMemoryContext, "median run", ALLOCSET_DEFAULT_SIZES);
+	r->blk = NULL;
+	r->i = 0;
+}
+
+/* Reads the next block of the run, returning false at its end */
+bool
+median_reader_next(struct MedianState *pms, struct MedianRunReader *r)
+{
+	StringInfoData data;
+	size_t		n;
+	MemoryContext old;
+
+	if (r->pos.left == 0)
+	{
+		return false;
+	}
+	MemoryContextReset(r->ctx);
+	old = MemoryContextSwitchTo(r->ctx);
+	initStringInfo(&data);
+	MemoryContextSwitchTo(old);
+	n = median_spill_read_block(pms, &r->pos, &data);
+	r->blk = create_MedianState(r->ctx, pms->ti, meAppend);
+	pms->ti->ops->unpack(r->blk, &data, n);
+	r->i = 0;
+
+	return true;
+}
+
+void
+median_reader_end(struct MedianRunReader *r)
+{
+	if (NULL != r->ctx)
+	{
+		MemoryContextDelete(r->ctx);
+	}
+}
+
+/** Bits of the digit of a radix select pass in memory, so that the
+    histogram stays in the L1 cache */
+#define MEDIAN_RADIX_BITS 11
+
+/** Bits of the digit of a radix select pass over spilled runs, where
+    what costs is the passes (reading the runs) */
+#define MEDIAN_RADIX_SPILL_BITS 16
+
+/* The `int64`, as unsigned, in the same order */
+static inline uint64
+radix_key(int64 x)
+{
+	return (uint64) x ^ (UINT64CONST(1) << 63);
+}
+
+/*
+ * The element at position `k` of the `n` unsorted elements of `v`, by
+ * MSD radix select: a histogram of the highest `MEDIAN_RADIX_BITS` bits
+ * (of the ones in which the elements differ) says which bucket holds the
+ * element, and the elements of that bucket are moved to the start of `v`,
+ * for the next pass to refine. Elements are never compared, and each pass
+ * reads only the elements of the bucket of the pass before it.
+ */
+static int64
+radix_rank(int64 *v, size_t n, size_t k)
+{
+	uint64		lo = PG_UINT64_MAX;
+	uint64		hi = 0;
+	size_t		i;
+
+	Assert(k < n);
+	for (i = 0; i < n; ++i)
+	{
+		uint64 const u = radix_key(v[i]);
+
+		lo = Min(lo, u);
+		hi = Max(hi, u);
+	}
+	while (lo != hi)
+	{
+		size_t		count[1 << MEDIAN_RADIX_BITS];
+		int const	varying = pg_leftmost_one_pos64(lo ^ hi) + 1;
+		int const	shift = varying - Min(MEDIAN_RADIX_BITS, varying);
+		uint64 const mask = (UINT64CONST(1) << (varying - shift)) - 1;
+		uint64		b;
+		size_t		m = 0;
+
+		if (n <= MEDIAN_SMALL_SORT_MAX)
+		{
+			median_sort_small(v, n);
+			return v[k];
+		}
+		memset(count, 0, (mask + 1) * sizeof count[0]);
+		for (i = 0; i < n; ++i)
+		{
+			++count[(radix_key(v[i]) >> shift) & mask];
+		}
+		for (b = 0; k >= count[b]; ++b)
+		{
+			k -= count[b];
+		}
+		lo = PG_UINT64_MAX;
+		hi = 0;
+		for (i = 0; i < n; ++i)
+		{
+			uint64 const u = radix_key(v[i]);
+
+			if (((u >> shift) & mask) == b)
+			{
+				int64 const t = v[m];
+
+				v[m++] = v[i];
+				v[i] = t;
+				lo = Min(lo, u);
+				hi = Max(hi, u);
+			}
+		}
+		Assert(m == count[b]);
+		n = m;
+	}
+	return (int64) radix_key((int64) lo);
+}
+
+/*
+ * Reads all the elements of the spilled state `pms`, counting the ones
+ * below `lo` in `below` and, of the ones in `[lo, hi]`, histograms them
+ * into `count`, by their bits from `shift` up, if it's not NULL, and
+ * copies them to `out`, if it's not NULL.
+ */
+static void
+radix_spill_scan(struct MedianState *pms, uint64 lo, uint64 hi, int shift,
+				 size_t *count, size_t *below, int64 *out)
+{
+	int64	   *blk = palloc(MEDIAN_SPILL_BLOCK * sizeof *blk);
+	StringInfoData data;
+	size_t		m = 0;
+	size_t		irun;
+
+	*below = 0;
+	initStringInfo(&data);
+	for (irun = 0; irun <= pms->spill->nruns; ++irun)
+	{
+		struct MedianRun pos;
+		int64 const *v = pms->buf.i;
+		size_t		n = pms->dim;
+		size_t		i;
+
+		if (irun > 0)
+		{
+			pos = pms->spill->runs[irun - 1];
+			n = 0;
+		}
+		for (;;)
+		{
+			for (i = 0; i < n; ++i)
+			{
+				uint64 const u = radix_key(v[i]);
+
+				if (u < lo)
+				{
+					++*below;
+				}
+				else if (u <= hi)
+				{
+					if (NULL != count)
+					{
+						++count[(u - lo) >> shift];
+					}
+					if (NULL != out)
+					{
+						out[m++] = v[i];
+					}
+				}
+			}
+			if ((irun == 0) || (pos.left == 0))
+			{
+				break;
+			}
+			n = median_spill_read_block(pms, &pos, &data);
+			unpack_int_array(&data, blk, n);
+			v = blk;
+		}
+	}
+	pfree(data.data);
+	pfree(blk);
+}
+
+/*
+ * As `radix_rank`, the element at position `rank` of a spilled state.
+ * Each pass reads all the elements (in the buffer and in the runs), to
+ * histogram the ones in the range of the bucket of the pass before it,
+ * into `MEDIAN_RADIX_SPILL_BITS` buckets. The range of the first pass is
+ * that of the buffer, which is as good a sample of the elements as any.
+ * Once the bucket of `rank` fits in `work_mem`, its elements are read,
+ * in one more pass, and selected from in memory.
+ */
+static int64
+radix_spill_rank(struct MedianState *pms, size_t rank)
+{
+	size_t	   *count = palloc(((size_t) 1 << MEDIAN_RADIX_SPILL_BITS) * sizeof *count);
+	uint64		lo = 0;
+	uint64		hi = PG_UINT64_MAX;
+	int64		x;
+	size_t		i;
+
+	if (pms->dim > 0)
+	{
+		lo = PG_UINT64_MAX;
+		hi = 0;
+		for (i = 0; i < pms->dim; ++i)
+		{
+			uint64 const u = radix_key(pms->buf.i[i]);
+
+			lo = Min(lo, u);
+			hi = Max(hi, u);
+		}
+	}
+	for (;;)
+	{
+		int const	varying = (lo == hi) ? 0 : pg_leftmost_one_pos64(hi - lo) + 1;
+		int const	shift = varying - Min(MEDIAN_RADIX_SPILL_BITS, varying);
+		size_t const nbuckets = (size_t) 1 << (varying - shift);
+		uint64 const width = (UINT64CONST(1) << shift) - 1;
+		size_t		below;
+		size_t		in = 0;
+		size_t		r;
+		size_t		b;
+		uint64		blo;
+		uint64		bhi;
+
+		memset(count, 0, nbuckets * sizeof *count);
+		radix_spill_scan(pms, lo, hi, shift, count, &below, NULL);
+		for (b = 0; b < nbuckets; ++b)
+		{
+			in += count[b];
+		}
+		if (rank < below)
+		{
+			hi = lo - 1;
+			lo = 0;
+			continue;
+		}
+		if (rank >= below + in)
+		{
+			lo = hi + 1;
+			hi = PG_UINT64_MAX;
+			continue;
+		}
+		r = rank - below;
+		for (b = 0; r >= count[b]; ++b)
+		{
+			r -= count[b];
+		}
+		blo = lo + ((uint64) b << shift);
+		bhi = (hi - blo <= width) ? hi : blo + width;
+		if (blo == bhi)
+		{
+			x = (int64) radix_key((int64) blo);
+			break;
+		}
+		if (count[b] * sizeof(int64) <= pms->spill->limit)
+		{
+			int64	   *v = palloc(count[b] * sizeof(int64));
+
+			radix_spill_scan(pms, blo, bhi, 0, NULL, &below, v);
+			x = radix_rank(v, count[b], r);
+			pfree(v);
+			break;
+		}
+		lo = blo;
+		hi = bhi;
+	}
+	pfree(count);
+
+	return x;
+}
+
+#define MT_PREFIX median_numeral
+#define MT_SCOPE
+#define MT_ELEM int64
+#define MT_FIELD i
+#define MT_CMP(a, b, pms) (MEDIAN_STAT_CMP(pms), ((a) > (b)) - ((a) < (b)))
+#define MT_COPY(x, pms) (x)
+#define MT_FREE(x, pms) ((void) (x))
+#define MT_FROM_DATUM(d, pms) ((int64) ((d) << (pms)->ti->shift) >> (pms)->ti->shift)
+#define MT_PEEK_DATUM(d, pms) MT_FROM_DATUM(d, pms)
+#define MT_TO_DATUM(x, pms) Int64GetDatum(x)
+#define MT_SEND_ARRAY(buf, v, n, pms) pq_sendbytes((buf), (char const *) (v), (n) * sizeof(int64))
+#define MT_RECV_ARRAY(buf, v, n, pms) memcpy((v), pq_getmsgbytes((buf), (n) * sizeof(int64)), (n) * sizeof(int64))
+#define MT_WRITE_ARRAY(buf, v, n, pms) write_int_array((buf), (v), (n))
+#define MT_READ_ARRAY(buf, v, n, pms) read_int_array((buf), (v), (n), (pms))
+#define MT_PACK_ARRAY(buf, v, n, pms) pack_int_array((buf), (v), (n))
+#define MT_UNPACK_ARRAY(buf, v, n, pms) unpack_int_array((buf), (v), (n))
+#define MT_VEC_UPPER_BOUND(v, n, x) median_simd.upper_bound((v), (n), (x))
+#define MT_VEC_LOWER_BOUND(v, n, x) median_simd.lower_bound((v), (n), (x))
+#define MT_VEC_PARTITION(v, n, pivot, le) median_simd.partition((v), (n), (pivot), (le))
+#define MT_VEC_SMALL_SORT(v, n) median_sort_small((v), (n))
+#define MT_RADIX_RANK(v, n, k) radix_rank((v), (n), (k))
+#define MT_RADIX_SPILL_RANK(pms, rank) radix_spill_rank((pms), (rank))
+#include "median_template.h"
+
+#define MT_PREFIX median_float
+#define MT_SCOPE
+#define MT_ELEM float8
+#define MT_FIELD f
+#define MT_CMP(a, b, pms) (MEDIAN_STAT_CMP(pms), float_cmp((a), (b)))
+#define MT_COPY(x, pms) (x)
+#define MT_FREE(x, pms) ((void) (x))
+#define MT_FROM_DATUM(d, pms) \
+	(((pms)->ti->typlen == sizeof(float4)) ? (float8) DatumGetFloat4(d) : DatumGetFloat8(d))
+#define MT_PEEK_DATUM(d, pms) MT_FROM_DATUM(d, pms)
+#define MT_TO_DATUM(x, pms) \
+	(((pms)->ti->typlen == sizeof(float4)) ? Float4GetDatum((float4) (x)) : Float8GetDatum(x))
+#define MT_SEND_ARRAY(buf, v, n, pms) pq_sendbytes((buf), (char const *) (v), (n) * sizeof(float8))
+#define MT_RECV_ARRAY(buf, v, n, pms) memcpy((v), pq_getmsgbytes((buf), (n) * sizeof(float8)), (n) * sizeof(float8))
+#define MT_WRITE_ARRAY(buf, v, n, pms) write_float_array((buf), (v), (n))
+#define MT_READ_ARRAY(buf, v, n, pms) read_float_array((buf), (v), (n))
+#include "median_template.h"
+
+
+struct MedianState *
+create_MedianState(MemoryContext ctx, struct MedianTypeInfo *ti, enum MedianEngine engine)
+{
+	struct MedianState *pms;
+	size_t const to_alloc = sizeof *pms;
+	size_t const npagescap = 4;
+
+	StaticAssertStmt(sizeof *pms <= MEDIAN_STATE_CHUNK, "median state outgrew its sspace");
+	/*
+	 * elog(WARNING, "create_MedianState() NULL == pms, to_alloc = %lu",
+	 * to_alloc);
+	 */
+	pms = MemoryContextAllocZero(ctx, to_alloc);
+	if (NULL == pms)
+	{
+		elog(ERROR, "create_MedianState() no memory");
+		return NULL;
+	}
+	pms->dim = 0;
+	pms->ti = ti;
+	pms->ctx = ctx;
+	set_engine(pms, engine);
+	if ((engine == meAppend) && median_spill)
+	{
+		MEDIAN_PART(pms, spill)->limit = work_mem * (size_t) 1024;
+	}
+	if (ti->valclass == vcText)
+	{
+		pms->arena = MemoryContextAllocZero(ctx, sizeof *pms->arena);
+	}
+	switch (engine)
+	{
+		case meSorted:
+			pms->pages = MemoryContextAlloc(ctx, npagescap * sizeof pms->pages[0]);
+			pms->pages[0] = create_MedianPage(pms, MEDIAN_FIRST_PAGE_CAP);
+			pms->npages = 1;
+			pms->pagescap = npagescap;
+			break;
+		case meAppend:
+		case meHeap:
+			pms->buf.i = pms->inl.i;
+			pms->cap = MEDIAN_INLINE_SIZE / MEDIAN_ELEM_SIZE(pms);
+			Assert(pms->cap > 0);
+			break;
+		case meSketch:
+			pms->pages = MemoryContextAlloc(ctx, npagescap * sizeof pms->pages[0]);
+			pms->pages[0] = create_MedianPage(pms, MEDIAN_FIRST_PAGE_CAP);
+			pms->npages = 1;
+			pms->pagescap = npagescap;
+			MEDIAN_PART(pms, sketch)->seed = 2463534242u;
+			median_sketch_set_k(pms, median_sketch_k(MEDIAN_SKETCH_ACCURACY));
+			break;
+		case meCounts:
+			pms->buf.i = MemoryContextAllocHuge(ctx, MEDIAN_FIRST_BUF_CAP * MEDIAN_ELEM_SIZE(pms));
+			MEDIAN_PART(pms, counts)->n = MemoryContextAllocHuge(ctx, MEDIAN_FIRST_BUF_CAP * sizeof(uint64));
+			pms->cap = MEDIAN_FIRST_BUF_CAP;
+			break;
+		case meTree:
+			median_init_tree(pms, 0);
+			break;
+		case meFlat:
+			pms->buf.i = MemoryContextAllocHuge(ctx, MEDIAN_FIRST_BUF_CAP * MEDIAN_ELEM_SIZE(pms));
+			pms->cap = MEDIAN_FIRST_BUF_CAP;
+			break;
+	}
+
+	return pms;
+}
@@ -0,0 +1,805 @@
+/* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
+/*
+ * median_engine.h
+ *
+ * The state of a median and its engines, the ways its values are kept
+ * (see `enum MedianEngine`), as generated, for each value class, by
+ * `median_template.h`, with the helpers they share: the pages, the tree,
+ * the sketch, the text arena and the spilled runs.
+ *
+ * The engines of the by-value classes (integers and floats), and the
+ * helpers, are in median_engine.c, which needs nothing of the server but
+ * memory contexts, `elog()`, string buffers and temporary files, so that
+ * they are driven outside it too (see bench/standalone). The engines of
+ * text and generic values, which need the catalog and collations, are in
+ * median.c, with the SQL interface.
+ */
+#ifndef MEDIAN_ENGINE_H
+#define MEDIAN_ENGINE_H
+
+#include <math.h>
+#include <lib/stringinfo.h>
+#include <portability/instr_time.h>
+#include <storage/buffile.h>
+#include <utils/array.h>
+#include <utils/pg_locale.h>
+#include <utils/sortsupport.h>
+
+/** Max number of elements of a window kept in a flat sorted array */
+extern int	median_small_window_threshold;
+
+/** Whether to spill (the state of) an aggregate bigger than `work_mem`
+    to disk */
+extern bool median_spill;
+
+/** How an element is selected from the unsorted elements of an
+    aggregate, by `median.select` */
+enum MedianSelect
+{
+	/** By (intro)select, comparing elements */
+	msQuick,
+	/** By the radix of (integer) elements, in a few histogram passes,
+	    without comparing them. Other values are selected by `msQuick`. */
+	msRadix
+};
+
+extern int	median_select;
+
+/** Whether to count the work done for each state (see `struct MedianStats`) */
+extern bool median_track_stats;
+
+/** We handle "classes" of values - meaning oids that can be handled
+    in a same way. The integer, date/time and floating point types,
+    which are the most common, get their own (fast) handling, as
+    does `text`. Any other type which has a b-tree ordering is handled
+    generically, through its sort support.
+*/
+enum ValueClass
+{
+	/** Which can be handled like integers */
+	vcNumeral,
+	/** Which can be handled like `float8` */
+	vcFloat,
+	/** Which can be handled like "Pascal" strings */
+	vcText,
+	/** Any other, compared by its sort support */
+	vcGeneric
+};
+
+/** A value of a generic type, with its abbreviated key, so that most
+    comparisons compare just the (pass by value) keys. If the type has
+    no abbreviation, the key is the value itself.
+*/
+struct MedianDatum
+{
+	Datum		key;
+	Datum		val;
+};
+
+/** A text value, kept in the arena of the state, with its length and
+    abbreviated key (by the sort support of the collation, or 0 if it
+    has none), so that most comparisons don't look at the string
+    itself.
+
+    With `median.text_sort_keys`, the sort key of the string (by the
+    collation) is kept in the arena too, right after the string (in the
+    same varlena), and the abbreviated key is its first bytes.
+*/
+struct MedianText
+{
+	Datum		key;
+	text	   *ptr;
+	uint32		len;
+};
+
+/** A sorted run of elements, spilled to the temporary file of the
+    state, in blocks of (at most) `MEDIAN_SPILL_BLOCK` elements. Each
+    block is the element count and the size (both `uint32`), followed
+    by the elements, serialized, or, for the numeral class, packed (see
+    `pack_int_array`). Also used as the position of a reader of a run.
+*/
+struct MedianRun
+{
+	/** Where the run is in the file, or, if `fileno` is -1, `offset` in
+	    the runs kept in memory (`mem` of `struct MedianSpill`) */
+	int			fileno;
+	off_t		offset;
+	/** Number of elements (left to read) */
+	size_t		left;
+};
+
+/** A chunk of the text arena */
+struct MedianChunk
+{
+	struct MedianChunk *next;
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+};
+
+/** We keep sorted arrays, instead of a node-based approach
+    (such as an AWL or red-black-tree), because it's actually
+    faster for a lot of use cases when array can fit into CPU
+    cache (which is pretty large these days), while being much
+    easier to implement and maintain.
+
+    To scale "beyond cache", the sorted data is split into "pages",
+    each being an array of at most `MEDIAN_PAGE_CAP` elements. We
+    insert into the page the element belongs to, adding a new one if
+    the last is full and element needs to be inserted after it and
+    breaking them up when they are full yet a new element needs to be
+    inserted. So, the cost of an insert is bounded by the size of a
+    page, not by the number of elements. The pages are kept in a
+    sorted directory, which we binary search (by the last element of
+    each page) to find the page to insert to, and walk (summing the
+    sizes of pages) to find the element at a given position.
+*/
+struct MedianPage
+{
+	size_t		cap;
+	size_t		dim;
+	union
+	{
+		int64		i[1];
+		float8		f[1];
+		struct MedianText t[1];
+		struct MedianDatum d[1];
+	}			data;
+};
+
+/** How is the data kept in the state. */
+enum MedianEngine
+{
+	/** In sorted pages. Needed for a window (moving aggregate), as
+	    elements are removed from it and the finalfn is called for
+	    every row. */
+	meSorted,
+	/** In a plain unsorted buffer, which the finalfn runs a select
+	    on. For aggregating a whole set, the finalfn is called only
+	    once, so there's no point in keeping data sorted, one order
+	    statistic is all we need. */
+	meAppend,
+	/** In a KLL sketch (`approx_median`), which keeps a sample of
+	    O(1/accuracy) elements, each standing for a power of two of the
+	    values added, so that ranks are within the accuracy (of the
+	    number of values). See `sketch` in `struct MedianState`. */
+	meSketch,
+	/** As (sorted, distinct) elements with the number of times each was
+	    added, for few distinct values, which a state (of an aggregate, or
+	    a window that outgrows its flat array) turns into, once it has
+	    `MEDIAN_COUNTS_PROBE` elements and they turn out to have few
+	    distinct values. Adding and removing a value is then updating its
+	    count, and the median is found by walking the counts. If they turn
+	    out to have many distinct values after all, the state is turned
+	    back into an unsorted buffer (or, for a window, a tree). See
+	    `counts` in `struct MedianState`. */
+	meCounts,
+	/** In a bounded heap (`kth_smallest`, `kth_largest` and `top_k`) of
+	    only the `k` smallest, or largest, of the values, in the `buf`,
+	    so that memory is O(k), not O(n). A value goes in only if it is
+	    past the root, which it then replaces. See `heap` in `struct
+	    MedianState`. */
+	meHeap,
+	/** In an order-statistic tree, for a moving aggregate, where the
+	    head of the frame moves, so elements are removed from it. The
+	    insert, remove and finding the median are all O(log n). */
+	meTree,
+	/** In a flat sorted array (the `buf`), for a moving aggregate of
+	    a small window, as a tree, for all its asymptotic advantages,
+	    is slower for a few hundred elements. Once the window reaches
+	    `median.small_window_threshold` elements, it becomes `meTree`. */
+	meFlat
+};
+
+/** Names of the engines, for messages */
+extern const char *const median_engine_names[];
+
+/** The engine forced by `median.engine`, or -1 (`auto`) for the engine to
+    be picked, and switched, by the values (see `MT_ADAPT`) */
+extern int	median_engine;
+
+struct MedianState;
+
+typedef struct MedianState *(*MedianAddFn) (struct MedianState *pms, Datum x);
+typedef bool (*MedianRemoveFn) (struct MedianState *pms, Datum x);
+typedef void (*MedianAddBatchFn) (struct MedianState *pms, Datum const *d, size_t n);
+
+/** The operations of a value class, generated by `median_template.h`.
+    Where indexed by `enum MedianEngine`, that's the engine of the
+    state they operate on.
+*/
+struct MedianOps
+{
+	/** Add a value (the transfn) */
+	MedianAddFn add[meFlat + 1];
+	/** Remove a value (the inverse transfn), only for moving-aggregate
+	    engines */
+	MedianRemoveFn remove[meFlat + 1];
+	/** Add the `n` (by-value) values at `d`, all at once, only for the
+	    engines which aggregate a whole set (`meAppend` and `meSketch`) */
+	MedianAddBatchFn add_batch[meFlat + 1];
+	/** The value at the given position, in sorted order */
+	Datum		(*rank) (struct MedianState *pms, size_t rank);
+	/** The values at the given (sorted, unique) positions, at once */
+	void		(*ranks) (struct MedianState *pms, size_t const *ranks, size_t n, Datum *values);
+	void		(*combine) (struct MedianState *pms, struct MedianState *other);
+	void		(*serialize) (struct MedianState *pms, StringInfo buf);
+	void		(*deserialize) (struct MedianState *pms, StringInfo buf, size_t n);
+	/** Read the `n` elements of a block of a spilled run into the
+	    (empty, `meAppend`) state */
+	void		(*unpack) (struct MedianState *pms, StringInfo buf, size_t n);
+	/** The size of an element */
+	size_t		elemsize;
+};
+
+/** The type of the values and all we need to know about it, resolved
+    once, on the first call of a function (for an aggregate), and
+    cached in its `fn_extra`, so that per row calls don't need to
+    look it up nor check which kind of value they got.
+*/
+struct MedianTypeInfo
+{
+	Oid			typid;
+	Oid			collation;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	enum ValueClass valclass;
+	const struct MedianOps *ops;
+	/** For numerals, the shift (left, then right) that sign-extends a
+	    `Datum` of this type into an `int64` */
+	int			shift;
+	/** For text, the comparator of the collation, for generic types,
+	    the (abbreviated, if the type supports it) comparator */
+	SortSupportData ssup;
+	/** For text compared by sort keys, the locale to make them by, and
+	    the buffers to make them in */
+	pg_locale_t locale;
+	bool		deterministic;
+	char	   *keybuf;
+	size_t		keybufsize;
+	char	   *srcbuf;
+	size_t		srcbufsize;
+};
+
+/** A node of the order-statistic tree: a treap, with the size of the
+    subtree kept in each node. Nodes are kept in an array, referenced by
+    index, with 0 being the "nil" node, which has size 0. Elements in
+    the left subtree are less than the element of the node, the ones in
+    the right subtree are not less than it.
+ */
+struct MedianNode
+{
+	union
+	{
+		int64		i;
+		float8		f;
+		struct MedianText t;
+		struct MedianDatum d;
+	}			val;
+	uint32		left;
+	uint32		right;
+	uint32		size;
+	uint32		prio;
+};
+
+/** Size of the elements kept in the state itself, so that a small group
+    (of a hash aggregate, say) doesn't need a buffer of its own. The state
+    is allocated as a chunk of a power of 2 bytes anyway, which this
+    still fits in, and which is the `sspace` of the aggregates (see
+    `MEDIAN_STATE_CHUNK`). */
+#define MEDIAN_INLINE_SIZE 64
+
+/** The chunk the state is allocated as, the `sspace` of `median` and
+    `quantiles`. The parts of the state that only some engines use are
+    allocated apart, so that the rest, with its inline values, fits. */
+#define MEDIAN_STATE_CHUNK 256
+
+/** The work done for a state, counted with `median.track_stats`, since
+    its last result (see `stats_report`), or, for the totals of the
+    backend (see `median_stats`), since they were reset.
+*/
+struct MedianStats
+{
+	/** Number of results (finalfn calls) */
+	uint64		results;
+	/** Number of values added */
+	uint64		rows;
+	/** Number of comparisons of elements, one at a time. The vectorized
+	    partitions count one for each element, the vectorized searches
+	    and the radix select none. */
+	uint64		comparisons;
+	/** Bytes moved by inserting into (and removing from) sorted arrays */
+	uint64		moved;
+	/** Number of times the buffer, a page, the directory or the tree
+	    was grown, or a chunk added to the text arena */
+	uint64		reallocs;
+	/** Most memory the state took, as of when it grew or gave a result
+	    (the max of all states, for the totals) */
+	uint64		peak;
+	/** Number of times the state switched engines */
+	uint64		switches;
+	/** Number of runs spilled to disk */
+	uint64		spill_runs;
+	/** Number of sort keys made, of text, with `median.text_sort_keys` */
+	uint64		sort_keys;
+	/** Time spent finding the results */
+	instr_time	select_time;
+};
+
+/** For `meSorted`, where the element of rank `rank` is: at `i` of page
+    `ipg`, as last found (see `median_page_of_rank`), and kept there by inserts,
+    so that the next rank is found by stepping from it. For a window
+    whose frame only grows, that's the median, which moves by at most one
+    position a row, so the finalfn is O(1), not a walk of the pages. It's
+    only valid while `dim` is the `dim` of the state, as everything else
+    that changes the pages also changes their number of elements. */
+struct MedianMid
+{
+	size_t		ipg;
+	size_t		i;
+	size_t		rank;
+	size_t		dim;
+};
+
+/** For `meAppend`, when it's the combination of sorted states (see
+    `MT_COMBINE`), which is kept as the concatenation of their sorted runs,
+    where the `n` runs after the first start at `at`, in order, so that a
+    rank is found by searching the runs (see `MT_RUNS_AT`), instead of
+    selecting it from all the elements. A single run is just `presorted`.
+    A combined state isn't added to, which would break the runs. */
+struct MedianRuns
+{
+	size_t		n;
+	size_t		cap;
+	size_t	   *at;
+};
+
+/** The order-statistic tree, for `meTree` */
+struct MedianTree
+{
+	struct MedianNode *nodes;
+	size_t		nnodes;
+	size_t		cap;
+	uint32		root;
+	uint32		freelist;
+	uint32		seed;
+};
+
+/** The text values, for `vcText`, packed in chunks which we bump allocate
+    from. Values removed (from a window) are only accounted for as
+    `dead`, and reclaimed by compacting the arena, once there are more of
+    them than `live` ones. */
+struct MedianArena
+{
+	struct MedianChunk *chunks;
+	char	   *free;
+	char	   *end;
+	size_t		chunksize;
+	size_t		live;
+	size_t		dead;
+};
+
+/** For `meCounts`, the number of times each of the `size` (sorted,
+    distinct) elements of `buf` was added, `dim` being their sum. If
+    `moving`, it's of a window, which is turned into a tree, not an
+    unsorted buffer, if there are too many distinct values. */
+struct MedianCounts
+{
+	uint64	   *n;
+	size_t		size;
+	bool		moving;
+};
+
+/** For `meSketch`, the `pages` are the levels of the sketch, each element
+    of level `h` standing for 2^h values. Level 0, where values are added,
+    is unsorted, the others are sorted. Once the sketch holds `capacity`
+    elements, the lowest level that is over its own capacity is compacted:
+    sorted, with every other element (starting at a random one of the
+    first two) moved to the level above, and the rest thrown away. The top
+    level has room for `k` elements, each one below for 2/3 of the one
+    above. */
+struct MedianSketch
+{
+	uint32		k;
+	uint32		seed;
+	/** Number of elements in all levels */
+	size_t		size;
+	size_t		capacity;
+};
+
+/** For `meAppend` with `median.spill`, the sorted runs the buffer was
+    spilled to, once it would take more than `limit` bytes. The elements
+    are then the `dim` ones in the buffer and the `n` ones in the runs.
+    The runs are kept in memory, in `mem`, as they'd be in the file, for
+    as long as they take up to half of `limit` (see `median_spill_write_block`),
+    which, packed, is several times as many elements as the buffer, so
+    that only the buffer, and not all the elements, has to fit in
+    `work_mem`. Then they're all moved to the file, and the next ones
+    start in memory again. */
+struct MedianSpill
+{
+	size_t		limit;
+	StringInfoData mem;
+	BufFile    *file;
+	bool		registered;
+	int			endfile;
+	off_t		endoff;
+	size_t		n;
+	size_t		nruns;
+	size_t		runscap;
+	struct MedianRun *runs;
+};
+
+/**
+ * The state of an aggregate, a plain struct in the aggregate context (the
+ * stype is `internal`), passed around by pointer. Its varlena form is only
+ * made by `median_serialfn`.
+ */
+struct MedianState
+{
+	/** Total number of elements, in all pages or in `buf`. For
+	    `meSketch`, the number of values added, of which the sketch
+	    only keeps a sample. */
+	size_t		dim;
+	struct MedianTypeInfo *ti;
+	enum MedianEngine engine;
+	/** For `meAppend`, whether the elements of `buf` are known to be in
+	    order, as they are once they've been sampled (see `MT_ADAPT`),
+	    for as long as values are added in order, so that any element is
+	    found where it is, without selecting it. For `meHeap`, whether
+	    the heap is sorted, root first (which keeps it a heap), as it is
+	    once a rank other than the root's was asked for. */
+	bool		presorted;
+	/** `ti->ops->add[engine]` */
+	MedianAddFn add;
+	MemoryContext ctx;
+	/** The sorted pages, for `meSorted`. These are also used for a window
+	    whose frame only grows (so there's no `meTree`), as, then, the
+	    finalfn is called for every row. */
+	size_t		npages;
+	size_t		pagescap;
+	struct MedianPage **pages;
+	/** The unsorted elements, for `meAppend`, or sorted, for `meFlat`,
+	    or the heap, for `meHeap` */
+	size_t		cap;
+	union
+	{
+		int64	   *i;
+		float8	   *f;
+		struct MedianText *t;
+		struct MedianDatum *d;
+	}			buf;
+	/** Where `buf` starts, for `meAppend` and `meHeap`, until it has
+	    more elements than fit here */
+	union
+	{
+		int64		i[MEDIAN_INLINE_SIZE / sizeof(int64)];
+		char		data[MEDIAN_INLINE_SIZE];
+	}			inl;
+	/** Memory of (by-reference) generic values */
+	size_t		datamem;
+	/** For the engines with an `add_batch`, of by-value types, the
+	    values staged to be added, as they were given, so that the checks
+	    of capacity, spilling and compaction, and the dispatch on the
+	    engine, are done per batch, instead of for every value. It's
+	    allocated once the state has `MEDIAN_STAGE_CAP` elements, so that
+	    small groups don't pay for it. */
+	struct
+	{
+		Datum	   *d;
+		size_t		n;
+	}			stage;
+	/** For `quantiles`, (a copy of) the array of fractions it was
+	    given, with the first value */
+	ArrayType  *fractions;
+	/** For `meHeap`, the number of values it keeps, given with the first
+	    value, and whether they are the largest ones (whose root is the
+	    smallest of them), or the smallest ones (whose root is the
+	    largest) */
+	struct
+	{
+		uint32		k;
+		bool		largest;
+	}			heap;
+
+	/*
+	 * The parts of the engines that only some states use, allocated when
+	 * they are first needed (see `MEDIAN_PART`), and NULL until then, so
+	 * that the state stays within `MEDIAN_STATE_CHUNK`. The `spill` is
+	 * allocated with the state, if it's to spill, and `arena` for text.
+	 */
+	struct MedianMid *mid;
+	struct MedianRuns *runs;
+	struct MedianTree *tree;
+	struct MedianArena *arena;
+	struct MedianCounts *counts;
+	struct MedianSketch *sketch;
+	struct MedianSpill *spill;
+	struct MedianStats *stats;
+};
+
+/** The part `field` of the state `pms`, allocated (zeroed) if it's not yet */
+#define MEDIAN_PART(pms, field) \
+	(likely(NULL != (pms)->field) ? (pms)->field : \
+	 ((pms)->field = MemoryContextAllocZero((pms)->ctx, sizeof *(pms)->field)))
+
+/** Reads a run back, a block at a time, into `blk`, a state in
+    `ctx`, which is reset for every block */
+struct MedianRunReader
+{
+	struct MedianRun pos;
+	MemoryContext ctx;
+	struct MedianState *blk;
+	/** Position (of the next element) in `blk` */
+	size_t		i;
+	/** Whether the run has been read to its end */
+	bool		done;
+};
+
+/** The ranges of the sorted runs of a state (see `runs` in `struct
+    MedianState`) that the element of a rank is searched in, by
+    `MT_RUNS_AT`: from `lo[r]` up to `hi[r]`, in the buffer, for run `r` */
+struct MedianRunsSearch
+{
+	struct MedianState *pms;
+	size_t	   *lo;
+	size_t	   *hi;
+};
+
+/** Max number of elements in a page. The original idea was to have
+    about 100000 elements per page, but, since every insert moves
+    half a page on average, we keep them smaller, to stay within the
+    L2 cache of an "everyday" CPU (64KB of `int64`). Even so, the
+    directory for 10M elements is just ~1200 pages, which is cheap to
+    search and walk.
+ */
+#define MEDIAN_PAGE_CAP 8192
+
+/** Number of elements of the first page of a new state */
+#define MEDIAN_FIRST_PAGE_CAP 64
+
+/** The size of an element of the state `pms` */
+#define MEDIAN_ELEM_SIZE(pms) ((pms)->ti->ops->elemsize)
+
+#define MEDIAN_PAGE_SIZE(pms, ncap) \
+	(offsetof(struct MedianPage, data) + MEDIAN_ELEM_SIZE(pms) * (ncap))
+
+/** Number of elements of the unsorted buffer of a new state, once it
+    outgrows the ones kept in the state itself */
+#define MEDIAN_FIRST_BUF_CAP 64
+
+/** Max number of values staged, to be added in a batch, and the number
+    of values a state has to have first, to get them staged */
+#define MEDIAN_STAGE_CAP 512
+
+/** Number of elements at which a state is checked for having few
+    distinct values, and turned into `meCounts` if at most a quarter of
+    them are distinct. It's turned back once more than half of them are.
+    Not more than `MEDIAN_STAGE_CAP`, as staged values aren't checked. */
+#define MEDIAN_COUNTS_PROBE 512
+
+/** Least average length of the sorted runs of a combined state for a
+    rank to be found by searching them (see `MT_RUNS_AT`), which costs
+    about the number of runs times the square of the log of the number of
+    elements, rather than selected from all of them, as it otherwise is */
+#define MEDIAN_RUN_MIN_AVG 1024
+
+/** Number of nodes of the order-statistic tree of a new state */
+#define MEDIAN_FIRST_TREE_CAP 64
+
+/** Size of the first chunk of the text arena, each next one being
+    twice the size, up to `MEDIAN_MAX_CHUNK_SIZE` */
+#define MEDIAN_FIRST_CHUNK_SIZE 1024
+#define MEDIAN_MAX_CHUNK_SIZE (1024 * 1024)
+
+/** Max number of elements in a block of a spilled run */
+#define MEDIAN_SPILL_BLOCK 1024
+
+/** Default accuracy of `approx_median`, as a fraction of the number of
+    values, and the bounds of the (sketch) `k` it translates to */
+#define MEDIAN_SKETCH_ACCURACY 0.01
+#define MEDIAN_SKETCH_MIN_K 8
+#define MEDIAN_SKETCH_MAX_K 65535
+
+/** Min capacity of a level of a sketch */
+#define MEDIAN_SKETCH_MIN_CAP 8
+
+/** Max number of levels of a sketch, as each one weighs twice the one
+    below */
+#define MEDIAN_SKETCH_MAX_LEVELS 64
+
+/** Adds `n` to the `field` of the stats of `pms`, with `median.track_stats` */
+#define MEDIAN_STAT(pms, field, n) \
+	do { \
+		if (unlikely(median_track_stats)) \
+		{ \
+			MEDIAN_PART(pms, stats)->field += (n); \
+		} \
+	} while (0)
+
+/** Counts a comparison of elements of `pms`, as an expression */
+#define MEDIAN_STAT_CMP(pms) \
+	(unlikely(median_track_stats) ? (void) ++MEDIAN_PART(pms, stats)->comparisons : (void) 0)
+
+/** The operations of the by-value classes, see median_engine.c */
+extern const struct MedianOps median_numeral_ops;
+extern const struct MedianOps median_float_ops;
+
+/** A new, empty, state of `engine`, for values of `ti`, in `ctx` */
+extern struct MedianState *create_MedianState(MemoryContext ctx, struct MedianTypeInfo *ti,
+											  enum MedianEngine engine);
+extern size_t median_state_size(struct MedianState *pms);
+
+extern void median_resize_buf(struct MedianState *pms, size_t ncap);
+extern void median_reserve_buf(struct MedianState *pms, size_t n);
+extern void median_grow_buf(struct MedianState *pms, size_t n);
+extern struct MedianState *median_expand_if_need_be(struct MedianState *pms);
+extern void median_runs_add(struct MedianState *pms, size_t at);
+
+extern struct MedianPage *create_MedianPage(struct MedianState *pms, size_t ncap);
+extern struct MedianPage *median_expand_page(struct MedianState *pms, size_t ipg);
+extern struct MedianPage *median_insert_page(struct MedianState *pms, size_t at, void const *src, size_t n);
+extern void median_split_page(struct MedianState *pms, size_t ipg);
+extern size_t median_page_of_rank(struct MedianState *pms, size_t *rank);
+
+extern void median_init_tree(struct MedianState *pms, size_t n);
+
+extern uint32 median_sketch_k(float8 accuracy);
+extern void median_sketch_set_k(struct MedianState *pms, uint32 k);
+extern struct MedianPage *median_sketch_reserve(struct MedianState *pms, size_t h, size_t n);
+
+extern text *median_arena_store(struct MedianState *pms, char const *data, uint32 len,
+								char const *key, uint32 keylen);
+extern void median_arena_compact(struct MedianState *pms);
+extern void median_arena_reset(struct MedianState *pms);
+
+extern void median_spill_begin_run(struct MedianState *pms, size_t n);
+extern void median_spill_write_block(struct MedianState *pms, size_t n, StringInfo data);
+extern void median_spill_end_run(struct MedianState *pms);
+extern size_t median_spill_read_block(struct MedianState *pms, struct MedianRun *pos, StringInfo data);
+extern void median_spill_shutdown(Datum arg);
+
+extern void median_reader_init(struct MedianRunReader *r, struct MedianRun const *run);
+extern bool median_reader_next(struct MedianState *pms, struct MedianRunReader *r);
+extern void median_reader_end(struct MedianRunReader *r);
+
+/* Counts a growth of the state, with `median.track_stats` */
+static inline void
+stats_grown(struct MedianState *pms)
+{
+	if (unlikely(median_track_stats))
+	{
+		struct MedianStats *st = MEDIAN_PART(pms, stats);
+
+		++st->reallocs;
+		st->peak = Max(st->peak, median_state_size(pms));
+	}
+}
+
+/* Number of the sorted runs of the buffer after the first (see `runs`) */
+static inline size_t
+runs_count(struct MedianState const *pms)
+{
+	return (NULL == pms->runs) ? 0 : pms->runs->n;
+}
+
+/* Forgets the sorted runs of the buffer, which are about to be reordered */
+static inline void
+runs_clear(struct MedianState *pms)
+{
+	if (NULL != pms->runs)
+	{
+		pms->runs->n = 0;
+	}
+}
+
+/* Number of values of the state, in memory or spilled */
+static inline size_t
+state_count(struct MedianState const *pms)
+{
+	return pms->dim + ((NULL == pms->spill) ? 0 : pms->spill->n);
+}
+
+/* Number of sorted runs the state spilled, which are still to be merged */
+static inline size_t
+spill_nruns(struct MedianState const *pms)
+{
+	return (NULL == pms->spill) ? 0 : pms->spill->nruns;
+}
+
+/*
+ * Whether the elements of the state are in order, or in sorted runs, so
+ * that, combined, they're (more) sorted runs of the combination
+ */
+static inline bool
+in_runs(struct MedianState const *pms)
+{
+	switch (pms->engine)
+	{
+		case meSorted:
+		case meCounts:
+			return true;
+		case meAppend:
+			return (spill_nruns(pms) == 0) &&
+				(pms->presorted || (runs_count(pms) > 0) || (pms->dim == 0));
+		case meSketch:
+		case meHeap:
+		case meTree:
+		case meFlat:
+			return false;
+	}
+	pg_unreachable();
+}
+
+/*
+ * Keeps the `mid` element where it is, about to be moved by an element
+ * inserted at position `i` of page `ipg` (before `dim` is incremented).
+ */
+static inline void
+mid_insert(struct MedianState *pms, size_t ipg, size_t i)
+{
+	if ((NULL == pms->mid) || (pms->mid->dim != pms->dim))
+	{
+		return;
+	}
+	if ((ipg < pms->mid->ipg) || ((ipg == pms->mid->ipg) && (i <= pms->mid->i)))
+	{
+		if (ipg == pms->mid->ipg)
+		{
+			++pms->mid->i;
+		}
+		++pms->mid->rank;
+	}
+	++pms->mid->dim;
+}
+
+/* Next number of the pseudo-random sequence of `seed` (xorshift) */
+static inline uint32
+next_random(uint32 *seed)
+{
+	uint32		x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+
+	return x;
+}
+
+/* Capacity of level `h` of the sketch */
+static inline size_t
+sketch_level_cap(struct MedianState *pms, size_t h)
+{
+	size_t const cap = (size_t) (pms->sketch->k * pow(2.0 / 3.0, (float8) (pms->npages - 1 - h)));
+
+	return Max(cap, MEDIAN_SKETCH_MIN_CAP);
+}
+
+/* Sets the engine of the state, and the `add` operation to go with it */
+static inline void
+set_engine(struct MedianState *pms, enum MedianEngine engine)
+{
+	if (NULL != pms->add)
+	{
+		MEDIAN_STAT(pms, switches, pms->engine != engine);
+	}
+	pms->engine = engine;
+	pms->add = pms->ti->ops->add[engine];
+}
+
+/*
+ * Whether the buffer of `pms` is to be spilled, before adding an element to
+ * it, as it would take more memory than the limit.
+ */
+static inline bool
+spill_due(struct MedianState *pms)
+{
+	size_t const cap = (pms->dim >= pms->cap) ? (pms->cap * 3) / 2 : pms->cap;
+
+	size_t const live = (NULL == pms->arena) ? 0 : pms->arena->live;
+
+	return (pms->dim > 0) &&
+		(cap * MEDIAN_ELEM_SIZE(pms) + live + pms->datamem + pms->spill->mem.len > pms->spill->limit);
+}
+
+#endif							/* MEDIAN_ENGINE_H */
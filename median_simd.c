@@ -0,0 +1,762 @@
+/* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
+/*
+ * median_simd.c
+ *
+ * The `int64` kernels of `median_simd.h`. The vectorized ones are
+ * compiled for their instruction set with a `target` attribute, so the
+ * module itself is still built for the baseline CPU, and are only
+ * called if `median_simd_init()` found the CPU supports them.
+ *
+ * Bounds are a binary search down to a small window, whose elements are
+ * then all compared at once, instead of branching on each comparison.
+ *
+ * Partition (of quickselect) is in place: a vector of elements is read
+ * from one end or the other (whichever has less room written for it),
+ * its lanes permuted so that the ones going left come first, and the
+ * vector written out to both ends, each taking the lanes that go to it.
+ * The first and last vectors are kept aside, to make room for that, and
+ * are put in place, with the leftover elements, at the end.
+ *
+ * Unpacking (of the blocks of spilled runs, see `median_pack()`) gathers,
+ * for each lane, the word its element starts in and the one after it,
+ * and shifts the two together, by the lane's offset of bits, as the
+ * elements are all of the same width, so their offsets are known.
+ */
+#include <postgres.h>
+
+#include "median_simd.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define MEDIAN_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define MEDIAN_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+/** Size of the window that a bound search is narrowed down to */
+#define MEDIAN_BOUND_WINDOW 32
+
+struct MedianSimd median_simd;
+
+static inline bool
+goes_left(int64 x, int64 pivot, bool le)
+{
+	return le ? (x <= pivot) : (x < pivot);
+}
+
+static size_t
+upper_bound_scalar(int64 const *v, size_t n, int64 x)
+{
+	size_t		lo = 0;
+	size_t		hi = n;
+
+	while (lo < hi)
+	{
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (v[mid] <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static size_t
+lower_bound_scalar(int64 const *v, size_t n, int64 x)
+{
+	size_t		lo = 0;
+	size_t		hi = n;
+
+	while (lo < hi)
+	{
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (v[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Hoare's partition, used for the small arrays by the vectorized ones, too */
+static size_t
+partition_scalar(int64 *v, size_t n, int64 pivot, bool le)
+{
+	size_t		i = 0;
+	size_t		j = n;
+
+	for (;;)
+	{
+		int64		t;
+
+		while ((i < j) && goes_left(v[i], pivot, le))
+		{
+			++i;
+		}
+		while ((i < j) && !goes_left(v[j - 1], pivot, le))
+		{
+			--j;
+		}
+		if (i >= j)
+		{
+			return i;
+		}
+		t = v[i];
+		v[i++] = v[--j];
+		v[j] = t;
+	}
+}
+
+/*
+ * Puts the `n` elements of `rest` into the (free) `v[*lw, *rw)`, the ones
+ * going left from `*lw` up, the others from `*rw` down.
+ */
+static inline void
+partition_rest(int64 *v, size_t *lw, size_t *rw, int64 const *rest, size_t n, int64 pivot, bool le)
+{
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		if (goes_left(rest[i], pivot, le))
+		{
+			v[(*lw)++] = rest[i];
+		}
+		else
+		{
+			v[--(*rw)] = rest[i];
+		}
+	}
+}
+
+/* The mask of the low `width` bits */
+static inline uint64
+width_mask(int width)
+{
+	return (width == 64) ? PG_UINT64_MAX : ((UINT64CONST(1) << width) - 1);
+}
+
+/* Unpacks the elements of `v[from, n)`, as `median_simd.unpack` */
+static inline void
+unpack_rest(uint64 const *words, int width, int64 base, int64 *v, size_t from, size_t n)
+{
+	uint64 const mask = width_mask(width);
+	size_t		i;
+
+	for (i = from; i < n; ++i)
+	{
+		uint64 const bit = (uint64) i * width;
+		int const	off = bit % 64;
+		uint64		x = words[bit / 64] >> off;
+
+		if (off + width > 64)
+		{
+			x |= words[bit / 64 + 1] << (64 - off);
+		}
+		v[i] = (int64) ((uint64) base + (x & mask));
+	}
+}
+
+static void
+unpack_scalar(uint64 const *words, int width, int64 base, int64 *v, size_t n)
+{
+	unpack_rest(words, width, base, v, 0, n);
+}
+
+#ifdef MEDIAN_SIMD_X86
+
+/** For each mask of the (4) lanes going left, the permutation (of 32-bit
+    lanes) that puts them first, in order, followed by the others */
+static uint32 avx2_permutations[16][8];
+
+static void
+init_avx2_permutations(void)
+{
+	int			m;
+
+	for (m = 0; m < 16; ++m)
+	{
+		int			j = 0;
+		int			lane;
+
+		for (lane = 0; lane < 4; ++lane)
+		{
+			if (m & (1 << lane))
+			{
+				avx2_permutations[m][j++] = 2 * lane;
+				avx2_permutations[m][j++] = 2 * lane + 1;
+			}
+		}
+		for (lane = 0; lane < 4; ++lane)
+		{
+			if (!(m & (1 << lane)))
+			{
+				avx2_permutations[m][j++] = 2 * lane;
+				avx2_permutations[m][j++] = 2 * lane + 1;
+			}
+		}
+	}
+}
+
+/* Number of the elements of `v[lo, hi)` greater than `x` */
+__attribute__((target("avx2,popcnt")))
+static size_t
+count_greater_avx2(int64 const *v, size_t lo, size_t hi, int64 x)
+{
+	__m256i const xv = _mm256_set1_epi64x(x);
+	size_t		c = 0;
+	size_t		i;
+
+	for (i = lo; i + 4 <= hi; i += 4)
+	{
+		__m256i const a = _mm256_loadu_si256((__m256i const *) (v + i));
+
+		c += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(a, xv))));
+	}
+	for (; i < hi; ++i)
+	{
+		c += (v[i] > x);
+	}
+	return c;
+}
+
+/* Number of the elements of `v[lo, hi)` less than `x` */
+__attribute__((target("avx2,popcnt")))
+static size_t
+count_less_avx2(int64 const *v, size_t lo, size_t hi, int64 x)
+{
+	__m256i const xv = _mm256_set1_epi64x(x);
+	size_t		c = 0;
+	size_t		i;
+
+	for (i = lo; i + 4 <= hi; i += 4)
+	{
+		__m256i const a = _mm256_loadu_si256((__m256i const *) (v + i));
+
+		c += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(xv, a))));
+	}
+	for (; i < hi; ++i)
+	{
+		c += (v[i] < x);
+	}
+	return c;
+}
+
+static size_t
+upper_bound_avx2(int64 const *v, size_t n, int64 x)
+{
+	size_t		lo = 0;
+	size_t		hi = n;
+
+	while (hi - lo > MEDIAN_BOUND_WINDOW)
+	{
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (v[mid] <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return hi - count_greater_avx2(v, lo, hi, x);
+}
+
+static size_t
+lower_bound_avx2(int64 const *v, size_t n, int64 x)
+{
+	size_t		lo = 0;
+	size_t		hi = n;
+
+	while (hi - lo > MEDIAN_BOUND_WINDOW)
+	{
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (v[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo + count_less_avx2(v, lo, hi, x);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t
+partition_avx2(int64 *v, size_t n, int64 pivot, bool le)
+{
+	__m256i const pv = _mm256_set1_epi64x(pivot);
+	__m256i		first;
+	__m256i		last;
+	int64		rest[4 + 2 * 4];
+	size_t		lr = 4;
+	size_t		rr = n - 4;
+	size_t		lw = 0;
+	size_t		rw = n;
+
+	if (n < 4 * 4)
+	{
+		return partition_scalar(v, n, pivot, le);
+	}
+	first = _mm256_loadu_si256((__m256i const *) v);
+	last = _mm256_loadu_si256((__m256i const *) (v + n - 4));
+	while (rr - lr >= 4)
+	{
+		__m256i		x;
+		int			gt;
+		int			m;
+		int			c;
+		__m256i		p;
+
+		if (lr - lw <= rw - rr)
+		{
+			x = _mm256_loadu_si256((__m256i const *) (v + lr));
+			lr += 4;
+		}
+		else
+		{
+			rr -= 4;
+			x = _mm256_loadu_si256((__m256i const *) (v + rr));
+		}
+		gt = _mm256_movemask_pd(_mm256_castsi256_pd(le ? _mm256_cmpgt_epi64(x, pv) : _mm256_cmpgt_epi64(pv, x)));
+		m = le ? (~gt & 0xF) : gt;
+		c = __builtin_popcount(m);
+		p = _mm256_permutevar8x32_epi32(x, _mm256_loadu_si256((__m256i const *) avx2_permutations[m]));
+		_mm256_storeu_si256((__m256i *) (v + lw), p);
+		_mm256_storeu_si256((__m256i *) (v + rw - 4), p);
+		lw += c;
+		rw -= 4 - c;
+	}
+	memcpy(rest, v + lr, (rr - lr) * sizeof(int64));
+	_mm256_storeu_si256((__m256i *) (rest + (rr - lr)), first);
+	_mm256_storeu_si256((__m256i *) (rest + (rr - lr) + 4), last);
+	partition_rest(v, &lw, &rw, rest, (rr - lr) + 2 * 4, pivot, le);
+	Assert(lw == rw);
+
+	return lw;
+}
+
+/*
+ * The gathers read the word after the one each element starts in, which
+ * `MEDIAN_PACKED_WORDS` has room for, and a shift by 64 (of an element
+ * that starts a word) is 0, so there's no branch on whether an element
+ * goes on into the next word.
+ */
+__attribute__((target("avx2")))
+static void
+unpack_avx2(uint64 const *words, int width, int64 base, int64 *v, size_t n)
+{
+	__m256i const mask = _mm256_set1_epi64x((int64) width_mask(width));
+	__m256i const vbase = _mm256_set1_epi64x(base);
+	__m256i const step = _mm256_set1_epi64x(4 * (int64) width);
+	__m256i const low6 = _mm256_set1_epi64x(63);
+	__m256i const all = _mm256_set1_epi64x(64);
+	__m256i		bit = _mm256_setr_epi64x(0, width, 2 * (int64) width, 3 * (int64) width);
+	size_t		i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+	{
+		__m256i const at = _mm256_srli_epi64(bit, 6);
+		__m256i const off = _mm256_and_si256(bit, low6);
+		__m256i const lo = _mm256_i64gather_epi64((long long const *) words, at, 8);
+		__m256i const hi = _mm256_i64gather_epi64((long long const *) (words + 1), at, 8);
+		__m256i const x = _mm256_or_si256(_mm256_srlv_epi64(lo, off),
+										  _mm256_sllv_epi64(hi, _mm256_sub_epi64(all, off)));
+
+		_mm256_storeu_si256((__m256i *) (v + i), _mm256_add_epi64(_mm256_and_si256(x, mask), vbase));
+		bit = _mm256_add_epi64(bit, step);
+	}
+	unpack_rest(words, width, base, v, i, n);
+}
+
+/* Number of the elements of `v[lo, hi)` greater than `x` */
+__attribute__((target("avx512f,popcnt")))
+static size_t
+count_greater_avx512(int64 const *v, size_t lo, size_t hi, int64 x)
+{
+	__m512i const xv = _mm512_set1_epi64(x);
+	size_t		c = 0;
+	size_t		i;
+
+	for (i = lo; i + 8 <= hi; i += 8)
+	{
+		c += __builtin_popcount(_mm512_cmpgt_epi64_mask(_mm512_loadu_si512(v + i), xv));
+	}
+	if (i < hi)
+	{
+		__mmask8 const tail = (__mmask8) ((1u << (hi - i)) - 1);
+
+		c += __builtin_popcount(_mm512_mask_cmpgt_epi64_mask(tail, _mm512_maskz_loadu_epi64(tail, v + i), xv));
+	}
+	return c;
+}
+
+/* Number of the elements of `v[lo, hi)` less than `x` */
+__attribute__((target("avx512f,popcnt")))
+static size_t
+count_less_avx512(int64 const *v, size_t lo, size_t hi, int64 x)
+{
+	__m512i const xv = _mm512_set1_epi64(x);
+	size_t		c = 0;
+	size_t		i;
+
+	for (i = lo; i + 8 <= hi; i += 8)
+	{
+		c += __builtin_popcount(_mm512_cmplt_epi64_mask(_mm512_loadu_si512(v + i), xv));
+	}
+	if (i < hi)
+	{
+		__mmask8 const tail = (__mmask8) ((1u << (hi - i)) - 1);
+
+		c += __builtin_popcount(_mm512_mask_cmplt_epi64_mask(tail, _mm512_maskz_loadu_epi64(tail, v + i), xv));
+	}
+	return c;
+}
+
+static size_t
+upper_bound_avx512(int64 const *v, size_t n, int64 x)
+{
+	size_t		lo = 0;
+	size_t		hi = n;
+
+	while (hi - lo > MEDIAN_BOUND_WINDOW)
+	{
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (v[mid] <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return hi - count_greater_avx512(v, lo, hi, x);
+}
+
+static size_t
+lower_bound_avx512(int64 const *v, size_t n, int64 x)
+{
+	size_t		lo = 0;
+	size_t		hi = n;
+
+	while (hi - lo > MEDIAN_BOUND_WINDOW)
+	{
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (v[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo + count_less_avx512(v, lo, hi, x);
+}
+
+/*
+ * As `partition_avx2`, but with 8 lanes, and the permutation made by
+ * compressing the lane numbers, instead of looked up.
+ */
+__attribute__((target("avx512f,popcnt")))
+static size_t
+partition_avx512(int64 *v, size_t n, int64 pivot, bool le)
+{
+	__m512i const pv = _mm512_set1_epi64(pivot);
+	__m512i const lanes = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+	__m512i		first;
+	__m512i		last;
+	int64		rest[8 + 2 * 8];
+	size_t		lr = 8;
+	size_t		rr = n - 8;
+	size_t		lw = 0;
+	size_t		rw = n;
+
+	if (n < 4 * 8)
+	{
+		return partition_scalar(v, n, pivot, le);
+	}
+	first = _mm512_loadu_si512(v);
+	last = _mm512_loadu_si512(v + n - 8);
+	while (rr - lr >= 8)
+	{
+		__m512i		x;
+		__mmask8	m;
+		int			c;
+		__m512i		idx;
+		__m512i		p;
+
+		if (lr - lw <= rw - rr)
+		{
+			x = _mm512_loadu_si512(v + lr);
+			lr += 8;
+		}
+		else
+		{
+			rr -= 8;
+			x = _mm512_loadu_si512(v + rr);
+		}
+		m = le ? _mm512_cmple_epi64_mask(x, pv) : _mm512_cmplt_epi64_mask(x, pv);
+		c = __builtin_popcount(m);
+		idx = _mm512_maskz_compress_epi64(m, lanes);
+		idx = _mm512_mask_expand_epi64(idx, (__mmask8) (0xFF << c),
+									   _mm512_maskz_compress_epi64((__mmask8) ~m, lanes));
+		p = _mm512_permutexvar_epi64(idx, x);
+		_mm512_storeu_si512(v + lw, p);
+		_mm512_storeu_si512(v + rw - 8, p);
+		lw += c;
+		rw -= 8 - c;
+	}
+	memcpy(rest, v + lr, (rr - lr) * sizeof(int64));
+	_mm512_storeu_si512(rest + (rr - lr), first);
+	_mm512_storeu_si512(rest + (rr - lr) + 8, last);
+	partition_rest(v, &lw, &rw, rest, (rr - lr) + 2 * 8, pivot, le);
+	Assert(lw == rw);
+
+	return lw;
+}
+
+/* As `unpack_avx2`, 8 elements at a time */
+__attribute__((target("avx512f")))
+static void
+unpack_avx512(uint64 const *words, int width, int64 base, int64 *v, size_t n)
+{
+	__m512i const mask = _mm512_set1_epi64((int64) width_mask(width));
+	__m512i const vbase = _mm512_set1_epi64(base);
+	__m512i const step = _mm512_set1_epi64(8 * (int64) width);
+	__m512i const low6 = _mm512_set1_epi64(63);
+	__m512i const all = _mm512_set1_epi64(64);
+	int64 const w = width;
+	__m512i		bit = _mm512_setr_epi64(0, w, 2 * w, 3 * w, 4 * w, 5 * w, 6 * w, 7 * w);
+	size_t		i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		__m512i const at = _mm512_srli_epi64(bit, 6);
+		__m512i const off = _mm512_and_si512(bit, low6);
+		__m512i const lo = _mm512_i64gather_epi64(at, words, 8);
+		__m512i const hi = _mm512_i64gather_epi64(at, words + 1, 8);
+		__m512i const x = _mm512_or_si512(_mm512_srlv_epi64(lo, off),
+										  _mm512_sllv_epi64(hi, _mm512_sub_epi64(all, off)));
+
+		_mm512_storeu_si512(v + i, _mm512_add_epi64(_mm512_and_si512(x, mask), vbase));
+		bit = _mm512_add_epi64(bit, step);
+	}
+	unpack_rest(words, width, base, v, i, n);
+}
+
+#endif							/* MEDIAN_SIMD_X86 */
+
+#ifdef MEDIAN_SIMD_NEON
+
+/* Number of the elements of `v[lo, hi)` greater than `x` */
+static size_t
+count_greater_neon(int64 const *v, size_t lo, size_t hi, int64 x)
+{
+	int64x2_t const xv = vdupq_n_s64(x);
+	int64x2_t	c = vdupq_n_s64(0);
+	size_t		i;
+	size_t		tail = 0;
+
+	for (i = lo; i + 2 <= hi; i += 2)
+	{
+		/* a lane which is greater is all ones, that is -1 */
+		c = vsubq_s64(c, vreinterpretq_s64_u64(vcgtq_s64(vld1q_s64(v + i), xv)));
+	}
+	for (; i < hi; ++i)
+	{
+		tail += (v[i] > x);
+	}
+	return (size_t) vaddvq_s64(c) + tail;
+}
+
+/* Number of the elements of `v[lo, hi)` less than `x` */
+static size_t
+count_less_neon(int64 const *v, size_t lo, size_t hi, int64 x)
+{
+	int64x2_t const xv = vdupq_n_s64(x);
+	int64x2_t	c = vdupq_n_s64(0);
+	size_t		i;
+	size_t		tail = 0;
+
+	for (i = lo; i + 2 <= hi; i += 2)
+	{
+		c = vsubq_s64(c, vreinterpretq_s64_u64(vcltq_s64(vld1q_s64(v + i), xv)));
+	}
+	for (; i < hi; ++i)
+	{
+		tail += (v[i] < x);
+	}
+	return (size_t) vaddvq_s64(c) + tail;
+}
+
+static size_t
+upper_bound_neon(int64 const *v, size_t n, int64 x)
+{
+	size_t		lo = 0;
+	size_t		hi = n;
+
+	while (hi - lo > MEDIAN_BOUND_WINDOW)
+	{
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (v[mid] <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return hi - count_greater_neon(v, lo, hi, x);
+}
+
+static size_t
+lower_bound_neon(int64 const *v, size_t n, int64 x)
+{
+	size_t		lo = 0;
+	size_t		hi = n;
+
+	while (hi - lo > MEDIAN_BOUND_WINDOW)
+	{
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (v[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo + count_less_neon(v, lo, hi, x);
+}
+
+#endif							/* MEDIAN_SIMD_NEON */
+
+/*
+ * Chooses the kernels for the CPU. NEON is always there on AArch64, but,
+ * with only two `int64` lanes and no cheap way to permute them by a mask,
+ * partition stays scalar there.
+ */
+void
+median_simd_init(void)
+{
+	median_simd.upper_bound = upper_bound_scalar;
+	median_simd.lower_bound = lower_bound_scalar;
+	median_simd.partition = partition_scalar;
+	median_simd.unpack = unpack_scalar;
+	median_simd.name = "scalar";
+#ifdef MEDIAN_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("popcnt"))
+	{
+		median_simd.upper_bound = upper_bound_avx512;
+		median_simd.lower_bound = lower_bound_avx512;
+		median_simd.partition = partition_avx512;
+		median_simd.unpack = unpack_avx512;
+		median_simd.name = "avx512";
+	}
+	else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+	{
+		init_avx2_permutations();
+		median_simd.upper_bound = upper_bound_avx2;
+		median_simd.lower_bound = lower_bound_avx2;
+		median_simd.partition = partition_avx2;
+		median_simd.unpack = unpack_avx2;
+		median_simd.name = "avx2";
+	}
+#endif
+#ifdef MEDIAN_SIMD_NEON
+	median_simd.upper_bound = upper_bound_neon;
+	median_simd.lower_bound = lower_bound_neon;
+	median_simd.name = "neon";
+#endif
+}
+
+/* Compare-exchange of `w[a]` and `w[b]`, without a branch */
+#define MEDIAN_CE(a, b) \
+	do { \
+		int64 const x_ = w[a]; \
+		int64 const y_ = w[b]; \
+		w[a] = (x_ < y_) ? x_ : y_; \
+		w[b] = (x_ < y_) ? y_ : x_; \
+	} while (0)
+
+/*
+ * Sorts the (up to `MEDIAN_SMALL_SORT_MAX`) `n` elements of `v`, with a
+ * sorting network for 8 or 16 elements, padded with the max value. The
+ * networks are the known optimal ones (19 and 60 compare-exchanges).
+ */
+void
+median_sort_small(int64 *v, size_t n)
+{
+	int64		w[MEDIAN_SMALL_SORT_MAX];
+	size_t		i;
+
+	Assert(n <= MEDIAN_SMALL_SORT_MAX);
+	if (n < 2)
+	{
+		return;
+	}
+	memcpy(w, v, n * sizeof(int64));
+	if (n <= 8)
+	{
+		for (i = n; i < 8; ++i)
+		{
+			w[i] = PG_INT64_MAX;
+		}
+		MEDIAN_CE(0, 2); MEDIAN_CE(1, 3); MEDIAN_CE(4, 6); MEDIAN_CE(5, 7);
+		MEDIAN_CE(0, 4); MEDIAN_CE(1, 5); MEDIAN_CE(2, 6); MEDIAN_CE(3, 7);
+		MEDIAN_CE(0, 1); MEDIAN_CE(2, 3); MEDIAN_CE(4, 5); MEDIAN_CE(6, 7);
+		MEDIAN_CE(2, 4); MEDIAN_CE(3, 5);
+		MEDIAN_CE(1, 4); MEDIAN_CE(3, 6);
+		MEDIAN_CE(1, 2); MEDIAN_CE(3, 4); MEDIAN_CE(5, 6);
+	}
+	else
+	{
+		for (i = n; i < 16; ++i)
+		{
+			w[i] = PG_INT64_MAX;
+		}
+		MEDIAN_CE(0, 13); MEDIAN_CE(1, 12); MEDIAN_CE(2, 15); MEDIAN_CE(3, 14);
+		MEDIAN_CE(4, 8); MEDIAN_CE(5, 6); MEDIAN_CE(7, 11); MEDIAN_CE(9, 10);
+		MEDIAN_CE(0, 5); MEDIAN_CE(1, 7); MEDIAN_CE(2, 9); MEDIAN_CE(3, 4);
+		MEDIAN_CE(6, 13); MEDIAN_CE(8, 14); MEDIAN_CE(10, 15); MEDIAN_CE(11, 12);
+		MEDIAN_CE(0, 1); MEDIAN_CE(2, 3); MEDIAN_CE(4, 5); MEDIAN_CE(6, 8);
+		MEDIAN_CE(7, 9); MEDIAN_CE(10, 11); MEDIAN_CE(12, 13); MEDIAN_CE(14, 15);
+		MEDIAN_CE(0, 2); MEDIAN_CE(1, 3); MEDIAN_CE(4, 10); MEDIAN_CE(5, 11);
+		MEDIAN_CE(6, 7); MEDIAN_CE(8, 9); MEDIAN_CE(12, 14); MEDIAN_CE(13, 15);
+		MEDIAN_CE(1, 2); MEDIAN_CE(3, 12); MEDIAN_CE(4, 6); MEDIAN_CE(5, 7);
+		MEDIAN_CE(8, 10); MEDIAN_CE(9, 11); MEDIAN_CE(13, 14);
+		MEDIAN_CE(1, 4); MEDIAN_CE(2, 6); MEDIAN_CE(5, 8); MEDIAN_CE(7, 10);
+		MEDIAN_CE(9, 13); MEDIAN_CE(11, 14);
+		MEDIAN_CE(2, 4); MEDIAN_CE(3, 6); MEDIAN_CE(9, 12); MEDIAN_CE(11, 13);
+		MEDIAN_CE(3, 5); MEDIAN_CE(6, 8); MEDIAN_CE(7, 9); MEDIAN_CE(10, 12);
+		MEDIAN_CE(3, 4); MEDIAN_CE(5, 6); MEDIAN_CE(7, 8); MEDIAN_CE(9, 10);
+		MEDIAN_CE(11, 12);
+		MEDIAN_CE(6, 7); MEDIAN_CE(8, 9);
+	}
+	memcpy(v, w, n * sizeof(int64));
+}
+
+/*
+ * Packs the `n` elements of `v`, each as its difference from `base`, the
+ * least of them (frame of reference), in `width` bits, enough for the
+ * greatest difference, one after the other, into the (zeroed)
+ * `MEDIAN_PACKED_WORDS(n, width)` `words`. Elements that are close to
+ * each other, as the ones of a block of a sorted run are, take few bits.
+ */
+void
+median_pack(int64 const *v, size_t n, int width, int64 base, uint64 *words)
+{
+	size_t		i;
+
+	if (width == 0)
+	{
+		return;
+	}
+	for (i = 0; i < n; ++i)
+	{
+		uint64 const x = (uint64) v[i] - (uint64) base;
+		uint64 const bit = (uint64) i * width;
+		int const	off = bit % 64;
+
+		words[bit / 64] |= x << off;
+		if (off + width > 64)
+		{
+			words[bit / 64 + 1] |= x >> (64 - off);
+		}
+	}
+}
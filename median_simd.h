@@ -0,0 +1,50 @@
+/* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
+/*
+ * median_simd.h
+ *
+ * Kernels for the `int64` elements (of the numeral value class), which
+ * are the bulk of the work for integer and date/time medians. They are
+ * vectorized (AVX2, AVX-512), where the CPU supports it, which is found
+ * out at module load, with scalar ones as the fallback.
+ */
+#ifndef MEDIAN_SIMD_H
+#define MEDIAN_SIMD_H
+
+/** The kernels chosen for the CPU, by `median_simd_init()` */
+struct MedianSimd
+{
+	/** Index of the first of the `n` sorted elements of `v` that is
+	    greater than `x`, or `n` if there is no such element */
+	size_t		(*upper_bound) (int64 const *v, size_t n, int64 x);
+	/** Index of the first of the `n` sorted elements of `v` that is
+	    not less than `x`, or `n` if there is no such element */
+	size_t		(*lower_bound) (int64 const *v, size_t n, int64 x);
+	/** Rearranges the `n` elements of `v` so that the ones less than
+	    `pivot` (or, if `le`, not greater than it) come first, returning
+	    their number */
+	size_t		(*partition) (int64 *v, size_t n, int64 pivot, bool le);
+	/** Unpacks the `n` elements packed by `median_pack()` into `words`,
+	    `width` bits each, above `base`, into `v` */
+	void		(*unpack) (uint64 const *words, int width, int64 base, int64 *v, size_t n);
+	/** The instruction set of the kernels */
+	char const *name;
+};
+
+extern struct MedianSimd median_simd;
+
+extern void median_simd_init(void);
+
+/** Max number of elements `median_sort_small()` sorts */
+#define MEDIAN_SMALL_SORT_MAX 16
+
+extern void median_sort_small(int64 *v, size_t n);
+
+/** Number of words `median_pack()` packs `n` elements of `width` bits
+    into: one more than they take, as the vectorized unpacking reads the
+    word after the one an element starts in, even if it doesn't go on
+    into it */
+#define MEDIAN_PACKED_WORDS(n, width) (((size_t) (n) * (width) + 63) / 64 + 1)
+
+extern void median_pack(int64 const *v, size_t n, int width, int64 base, uint64 *words);
+
+#endif							/* MEDIAN_SIMD_H */
@@ -0,0 +1,2433 @@
+/* -*- c-file-style:"bsd"; tab-width:4; indent-tabs-mode: t -*- */
+/*
+ * median_template.h
+ *
+ * The value class specific parts of the median state engines.
+ *
+ * This is included once for every value class, in the manner of
+ * PostgreSQL's own `lib/sort_template.h`, so that the element type
+ * and its comparison are known at compile time and get inlined into
+ * the inner loops, instead of going through a function pointer for
+ * every comparison.
+ *
+ * Before including, define:
+ *
+ *	MT_PREFIX - prefix for the names of the generated functions
+ *	MT_ELEM - the element type
+ *	MT_FIELD - the member of the `MedianPage.data` and `MedianState.buf`
+ *		unions of MT_ELEM type
+ *	MT_CMP(a, b, pms) - three-way comparison of elements `a` and `b`,
+ *		`pms` being the `struct MedianState` they belong to
+ *	MT_COPY(x, pms) - copy of element `x`, that must be allocated in
+ *		`pms->ctx` if it references any memory
+ *	MT_FREE(x, pms) - free any memory referenced by element `x`
+ *	MT_SEND_ARRAY(buf, v, n, pms) - serialize `n` elements of `v` into the
+ *		StringInfo `buf`
+ *	MT_RECV_ARRAY(buf, v, n, pms) - deserialize `n` elements from the
+ *		StringInfo `buf` into `v`, allocating any referenced memory in
+ *		`pms->ctx`
+ *	MT_WRITE_ARRAY(buf, v, n, pms) - as `MT_SEND_ARRAY`, in the portable
+ *		encoding of a `median_sketch`, which can be read on any server
+ *	MT_READ_ARRAY(buf, v, n, pms) - as `MT_RECV_ARRAY`, for the elements
+ *		written by `MT_WRITE_ARRAY`, which may come from the outside, so
+ *		that every length and value must be checked
+ *	MT_FROM_DATUM(d, pms) - the element to keep for the argument `d`
+ *	MT_PEEK_DATUM(d, pms) - the element to compare with, for the
+ *		argument `d`, that doesn't need to be kept
+ *	MT_TO_DATUM(x, pms) - the result `Datum` for element `x`
+ *
+ * and, optionally, kernels to use instead of the generic code, for
+ * element types which have faster (vectorized) ones:
+ *
+ *	MT_VEC_UPPER_BOUND(v, n, x) - as `MT_UPPER_BOUND`
+ *	MT_VEC_LOWER_BOUND(v, n, x) - as `MT_LOWER_BOUND`
+ *	MT_VEC_PARTITION(v, n, pivot, le) - rearranges the `n` elements of `v`
+ *		so that the ones less than `pivot` (or, if `le`, not greater than
+ *		it) come first, returning their number
+ *	MT_VEC_SMALL_SORT(v, n) - sorts the (up to 16) `n` elements of `v`
+ *
+ * and, for element types that can be selected by their radix, which is
+ * done instead of comparing them if `median.select` is `radix`:
+ *
+ *	MT_RADIX_RANK(v, n, k) - the element at position `k` of the `n`
+ *		unsorted elements of `v`, which it may rearrange
+ *	MT_RADIX_SPILL_RANK(pms, rank) - as `MT_SPILL_RANK`
+ *
+ * and, for element types that can be packed smaller than they're
+ * serialized, which the blocks of spilled runs are then:
+ *
+ *	MT_PACK_ARRAY(buf, v, n, pms) - as `MT_SEND_ARRAY`, for the `n` (at
+ *		most `MEDIAN_SPILL_BLOCK`) sorted elements of `v`
+ *	MT_UNPACK_ARRAY(buf, v, n, pms) - as `MT_RECV_ARRAY`, for the
+ *		elements packed by `MT_PACK_ARRAY`
+ *
+ * The operations are then available as `<MT_PREFIX>_ops`, which is
+ * `static`, unless `MT_SCOPE` is defined (as empty, for the ones declared
+ * in median_engine.h).
+ *
+ * All of them are undefined at the end of this file.
+ */
+
+#define MT_MAKE_PREFIX(a) CppConcat(a,_)
+#define MT_MAKE_NAME(a,b) MT_MAKE_NAME_(MT_MAKE_PREFIX(a),b)
+#define MT_MAKE_NAME_(a,b) CppConcat(a,b)
+
+#define MT_UPPER_BOUND MT_MAKE_NAME(MT_PREFIX, upper_bound)
+#define MT_LOWER_BOUND MT_MAKE_NAME(MT_PREFIX, lower_bound)
+#define MT_FIND_PAGE MT_MAKE_NAME(MT_PREFIX, find_page)
+#define MT_INSERT MT_MAKE_NAME(MT_PREFIX, insert)
+#define MT_AT MT_MAKE_NAME(MT_PREFIX, at)
+#define MT_APPEND MT_MAKE_NAME(MT_PREFIX, append)
+#define MT_KEEP_PRESORTED MT_MAKE_NAME(MT_PREFIX, keep_presorted)
+#define MT_SWAP MT_MAKE_NAME(MT_PREFIX, swap)
+#define MT_INSERTION_SORT MT_MAKE_NAME(MT_PREFIX, insertion_sort)
+#define MT_MEDIAN3 MT_MAKE_NAME(MT_PREFIX, median3)
+#define MT_MOM_PIVOT MT_MAKE_NAME(MT_PREFIX, mom_pivot)
+#define MT_SELECT_DEPTH MT_MAKE_NAME(MT_PREFIX, select_depth)
+#define MT_SELECT MT_MAKE_NAME(MT_PREFIX, select)
+#define MT_APPEND_ALL MT_MAKE_NAME(MT_PREFIX, append_all)
+#define MT_FLATTEN MT_MAKE_NAME(MT_PREFIX, flatten)
+#define MT_ADD_RUNS MT_MAKE_NAME(MT_PREFIX, add_runs)
+#define MT_SORT_RUNS MT_MAKE_NAME(MT_PREFIX, sort_runs)
+#define MT_RUNS_AT MT_MAKE_NAME(MT_PREFIX, runs_at)
+#define MT_COMBINE MT_MAKE_NAME(MT_PREFIX, combine)
+#define MT_HEAP_ABOVE MT_MAKE_NAME(MT_PREFIX, heap_above)
+#define MT_HEAP_UP MT_MAKE_NAME(MT_PREFIX, heap_up)
+#define MT_HEAP_DOWN MT_MAKE_NAME(MT_PREFIX, heap_down)
+#define MT_HEAP_KEEPS MT_MAKE_NAME(MT_PREFIX, heap_keeps)
+#define MT_HEAP_PUT MT_MAKE_NAME(MT_PREFIX, heap_put)
+#define MT_HEAP_ORDER MT_MAKE_NAME(MT_PREFIX, heap_order)
+#define MT_HEAP_COMBINE MT_MAKE_NAME(MT_PREFIX, heap_combine)
+#define MT_SERIALIZE MT_MAKE_NAME(MT_PREFIX, serialize)
+#define MT_DESERIALIZE MT_MAKE_NAME(MT_PREFIX, deserialize)
+#define MT_UNPACK MT_MAKE_NAME(MT_PREFIX, unpack)
+#define MT_TREE_NEW MT_MAKE_NAME(MT_PREFIX, tree_new)
+#define MT_TREE_SPLIT MT_MAKE_NAME(MT_PREFIX, tree_split)
+#define MT_TREE_MERGE MT_MAKE_NAME(MT_PREFIX, tree_merge)
+#define MT_TREE_PUT MT_MAKE_NAME(MT_PREFIX, tree_put)
+#define MT_TREE_DEL MT_MAKE_NAME(MT_PREFIX, tree_del)
+#define MT_TREE_INSERT MT_MAKE_NAME(MT_PREFIX, tree_insert)
+#define MT_TREE_REMOVE MT_MAKE_NAME(MT_PREFIX, tree_remove)
+#define MT_TREE_AT MT_MAKE_NAME(MT_PREFIX, tree_at)
+
+#define MT_DATA(pg) ((pg)->data.MT_FIELD)
+#define MT_RANK MT_MAKE_NAME(MT_PREFIX, rank)
+#define MT_FLAT_INSERT MT_MAKE_NAME(MT_PREFIX, flat_insert)
+#define MT_FLAT_REMOVE MT_MAKE_NAME(MT_PREFIX, flat_remove)
+#define MT_FLAT_TO_TREE MT_MAKE_NAME(MT_PREFIX, flat_to_tree)
+#define MT_ADD_APPEND MT_MAKE_NAME(MT_PREFIX, add_append)
+#define MT_COUNTS_RESERVE MT_MAKE_NAME(MT_PREFIX, counts_reserve)
+#define MT_COUNTS_PUT MT_MAKE_NAME(MT_PREFIX, counts_put)
+#define MT_COUNTS_TOO_MANY MT_MAKE_NAME(MT_PREFIX, counts_too_many)
+#define MT_COUNTS_AT MT_MAKE_NAME(MT_PREFIX, counts_at)
+#define MT_COUNTS_RANKS MT_MAKE_NAME(MT_PREFIX, counts_ranks)
+#define MT_TRY_COUNTS MT_MAKE_NAME(MT_PREFIX, try_counts)
+#define MT_ADAPT MT_MAKE_NAME(MT_PREFIX, adapt)
+#define MT_COUNTS_EXPAND MT_MAKE_NAME(MT_PREFIX, counts_expand)
+#define MT_COUNTS_MERGE MT_MAKE_NAME(MT_PREFIX, counts_merge)
+#define MT_APPEND_COUNTS MT_MAKE_NAME(MT_PREFIX, append_counts)
+#define MT_ADD_COUNTS MT_MAKE_NAME(MT_PREFIX, add_counts)
+#define MT_ADD_BATCH_COUNTS MT_MAKE_NAME(MT_PREFIX, add_batch_counts)
+#define MT_REMOVE_COUNTS MT_MAKE_NAME(MT_PREFIX, remove_counts)
+#define MT_ADD_BATCH_APPEND MT_MAKE_NAME(MT_PREFIX, add_batch_append)
+#define MT_ADD_BATCH_SKETCH MT_MAKE_NAME(MT_PREFIX, add_batch_sketch)
+#define MT_ADD_SORTED MT_MAKE_NAME(MT_PREFIX, add_sorted)
+#define MT_ADD_TREE MT_MAKE_NAME(MT_PREFIX, add_tree)
+#define MT_ADD_FLAT MT_MAKE_NAME(MT_PREFIX, add_flat)
+#define MT_ADD_HEAP MT_MAKE_NAME(MT_PREFIX, add_heap)
+#define MT_REMOVE_TREE MT_MAKE_NAME(MT_PREFIX, remove_tree)
+#define MT_REMOVE_FLAT MT_MAKE_NAME(MT_PREFIX, remove_flat)
+#define MT_RANK_DATUM MT_MAKE_NAME(MT_PREFIX, rank_datum)
+#define MT_RANKS_DATUM MT_MAKE_NAME(MT_PREFIX, ranks_datum)
+#define MT_MULTI_SELECT MT_MAKE_NAME(MT_PREFIX, multi_select)
+#define MT_OPS MT_MAKE_NAME(MT_PREFIX, ops)
+#define MT_SORT MT_MAKE_NAME(MT_PREFIX, sort)
+#define MT_SPILL MT_MAKE_NAME(MT_PREFIX, spill)
+#define MT_LOSER_WINS MT_MAKE_NAME(MT_PREFIX, loser_wins)
+#define MT_SPILL_RANK MT_MAKE_NAME(MT_PREFIX, spill_rank)
+#define MT_APPEND_RUNS MT_MAKE_NAME(MT_PREFIX, append_runs)
+#define MT_HEAD(r) ((r)->blk->buf.MT_FIELD[(r)->i])
+#define MT_RUNS_MID(s, r) ((s)->pms->buf.MT_FIELD[(s)->lo[r] + ((s)->hi[r] - (s)->lo[r]) / 2])
+#define MT_SKETCH_MERGE_LEVEL MT_MAKE_NAME(MT_PREFIX, sketch_merge_level)
+#define MT_SKETCH_COMPACT MT_MAKE_NAME(MT_PREFIX, sketch_compact)
+#define MT_SKETCH_INSERT MT_MAKE_NAME(MT_PREFIX, sketch_insert)
+#define MT_SKETCH_AT MT_MAKE_NAME(MT_PREFIX, sketch_at)
+#define MT_SKETCH_COMBINE MT_MAKE_NAME(MT_PREFIX, sketch_combine)
+#define MT_ADD_SKETCH MT_MAKE_NAME(MT_PREFIX, add_sketch)
+#define MT_N(pms, n) ((pms)->tree->nodes[n])
+#define MT_LAST(pg) (MT_DATA(pg)[(pg)->dim - 1])
+
+#ifdef MT_PACK_ARRAY
+#define MT_PACKED
+#else
+#define MT_PACK_ARRAY(buf, v, n, pms) MT_SEND_ARRAY(buf, v, n, pms)
+#define MT_UNPACK_ARRAY(buf, v, n, pms) MT_RECV_ARRAY(buf, v, n, pms)
+#endif
+
+/*
+ * Index of the first of the `n` sorted elements in `v` that is greater
+ * than `x`, or `n` if there is no such element.
+ */
+static inline size_t
+MT_UPPER_BOUND(MT_ELEM const *v, size_t n, MT_ELEM x, struct MedianState *pms)
+{
+#ifdef MT_VEC_UPPER_BOUND
+	return MT_VEC_UPPER_BOUND(v, n, x);
+#else
+	size_t		lo = 0;
+	size_t		hi = n;
+
+	while (lo < hi)
+	{
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (MT_CMP(v[mid], x, pms) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+#endif
+}
+
+/*
+ * Index of the first of the `n` sorted elements in `v` that is not
+ * less than `x`, or `n` if there is no such element.
+ */
+static inline size_t
+MT_LOWER_BOUND(MT_ELEM const *v, size_t n, MT_ELEM x, struct MedianState *pms)
+{
+#ifdef MT_VEC_LOWER_BOUND
+	return MT_VEC_LOWER_BOUND(v, n, x);
+#else
+	size_t		lo = 0;
+	size_t		hi = n;
+
+	while (lo < hi)
+	{
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (MT_CMP(v[mid], x, pms) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+#endif
+}
+
+/*
+ * Binary search of the page directory. If `upper`, returns the index of
+ * the first page whose last element is greater than `x`, otherwise of
+ * the first page whose last element is not less than `x`. If there is
+ * no such page, returns the index of the last page.
+ */
+static inline size_t
+MT_FIND_PAGE(struct MedianState *pms, MT_ELEM x, bool upper)
+{
+	size_t		lo = 0;
+	size_t		hi = pms->npages;
+
+	while (lo < hi)
+	{
+		size_t		mid = lo + (hi - lo) / 2;
+		struct MedianPage *pg = pms->pages[mid];
+		int			c = (pg->dim == 0) ? 1 : MT_CMP(MT_LAST(pg), x, pms);
+
+		if (upper ? (c <= 0) : (c < 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < pms->npages) ? lo : pms->npages - 1;
+}
+
+/*
+ * Inserts `x` into the sorted pages, keeping them sorted (and the `mid`
+ * element found). Cost is bounded by the size of a page, not the number
+ * of elements.
+ */
+static struct MedianState *
+MT_INSERT(struct MedianState *pms, MT_ELEM x)
+{
+	size_t		ipg = MT_FIND_PAGE(pms, x, true);
+	struct MedianPage *pg = pms->pages[ipg];
+	size_t		i;
+
+	if (pg->dim >= pg->cap)
+	{
+		if (pg->cap < MEDIAN_PAGE_CAP)
+		{
+			pg = median_expand_page(pms, ipg);
+		}
+		else if ((ipg + 1 == pms->npages) && (MT_CMP(MT_LAST(pg), x, pms) <= 0))
+		{
+			/* appending past the end, don't leave half-empty pages behind */
+			pg = median_insert_page(pms, ipg + 1, NULL, 0);
+			++ipg;
+		}
+		else
+		{
+			median_split_page(pms, ipg);
+			if (MT_CMP(MT_LAST(pg), x, pms) <= 0)
+			{
+				pg = pms->pages[++ipg];
+			}
+		}
+	}
+	i = MT_UPPER_BOUND(MT_DATA(pg), pg->dim, x, pms);
+	MEDIAN_STAT(pms, moved, (pg->dim - i) * sizeof(MT_ELEM));
+	memmove(MT_DATA(pg) + i + 1, MT_DATA(pg) + i, (pg->dim - i) * sizeof(MT_ELEM));
+	MT_DATA(pg)[i] = x;
+	++pg->dim;
+	mid_insert(pms, ipg, i);
+	++pms->dim;
+
+	return pms;
+}
+
+/* The element at position `rank` of the sorted pages */
+static inline MT_ELEM
+MT_AT(struct MedianState *pms, size_t rank)
+{
+	size_t		ipg = median_page_of_rank(pms, &rank);
+
+	return MT_DATA(pms->pages[ipg])[rank];
+}
+
+/* Appends `x` to the unsorted buffer */
+static inline struct MedianState *
+MT_APPEND(struct MedianState *pms, MT_ELEM x)
+{
+	pms = median_expand_if_need_be(pms);
+	pms->buf.MT_FIELD[pms->dim++] = x;
+
+	return pms;
+}
+
+/*
+ * Keeps the unsorted buffer known to be sorted if its elements from
+ * `from` on are in order, after the ones before.
+ */
+static inline void
+MT_KEEP_PRESORTED(struct MedianState *pms, size_t from)
+{
+	MT_ELEM const *v = pms->buf.MT_FIELD;
+	size_t		i;
+
+	for (i = Max(from, 1); i < pms->dim; ++i)
+	{
+		if (MT_CMP(v[i - 1], v[i], pms) > 0)
+		{
+			pms->presorted = false;
+			return;
+		}
+	}
+}
+
+static inline void
+MT_SWAP(MT_ELEM *a, MT_ELEM *b)
+{
+	MT_ELEM		t = *a;
+
+	*a = *b;
+	*b = t;
+}
+
+#ifndef MT_VEC_SMALL_SORT
+static void
+MT_INSERTION_SORT(MT_ELEM *v, size_t n, struct MedianState *pms)
+{
+	size_t		i;
+
+	for (i = 1; i < n; ++i)
+	{
+		MT_ELEM		x = v[i];
+		size_t		j = i;
+
+		while ((j > 0) && (MT_CMP(x, v[j - 1], pms) < 0))
+		{
+			v[j] = v[j - 1];
+			--j;
+		}
+		v[j] = x;
+	}
+}
+#endif
+
+/* Index of the median of `v[a]`, `v[b]` and `v[c]` */
+static inline size_t
+MT_MEDIAN3(MT_ELEM const *v, size_t a, size_t b, size_t c, struct MedianState *pms)
+{
+	if (MT_CMP(v[a], v[b], pms) < 0)
+	{
+		if (MT_CMP(v[b], v[c], pms) < 0)
+			return b;
+		return (MT_CMP(v[a], v[c], pms) < 0) ? c : a;
+	}
+	if (MT_CMP(v[b], v[c], pms) > 0)
+		return b;
+	return (MT_CMP(v[a], v[c], pms) > 0) ? c : a;
+}
+
+static void MT_SELECT_DEPTH(MT_ELEM *v, size_t n, size_t k, int depth, struct MedianState *pms);
+
+/*
+ * The "median of medians" pivot: medians of groups of 5 are gathered
+ * at the start of `v` and their median is selected. Guarantees that at
+ * least 30% of elements are on each side of the pivot, which is what
+ * makes the worst case of the selection linear.
+ */
+static size_t
+MT_MOM_PIVOT(MT_ELEM *v, size_t n, struct MedianState *pms)
+{
+	size_t		ngroups = n / 5;
+	size_t		g;
+
+	for (g = 0; g < ngroups; ++g)
+	{
+#ifdef MT_VEC_SMALL_SORT
+		MT_VEC_SMALL_SORT(v + g * 5, 5);
+#else
+		MT_INSERTION_SORT(v + g * 5, 5, pms);
+#endif
+		MT_SWAP(v + g, v + g * 5 + 2);
+	}
+	MT_SELECT_DEPTH(v, ngroups, ngroups / 2, 0, pms);
+
+	return ngroups / 2;
+}
+
+/*
+ * Introselect: Quick Select with a median of 3 (ninther, for larger
+ * arrays) pivot and a three-way partition, so that many duplicates
+ * don't hurt. If partitioning is not making enough progress (`depth`
+ * goes to 0), switches to the median of medians pivot.
+ */
+static void
+MT_SELECT_DEPTH(MT_ELEM *v, size_t n, size_t k, int depth, struct MedianState *pms)
+{
+	while (n > 16)
+	{
+		size_t		ip;
+		MT_ELEM		pivot;
+		size_t		lt = 0;
+		size_t		gt = n;
+
+		if (depth-- <= 0)
+		{
+			ip = MT_MOM_PIVOT(v, n, pms);
+		}
+		else if (n > 128)
+		{
+			size_t		s = n / 8;
+
+			ip = MT_MEDIAN3(v,
+							MT_MEDIAN3(v, 0, s, 2 * s, pms),
+							MT_MEDIAN3(v, 3 * s, 4 * s, 5 * s, pms),
+							MT_MEDIAN3(v, 6 * s, 7 * s, n - 1, pms),
+							pms);
+		}
+		else
+		{
+			ip = MT_MEDIAN3(v, 0, n / 2, n - 1, pms);
+		}
+		pivot = v[ip];
+
+#ifdef MT_VEC_PARTITION
+		/*
+		 * Two (vectorized) passes: the one putting the elements equal to
+		 * the pivot after the smaller ones is only needed if `k` is not
+		 * among the smaller ones.
+		 */
+		lt = MT_VEC_PARTITION(v, n, pivot, false);
+		gt = (k < lt) ? n : lt + MT_VEC_PARTITION(v + lt, n - lt, pivot, true);
+		MEDIAN_STAT(pms, comparisons, n + ((k < lt) ? 0 : n - lt));
+#else
+		{
+			size_t		i = 0;
+
+			/* v[0, lt) < pivot, v[lt, i) == pivot, v[gt, n) > pivot */
+			while (i < gt)
+			{
+				int			c = MT_CMP(v[i], pivot, pms);
+
+				if (c < 0)
+					MT_SWAP(v + lt++, v + i++);
+				else if (c > 0)
+					MT_SWAP(v + i, v + --gt);
+				else
+					++i;
+			}
+		}
+#endif
+		if (k < lt)
+		{
+			n = lt;
+		}
+		else if (k >= gt)
+		{
+			v += gt;
+			k -= gt;
+			n -= gt;
+		}
+		else
+		{
+			return;
+		}
+	}
+#ifdef MT_VEC_SMALL_SORT
+	MT_VEC_SMALL_SORT(v, n);
+#else
+	MT_INSERTION_SORT(v, n, pms);
+#endif
+}
+
+/*
+ * Rearranges the `n` elements of `v` so that `v[k]` is the element that
+ * would be there if `v` was sorted, with none of the elements before it
+ * being greater, nor any after it being smaller.
+ */
+static void
+MT_SELECT(MT_ELEM *v, size_t n, size_t k, struct MedianState *pms)
+{
+	Assert(k < n);
+	MT_SELECT_DEPTH(v, n, k, 2 * (pg_leftmost_one_pos64(n) + 1), pms);
+}
+
+/*
+ * Selects all the (sorted, unique) `ranks` of `v[lo, hi)`, as `MT_SELECT`
+ * does one: the middle one is selected first, which partitions the
+ * elements for the ranks below and above it, so the partitioning is
+ * shared by all of them.
+ */
+static void
+MT_MULTI_SELECT(MT_ELEM *v, size_t lo, size_t hi, size_t const *ranks, size_t nranks,
+				struct MedianState *pms)
+{
+	while (nranks > 0)
+	{
+		size_t const m = nranks / 2;
+		size_t const r = ranks[m];
+
+		MT_SELECT(v + lo, hi - lo, r - lo, pms);
+		MT_MULTI_SELECT(v, lo, r, ranks, m, pms);
+		lo = r + 1;
+		ranks += m + 1;
+		nranks -= m + 1;
+	}
+}
+
+/* Appends (copies of) the `n` elements at `v` to the unsorted buffer */
+static void
+MT_APPEND_ALL(struct MedianState *pms, MT_ELEM const *v, size_t n)
+{
+	MT_ELEM    *dst;
+	size_t		i;
+
+	median_grow_buf(pms, pms->dim + n);
+	dst = pms->buf.MT_FIELD + pms->dim;
+	for (i = 0; i < n; ++i)
+	{
+		dst[i] = MT_COPY(v[i], pms);
+	}
+	pms->dim += n;
+}
+
+/* Turns the sorted pages into an (already sorted) unsorted buffer */
+static void
+MT_FLATTEN(struct MedianState *pms)
+{
+	size_t		ipg;
+	size_t		n = 0;
+
+	Assert(pms->engine == meSorted);
+	pms->cap = 0;
+	pms->buf.MT_FIELD = NULL;
+	median_reserve_buf(pms, pms->dim);
+	for (ipg = 0; ipg < pms->npages; ++ipg)
+	{
+		struct MedianPage *pg = pms->pages[ipg];
+
+		memcpy(pms->buf.MT_FIELD + n, MT_DATA(pg), pg->dim * sizeof(MT_ELEM));
+		n += pg->dim;
+		pfree(pg);
+	}
+	pfree(pms->pages);
+	pms->pages = NULL;
+	pms->npages = pms->pagescap = 0;
+	set_engine(pms, meAppend);
+}
+
+/*
+ * Records the sorted runs of `other`, whose elements were appended to the
+ * buffer of `pms` at `from`, the first of them going on with the last run
+ * of `pms` if it's in order after it, as it is for the partitions of a
+ * range, and makes a buffer of a single run `presorted`.
+ */
+static void
+MT_ADD_RUNS(struct MedianState *pms, struct MedianState const *other, size_t from)
+{
+	MT_ELEM const *v = pms->buf.MT_FIELD;
+	size_t		i;
+
+	if ((from > 0) && (MT_CMP(v[from - 1], v[from], pms) > 0))
+	{
+		median_runs_add(pms, from);
+	}
+	if (other->engine == meAppend)
+	{
+		for (i = 0; i < runs_count(other); ++i)
+		{
+			median_runs_add(pms, from + other->runs->at[i]);
+		}
+	}
+	pms->presorted = (runs_count(pms) == 0);
+}
+
+#define ST_SORT MT_SORT_RUNS
+#define ST_ELEMENT_TYPE size_t
+#define ST_COMPARE_ARG_TYPE struct MedianRunsSearch
+#define ST_COMPARE(a, b, s) MT_CMP(MT_RUNS_MID(s, *(a)), MT_RUNS_MID(s, *(b)), (s)->pms)
+#define ST_SCOPE static
+#define ST_DEFINE
+#include <lib/sort_template.h>
+
+/*
+ * The element at position `rank` of a buffer of sorted runs, found by
+ * narrowing down a range of each run, without moving any element: the
+ * middle element of the ranges, weighted by their lengths (the pivot), is
+ * counted, by a binary search of every range, to be at ranks `[below,
+ * below + equal)`, and the ranges are cut to the elements each side of it
+ * that the rank is in, until it's the pivot's. As half of the ranges, by
+ * their lengths, have their middle element on each side of the pivot,
+ * at least a quarter of the elements left is cut every time, so this
+ * takes O(log n) rounds of O(k log n) comparisons, for `k` runs.
+ */
+static MT_ELEM
+MT_RUNS_AT(struct MedianState *pms, size_t rank)
+{
+	MT_ELEM const *v = pms->buf.MT_FIELD;
+	size_t const k = runs_count(pms) + 1;
+	struct MedianRunsSearch s;
+	size_t	   *ord = palloc(5 * k * sizeof *ord);
+	size_t	   *lt = ord + 3 * k;
+	size_t	   *le = ord + 4 * k;
+	size_t		r;
+	MT_ELEM		pivot;
+
+	s.pms = pms;
+	s.lo = ord + k;
+	s.hi = ord + 2 * k;
+	for (r = 0; r < k; ++r)
+	{
+		s.lo[r] = (r == 0) ? 0 : pms->runs->at[r - 1];
+		s.hi[r] = (r + 1 < k) ? pms->runs->at[r] : pms->dim;
+	}
+	for (;;)
+	{
+		size_t		m = 0;
+		size_t		left = 0;
+		size_t		below = 0;
+		size_t		equal = 0;
+		size_t		acc = 0;
+		size_t		i;
+
+		for (r = 0; r < k; ++r)
+		{
+			if (s.lo[r] < s.hi[r])
+			{
+				ord[m++] = r;
+				left += s.hi[r] - s.lo[r];
+			}
+		}
+		Assert(rank < left);
+		if (m == 1)
+		{
+			pivot = v[s.lo[ord[0]] + rank];
+			break;
+		}
+		MT_SORT_RUNS(ord, m, &s);
+		for (i = 0; 2 * (acc + s.hi[ord[i]] - s.lo[ord[i]]) < left; ++i)
+		{
+			acc += s.hi[ord[i]] - s.lo[ord[i]];
+		}
+		pivot = MT_RUNS_MID(&s, ord[i]);
+		for (i = 0; i < m; ++i)
+		{
+			r = ord[i];
+			lt[r] = s.lo[r] + MT_LOWER_BOUND(v + s.lo[r], s.hi[r] - s.lo[r], pivot, pms);
+			le[r] = lt[r] + MT_UPPER_BOUND(v + lt[r], s.hi[r] - lt[r], pivot, pms);
+			below += lt[r] - s.lo[r];
+			equal += le[r] - lt[r];
+		}
+		if ((rank >= below) && (rank < below + equal))
+		{
+			break;
+		}
+		for (i = 0; i < m; ++i)
+		{
+			r = ord[i];
+			if (rank < below)
+			{
+				s.hi[r] = lt[r];
+			}
+			else
+			{
+				s.lo[r] = le[r];
+			}
+		}
+		if (rank >= below)
+		{
+			rank -= below + equal;
+		}
+	}
+	pfree(ord);
+
+	return pivot;
+}
+
+#define ST_SORT MT_SORT
+#define ST_ELEMENT_TYPE MT_ELEM
+#define ST_COMPARE_ARG_TYPE struct MedianState
+#define ST_COMPARE(a, b, pms) MT_CMP(*(a), *(b), (pms))
+#define ST_SCOPE static
+#define ST_DEFINE
+#include <lib/sort_template.h>
+
+/*
+ * Writes the buffer, sorted, as a new run to the temporary file, and
+ * empties it.
+ */
+static void
+MT_SPILL(struct MedianState *pms)
+{
+	StringInfoData data;
+	size_t		i;
+
+	MT_SORT(pms->buf.MT_FIELD, pms->dim, pms);
+	median_spill_begin_run(pms, pms->dim);
+	initStringInfo(&data);
+	for (i = 0; i < pms->dim; i += MEDIAN_SPILL_BLOCK)
+	{
+		size_t const n = Min(MEDIAN_SPILL_BLOCK, pms->dim - i);
+
+		resetStringInfo(&data);
+		MT_PACK_ARRAY(&data, pms->buf.MT_FIELD + i, n, pms);
+		median_spill_write_block(pms, n, &data);
+	}
+	median_spill_end_run(pms);
+	pfree(data.data);
+	for (i = 0; i < pms->dim; ++i)
+	{
+		MT_FREE(pms->buf.MT_FIELD[i], pms);
+	}
+	median_arena_reset(pms);
+	pms->dim = 0;
+	pms->presorted = false;
+	runs_clear(pms);
+}
+
+/*
+ * Whether reader `a` wins over reader `b`, in the tree of losers of
+ * `MT_SPILL_RANK`, by having the lesser head, a run that's been read to
+ * its end losing to any other
+ */
+static inline bool
+MT_LOSER_WINS(struct MedianRunReader const *a, struct MedianRunReader const *b, struct MedianState *pms)
+{
+	return !a->done && (b->done || (MT_CMP(MT_HEAD(a), MT_HEAD(b), pms) <= 0));
+}
+
+/*
+ * The element at position `rank` of a spilled state: the buffer is sorted
+ * and then merged with the runs, until we get to the element. The result is
+ * a copy, in the state.
+ *
+ * The runs are merged by a tree of losers: a node keeps the reader that
+ * lost the match of the winners of its two subtrees, and the root, `lt[0]`,
+ * the overall winner, whose head is the next element. Once it's taken,
+ * the new head of that reader only plays the losers on the path up from
+ * its leaf, one comparison per level, instead of the two per level of
+ * sifting down a heap.
+ */
+static MT_ELEM
+MT_SPILL_RANK(struct MedianState *pms, size_t rank)
+{
+	size_t const k = pms->spill->nruns + 1;
+	struct MedianRunReader *rd = palloc0(k * sizeof *rd);
+	size_t	   *lt = palloc(k * sizeof *lt);
+	size_t	   *win = palloc(2 * k * sizeof *win);
+	size_t		i;
+	MT_ELEM		x;
+
+	MT_SORT(pms->buf.MT_FIELD, pms->dim, pms);
+	rd[0].blk = pms;
+	rd[0].done = (pms->dim == 0);
+	for (i = 1; i < k; ++i)
+	{
+		median_reader_init(&rd[i], &pms->spill->runs[i - 1]);
+		rd[i].done = !median_reader_next(pms, &rd[i]);
+	}
+	/* the readers are the leaves, `k` on, of the nodes `1` to `k - 1` */
+	for (i = 0; i < k; ++i)
+	{
+		win[k + i] = i;
+	}
+	for (i = k; i-- > 1;)
+	{
+		size_t const a = win[2 * i];
+		size_t const b = win[2 * i + 1];
+		bool const	w = MT_LOSER_WINS(&rd[a], &rd[b], pms);
+
+		win[i] = w ? a : b;
+		lt[i] = w ? b : a;
+	}
+	lt[0] = (k > 1) ? win[1] : 0;
+	pfree(win);
+	for (;;)
+	{
+		struct MedianRunReader *r = &rd[lt[0]];
+		size_t		w = lt[0];
+
+		Assert(!r->done);
+		if (rank == 0)
+		{
+			x = MT_COPY(MT_HEAD(r), pms);
+			break;
+		}
+		--rank;
+		if ((++r->i >= r->blk->dim) && !median_reader_next(pms, r))
+		{
+			r->done = true;
+		}
+		for (i = (k + w) / 2; i > 0; i /= 2)
+		{
+			if (MT_LOSER_WINS(&rd[lt[i]], &rd[w], pms))
+			{
+				size_t const t = lt[i];
+
+				lt[i] = w;
+				w = t;
+			}
+		}
+		lt[0] = w;
+	}
+	for (i = 0; i < k; ++i)
+	{
+		median_reader_end(&rd[i]);
+	}
+	pfree(lt);
+	pfree(rd);
+
+	return x;
+}
+
+/* Adds the elements of the runs of (spilled) `other` to `pms` */
+static void
+MT_APPEND_RUNS(struct MedianState *pms, struct MedianState *other)
+{
+	StringInfoData data;
+	size_t		i;
+
+	initStringInfo(&data);
+	for (i = 0; i < spill_nruns(other); ++i)
+	{
+		struct MedianRun pos = other->spill->runs[i];
+
+		while (pos.left > 0)
+		{
+			size_t const n = median_spill_read_block(other, &pos, &data);
+
+			median_grow_buf(pms, pms->dim + n);
+			MT_UNPACK_ARRAY(&data, pms->buf.MT_FIELD + pms->dim, n, pms);
+			pms->dim += n;
+			if ((NULL != pms->spill) && spill_due(pms))
+			{
+				MT_SPILL(pms);
+			}
+		}
+	}
+	pfree(data.data);
+}
+
+/*
+ * Merges the `n` sorted elements of `v` into the (sorted) level `h` of the
+ * sketch, copying them if `copy`, otherwise moving them. Level 0 is not
+ * sorted, so they're just appended to it.
+ */
+static void
+MT_SKETCH_MERGE_LEVEL(struct MedianState *pms, size_t h, MT_ELEM const *v, size_t n, bool copy)
+{
+	struct MedianPage *pg = median_sketch_reserve(pms, h, ((h < pms->npages) ? pms->pages[h]->dim : 0) + n);
+	MT_ELEM    *dst = MT_DATA(pg);
+	size_t		i = pg->dim;
+	size_t		j = n;
+	size_t		to = pg->dim + n;
+
+	if (h == 0)
+	{
+		i = 0;
+	}
+	/* from the back, so that no element is overwritten before it's moved */
+	while (j > 0)
+	{
+		if ((i > 0) && (MT_CMP(dst[i - 1], v[j - 1], pms) > 0))
+		{
+			dst[--to] = dst[--i];
+		}
+		else
+		{
+			--j;
+			dst[--to] = copy ? MT_COPY(v[j], pms) : v[j];
+		}
+	}
+	pg->dim += n;
+	pms->sketch->size += n;
+}
+
+/* Compacts the lowest level of the sketch that is over its capacity */
+static void
+MT_SKETCH_COMPACT(struct MedianState *pms)
+{
+	size_t		h = 0;
+	struct MedianPage *pg;
+	MT_ELEM    *v;
+	size_t		odd;
+	size_t		n;
+	size_t		i;
+
+	while ((h + 1 < pms->npages) && (pms->pages[h]->dim < sketch_level_cap(pms, h)))
+	{
+		++h;
+	}
+	if (h + 1 == pms->npages)
+	{
+		median_sketch_reserve(pms, h + 1, 0);
+	}
+	pg = pms->pages[h];
+	v = MT_DATA(pg);
+	if (h == 0)
+	{
+		MT_SORT(v, pg->dim, pms);
+	}
+	/* with an odd number of elements, the first one stays */
+	odd = pg->dim & 1;
+	n = pg->dim / 2;
+	v += odd;
+	if (next_random(&pms->sketch->seed) & 1)
+	{
+		for (i = 0; i < n; ++i)
+		{
+			MT_FREE(v[2 * i], pms);
+			v[i] = v[2 * i + 1];
+		}
+	}
+	else
+	{
+		for (i = 0; i < n; ++i)
+		{
+			v[i] = v[2 * i];
+			MT_FREE(v[2 * i + 1], pms);
+		}
+	}
+	pg->dim = odd;
+	pms->sketch->size -= 2 * n;
+	MT_SKETCH_MERGE_LEVEL(pms, h + 1, v, n, false);
+}
+
+static struct MedianState *
+MT_SKETCH_INSERT(struct MedianState *pms, MT_ELEM x)
+{
+	struct MedianPage *pg;
+
+	if (pms->sketch->size >= pms->sketch->capacity)
+	{
+		MT_SKETCH_COMPACT(pms);
+	}
+	pg = pms->pages[0];
+	if (pg->dim >= pg->cap)
+	{
+		pg = median_sketch_reserve(pms, 0, pg->dim + 1);
+	}
+	MT_DATA(pg)[pg->dim++] = x;
+	++pms->sketch->size;
+	++pms->dim;
+
+	return pms;
+}
+
+/*
+ * The element of the sketch at (about) position `rank`, of all the values
+ * added: the levels are merged, by their weight, until we get past `rank`.
+ */
+static MT_ELEM
+MT_SKETCH_AT(struct MedianState *pms, size_t rank)
+{
+	size_t	   *at = palloc0(pms->npages * sizeof *at);
+	uint64		sum = 0;
+	MT_ELEM		x;
+
+	MT_SORT(MT_DATA(pms->pages[0]), pms->pages[0]->dim, pms);
+	for (;;)
+	{
+		size_t		best = pms->npages;
+		size_t		h;
+
+		for (h = 0; h < pms->npages; ++h)
+		{
+			if ((at[h] < pms->pages[h]->dim) &&
+				((best == pms->npages) ||
+				 (MT_CMP(MT_DATA(pms->pages[h])[at[h]], MT_DATA(pms->pages[best])[at[best]], pms) < 0)))
+			{
+				best = h;
+			}
+		}
+		Assert(best < pms->npages);
+		x = MT_DATA(pms->pages[best])[at[best]++];
+		sum += UINT64CONST(1) << best;
+		if (sum > rank)
+		{
+			break;
+		}
+	}
+	pfree(at);
+
+	return x;
+}
+
+/* Merges the sketch `other` into the sketch `pms` */
+static void
+MT_SKETCH_COMBINE(struct MedianState *pms, struct MedianState *other)
+{
+	size_t		h;
+
+	if ((pms->engine != meSketch) || (other->engine != meSketch))
+	{
+		elog(ERROR, "median sketch can only be combined with a sketch");
+		return;
+	}
+	if ((pms->dim == 0) || (other->sketch->k < pms->sketch->k))
+	{
+		median_sketch_set_k(pms, other->sketch->k);
+	}
+	for (h = 0; h < other->npages; ++h)
+	{
+		MT_SKETCH_MERGE_LEVEL(pms, h, MT_DATA(other->pages[h]), other->pages[h]->dim, true);
+	}
+	pms->dim += other->dim;
+	while (pms->sketch->size > pms->sketch->capacity)
+	{
+		MT_SKETCH_COMPACT(pms);
+	}
+}
+
+static struct MedianState *MT_TREE_INSERT(struct MedianState *pms, MT_ELEM x);
+
+/*
+ * The counted elements (`meCounts`): `buf` has the distinct elements,
+ * sorted, and `counts->n` the number of times each was added.
+ */
+
+/* Makes sure there's room for (at least) `n` distinct elements */
+static void
+MT_COUNTS_RESERVE(struct MedianState *pms, size_t n)
+{
+	if (n > pms->cap)
+	{
+		size_t const ncap = Max(n, Max((pms->cap * 3) / 2, MEDIAN_FIRST_BUF_CAP));
+
+		Assert(pms->buf.i != pms->inl.i);
+		median_resize_buf(pms, ncap);
+		pms->counts->n = repalloc_huge(pms->counts->n, ncap * sizeof(uint64));
+	}
+}
+
+/* Puts the (new) distinct element `x`, added `c` times, at `i` */
+static void
+MT_COUNTS_PUT(struct MedianState *pms, size_t i, MT_ELEM x, uint64 c)
+{
+	size_t const size = pms->counts->size;
+
+	MT_COUNTS_RESERVE(pms, size + 1);
+	MEDIAN_STAT(pms, moved, (size - i) * (sizeof(MT_ELEM) + sizeof(uint64)));
+	memmove(pms->buf.MT_FIELD + i + 1, pms->buf.MT_FIELD + i, (size - i) * sizeof(MT_ELEM));
+	memmove(pms->counts->n + i + 1, pms->counts->n + i, (size - i) * sizeof(uint64));
+	pms->buf.MT_FIELD[i] = x;
+	pms->counts->n[i] = c;
+	pms->counts->size = size + 1;
+	pms->dim += c;
+}
+
+/* Whether there are too many distinct elements for counting to pay off */
+static inline bool
+MT_COUNTS_TOO_MANY(struct MedianState *pms)
+{
+	return (pms->dim >= MEDIAN_COUNTS_PROBE) && (2 * pms->counts->size > pms->dim) &&
+		(median_engine != meCounts);
+}
+
+static MT_ELEM
+MT_COUNTS_AT(struct MedianState *pms, size_t rank)
+{
+	size_t		i;
+
+	for (i = 0; rank >= pms->counts->n[i]; ++i)
+	{
+		rank -= pms->counts->n[i];
+	}
+	return pms->buf.MT_FIELD[i];
+}
+
+/* The elements at the (sorted, unique) `ranks`, in one walk of the counts */
+static void
+MT_COUNTS_RANKS(struct MedianState *pms, size_t const *ranks, size_t n, Datum *values)
+{
+	size_t		i = 0;
+	size_t		below = 0;
+	size_t		j;
+
+	for (j = 0; j < n; ++j)
+	{
+		while (ranks[j] >= below + pms->counts->n[i])
+		{
+			below += pms->counts->n[i++];
+		}
+		values[j] = MT_TO_DATUM(pms->buf.MT_FIELD[i], pms);
+	}
+}
+
+/*
+ * Turns the state into `meCounts`, if (at most) a quarter of the (sorted)
+ * elements of its `buf` are distinct, returning whether it did. If
+ * `moving`, `buf` is the flat array of a window.
+ */
+static bool
+MT_TRY_COUNTS(struct MedianState *pms, bool moving)
+{
+	MT_ELEM    *v = pms->buf.MT_FIELD;
+	size_t		ndistinct = 1;
+	size_t		i;
+	size_t		j;
+
+	if ((pms->dim == 0) || (pms->buf.i == pms->inl.i))
+	{
+		return false;
+	}
+	for (i = 1; i < pms->dim; ++i)
+	{
+		ndistinct += (MT_CMP(v[i - 1], v[i], pms) != 0);
+	}
+	if (4 * ndistinct > pms->dim)
+	{
+		return false;
+	}
+	MEDIAN_PART(pms, counts)->n = MemoryContextAllocHuge(pms->ctx, pms->cap * sizeof(uint64));
+	pms->counts->n[0] = 1;
+	for (i = 1, j = 0; i < pms->dim; ++i)
+	{
+		if (MT_CMP(v[j], v[i], pms) == 0)
+		{
+			MT_FREE(v[i], pms);
+			++pms->counts->n[j];
+		}
+		else
+		{
+			v[++j] = v[i];
+			pms->counts->n[j] = 1;
+		}
+	}
+	pms->counts->size = j + 1;
+	pms->counts->moving = moving;
+	set_engine(pms, meCounts);
+
+	return true;
+}
+
+/*
+ * Picks how an aggregate keeps its values, by its first ones (the
+ * `MEDIAN_COUNTS_PROBE` of them in the buffer), which are sorted for that:
+ * counted, if few of them are distinct, or else the unsorted buffer, which
+ * is then known to be sorted, for as long as the next ones come in order,
+ * as they do for a (time) series, say. A buffer that's spilled, or turned
+ * into counts, later, once it's too big, or has too many distinct values,
+ * is switched by the checks of its adds.
+ */
+static void
+MT_ADAPT(struct MedianState *pms)
+{
+	MT_SORT(pms->buf.MT_FIELD, pms->dim, pms);
+	if (!MT_TRY_COUNTS(pms, false))
+	{
+		pms->presorted = true;
+	}
+}
+
+/*
+ * Turns the counted elements back into an unsorted buffer, or, for a
+ * window, a tree, once there are too many distinct ones.
+ */
+static void
+MT_COUNTS_EXPAND(struct MedianState *pms)
+{
+	MT_ELEM    *v = pms->buf.MT_FIELD;
+	uint64	   *counts = pms->counts->n;
+	size_t const size = pms->counts->size;
+	size_t const n = pms->dim;
+	size_t		i;
+
+	pms->buf.MT_FIELD = NULL;
+	pms->cap = 0;
+	pms->counts->n = NULL;
+	pms->counts->size = 0;
+	pms->dim = 0;
+	if (pms->counts->moving)
+	{
+		median_init_tree(pms, n);
+		for (i = 0; i < size; ++i)
+		{
+			uint64		c;
+
+			MT_TREE_INSERT(pms, v[i]);
+			for (c = 1; c < counts[i]; ++c)
+			{
+				MT_TREE_INSERT(pms, MT_COPY(v[i], pms));
+			}
+		}
+		set_engine(pms, meTree);
+	}
+	else
+	{
+		MT_ELEM    *dst;
+
+		median_reserve_buf(pms, n);
+		dst = pms->buf.MT_FIELD;
+		for (i = 0; i < size; ++i)
+		{
+			uint64		c;
+
+			*dst++ = v[i];
+			for (c = 1; c < counts[i]; ++c)
+			{
+				*dst++ = MT_COPY(v[i], pms);
+			}
+		}
+		pms->dim = n;
+		set_engine(pms, meAppend);
+		if ((NULL != pms->spill) && spill_due(pms))
+		{
+			MT_SPILL(pms);
+		}
+	}
+	pfree(v);
+	pfree(counts);
+}
+
+/* Merges the counted elements of `other` into the ones of `pms` */
+static void
+MT_COUNTS_MERGE(struct MedianState *pms, struct MedianState *other)
+{
+	size_t		i = 0;
+	size_t		j;
+
+	MT_COUNTS_RESERVE(pms, pms->counts->size + other->counts->size);
+	for (j = 0; j < other->counts->size; ++j)
+	{
+		MT_ELEM const x = other->buf.MT_FIELD[j];
+
+		i += MT_LOWER_BOUND(pms->buf.MT_FIELD + i, pms->counts->size - i, x, pms);
+		if ((i < pms->counts->size) && (MT_CMP(pms->buf.MT_FIELD[i], x, pms) == 0))
+		{
+			pms->counts->n[i] += other->counts->n[j];
+			pms->dim += other->counts->n[j];
+		}
+		else
+		{
+			MT_COUNTS_PUT(pms, i, MT_COPY(x, pms), other->counts->n[j]);
+		}
+	}
+	if (MT_COUNTS_TOO_MANY(pms))
+	{
+		MT_COUNTS_EXPAND(pms);
+	}
+}
+
+/* Appends (copies of) the counted elements of `other` to the unsorted buffer */
+static void
+MT_APPEND_COUNTS(struct MedianState *pms, struct MedianState *other)
+{
+	MT_ELEM    *dst;
+	size_t		i;
+
+	median_grow_buf(pms, pms->dim + other->dim);
+	dst = pms->buf.MT_FIELD + pms->dim;
+	for (i = 0; i < other->counts->size; ++i)
+	{
+		uint64		c;
+
+		for (c = 0; c < other->counts->n[i]; ++c)
+		{
+			*dst++ = MT_COPY(other->buf.MT_FIELD[i], pms);
+		}
+	}
+	pms->dim += other->dim;
+}
+
+/*
+ * The bounded heap of `meHeap` (see `heap` in `struct MedianState`),
+ * whose root, `buf[0]`, is the largest of the (smallest) values it keeps,
+ * or the smallest of the (largest) ones.
+ */
+
+/* Whether `a` goes above `b`, nearer the root */
+static inline bool
+MT_HEAP_ABOVE(struct MedianState *pms, MT_ELEM a, MT_ELEM b)
+{
+	int const	c = MT_CMP(a, b, pms);
+
+	return pms->heap.largest ? (c < 0) : (c > 0);
+}
+
+static void
+MT_HEAP_UP(struct MedianState *pms, size_t i)
+{
+	MT_ELEM    *v = pms->buf.MT_FIELD;
+	MT_ELEM const x = v[i];
+
+	while (i > 0)
+	{
+		size_t const parent = (i - 1) / 2;
+
+		if (!MT_HEAP_ABOVE(pms, x, v[parent]))
+		{
+			break;
+		}
+		v[i] = v[parent];
+		i = parent;
+	}
+	v[i] = x;
+}
+
+static void
+MT_HEAP_DOWN(struct MedianState *pms, size_t i)
+{
+	MT_ELEM    *v = pms->buf.MT_FIELD;
+	MT_ELEM const x = v[i];
+	size_t const n = pms->dim;
+
+	for (;;)
+	{
+		size_t		child = 2 * i + 1;
+
+		if (child >= n)
+		{
+			break;
+		}
+		if ((child + 1 < n) && MT_HEAP_ABOVE(pms, v[child + 1], v[child]))
+		{
+			++child;
+		}
+		if (!MT_HEAP_ABOVE(pms, v[child], x))
+		{
+			break;
+		}
+		v[i] = v[child];
+		i = child;
+	}
+	v[i] = x;
+}
+
+/* Whether `x` would be kept, as the heap isn't full, or `x` is past its root */
+static inline bool
+MT_HEAP_KEEPS(struct MedianState *pms, MT_ELEM x)
+{
+	return (pms->dim < pms->heap.k) || MT_HEAP_ABOVE(pms, pms->buf.MT_FIELD[0], x);
+}
+
+/* Puts `x`, which the heap keeps (and owns), in place of the root if full */
+static struct MedianState *
+MT_HEAP_PUT(struct MedianState *pms, MT_ELEM x)
+{
+	if (pms->dim < pms->heap.k)
+	{
+		pms = MT_APPEND(pms, x);
+		MT_HEAP_UP(pms, pms->dim - 1);
+	}
+	else
+	{
+		MT_FREE(pms->buf.MT_FIELD[0], pms);
+		pms->buf.MT_FIELD[0] = x;
+		MT_HEAP_DOWN(pms, 0);
+	}
+	pms->presorted = false;
+	return pms;
+}
+
+/*
+ * Sorts the heap, root first, so that any element is found at its rank.
+ * A sorted array is a heap, so values can still be added to it.
+ */
+static void
+MT_HEAP_ORDER(struct MedianState *pms)
+{
+	MT_ELEM    *v = pms->buf.MT_FIELD;
+
+	if (pms->presorted)
+	{
+		return;
+	}
+	MT_SORT(v, pms->dim, pms);
+	if (!pms->heap.largest)
+	{
+		size_t		i;
+
+		for (i = 0; i < pms->dim / 2; ++i)
+		{
+			MT_SWAP(&v[i], &v[pms->dim - 1 - i]);
+		}
+	}
+	pms->presorted = true;
+}
+
+static void
+MT_HEAP_COMBINE(struct MedianState *pms, struct MedianState *other)
+{
+	size_t		i;
+
+	for (i = 0; i < other->dim; ++i)
+	{
+		if (MT_HEAP_KEEPS(pms, other->buf.MT_FIELD[i]))
+		{
+			pms = MT_HEAP_PUT(pms, MT_COPY(other->buf.MT_FIELD[i], pms));
+		}
+	}
+}
+
+/*
+ * Adds the elements of `other` to `pms`. Sketches are merged level by
+ * level, heaps keep the best of both, and counts are merged. Otherwise
+ * the elements are appended to the unsorted buffer, and, if both states
+ * are sorted (or in sorted runs), the result is kept as their sorted
+ * runs (see `runs` in `struct MedianState`), which are searched for a
+ * rank, not merged.
+ */
+static void
+MT_COMBINE(struct MedianState *pms, struct MedianState *other)
+{
+	bool		sorted;
+	size_t		from;
+
+	if ((pms->engine >= meTree) || (other->engine >= meTree))
+	{
+		elog(ERROR, "median moving-aggregate state can't be combined");
+		return;
+	}
+	if (state_count(other) == 0)
+	{
+		return;
+	}
+	if ((pms->engine == meSketch) || (other->engine == meSketch))
+	{
+		MT_SKETCH_COMBINE(pms, other);
+		return;
+	}
+	if ((pms->engine == meHeap) || (other->engine == meHeap))
+	{
+		if (pms->engine != other->engine)
+		{
+			elog(ERROR, "median heap state can't be combined with a %s one",
+				 median_engine_names[(pms->engine == meHeap) ? other->engine : pms->engine]);
+			return;
+		}
+		MT_HEAP_COMBINE(pms, other);
+		return;
+	}
+	if ((pms->engine == meCounts) && (other->engine == meCounts))
+	{
+		MT_COUNTS_MERGE(pms, other);
+		return;
+	}
+	/*
+	 * Sorted states, which states of the partitions of a range often are,
+	 * are kept as sorted runs, for their ranks to be searched, when all of
+	 * them are in, instead of merged into each other, which would make it
+	 * O(n) per state. Otherwise, the elements are just appended, to be
+	 * selected from.
+	 */
+	sorted = in_runs(pms) && in_runs(other);
+	if (pms->engine == meSorted)
+	{
+		MT_FLATTEN(pms);
+	}
+	else if (pms->engine == meCounts)
+	{
+		MT_COUNTS_EXPAND(pms);
+	}
+	if (!sorted)
+	{
+		runs_clear(pms);
+	}
+	pms->presorted = false;
+	from = pms->dim;
+	if (other->engine == meCounts)
+	{
+		MT_APPEND_COUNTS(pms, other);
+	}
+	else if (other->engine == meAppend)
+	{
+		MT_APPEND_ALL(pms, other->buf.MT_FIELD, other->dim);
+		MT_APPEND_RUNS(pms, other);
+	}
+	else
+	{
+		size_t		ipg;
+
+		for (ipg = 0; ipg < other->npages; ++ipg)
+		{
+			MT_APPEND_ALL(pms, MT_DATA(other->pages[ipg]), other->pages[ipg]->dim);
+		}
+	}
+	if (sorted)
+	{
+		MT_ADD_RUNS(pms, other, from);
+	}
+	if ((NULL != pms->spill) && spill_due(pms))
+	{
+		MT_SPILL(pms);
+	}
+}
+
+static void
+MT_SERIALIZE(struct MedianState *pms, StringInfo buf)
+{
+	if (pms->engine >= meTree)
+	{
+		elog(ERROR, "median moving-aggregate state can't be serialized");
+		return;
+	}
+	if (pms->engine == meAppend)
+	{
+		StringInfoData data;
+		size_t		i;
+#ifdef MT_PACKED
+		MT_ELEM    *blk = palloc(MEDIAN_SPILL_BLOCK * sizeof *blk);
+#endif
+
+		MT_SEND_ARRAY(buf, pms->buf.MT_FIELD, pms->dim, pms);
+		/* unless packed, the runs are already serialized, and just copied */
+		initStringInfo(&data);
+		for (i = 0; i < spill_nruns(pms); ++i)
+		{
+			struct MedianRun pos = pms->spill->runs[i];
+
+			while (pos.left > 0)
+			{
+#ifdef MT_PACKED
+				size_t const n = median_spill_read_block(pms, &pos, &data);
+
+				MT_UNPACK_ARRAY(&data, blk, n, pms);
+				MT_SEND_ARRAY(buf, blk, n, pms);
+#else
+				median_spill_read_block(pms, &pos, &data);
+				pq_sendbytes(buf, data.data, data.len);
+#endif
+			}
+		}
+		pfree(data.data);
+#ifdef MT_PACKED
+		pfree(blk);
+#endif
+	}
+	else if (pms->engine == meHeap)
+	{
+		pq_sendint32(buf, pms->heap.k);
+		pq_sendbyte(buf, pms->heap.largest);
+		MT_SEND_ARRAY(buf, pms->buf.MT_FIELD, pms->dim, pms);
+	}
+	else if (pms->engine == meCounts)
+	{
+		pq_sendint64(buf, pms->counts->size);
+		MT_SEND_ARRAY(buf, pms->buf.MT_FIELD, pms->counts->size, pms);
+		pq_sendbytes(buf, (char *) pms->counts->n, pms->counts->size * sizeof(uint64));
+	}
+	else if (pms->engine == meSketch)
+	{
+		size_t		h;
+
+		pq_sendint32(buf, pms->sketch->k);
+		pq_sendint32(buf, pms->npages);
+		for (h = 0; h < pms->npages; ++h)
+		{
+			pq_sendint64(buf, pms->pages[h]->dim);
+		}
+		for (h = 0; h < pms->npages; ++h)
+		{
+			MT_WRITE_ARRAY(buf, MT_DATA(pms->pages[h]), pms->pages[h]->dim, pms);
+		}
+	}
+	else
+	{
+		size_t		ipg;
+
+		for (ipg = 0; ipg < pms->npages; ++ipg)
+		{
+			MT_SEND_ARRAY(buf, MT_DATA(pms->pages[ipg]), pms->pages[ipg]->dim, pms);
+		}
+	}
+}
+
+/*
+ * Reads `n` serialized elements into the (new) state. For the sorted
+ * engine, they are known to be sorted, so we just fill the pages. For the
+ * sketch, `n` is the number of values it stands for, and its levels are
+ * read as they were, as are the distinct elements and their counts. As a
+ * sketch may be a `median_sketch` from the outside, the sizes of its
+ * levels are checked against what's left of `buf` before anything is
+ * allocated, and the levels above 0 to be sorted.
+ */
+static void
+MT_DESERIALIZE(struct MedianState *pms, StringInfo buf, size_t n)
+{
+	if (pms->engine == meAppend)
+	{
+		median_reserve_buf(pms, n);
+		MT_RECV_ARRAY(buf, pms->buf.MT_FIELD, n, pms);
+	}
+	else if (pms->engine == meHeap)
+	{
+		pms->heap.k = pq_getmsgint(buf, 4);
+		pms->heap.largest = pq_getmsgbyte(buf);
+		if (n > pms->heap.k)
+		{
+			elog(ERROR, "invalid median heap state");
+			return;
+		}
+		median_reserve_buf(pms, n);
+		MT_RECV_ARRAY(buf, pms->buf.MT_FIELD, n, pms);
+	}
+	else if (pms->engine == meCounts)
+	{
+		size_t const size = pq_getmsgint64(buf);
+
+		MT_COUNTS_RESERVE(pms, size);
+		MT_RECV_ARRAY(buf, pms->buf.MT_FIELD, size, pms);
+		memcpy(pms->counts->n, pq_getmsgbytes(buf, size * sizeof(uint64)), size * sizeof(uint64));
+		pms->counts->size = size;
+	}
+	else if (pms->engine == meSketch)
+	{
+		size_t		nlevels;
+		size_t	   *dims;
+		size_t		h;
+
+		median_sketch_set_k(pms, pq_getmsgint(buf, 4));
+		nlevels = pq_getmsgint(buf, 4);
+		if ((pms->sketch->k < MEDIAN_SKETCH_MIN_K) || (pms->sketch->k > MEDIAN_SKETCH_MAX_K) ||
+			(nlevels == 0) || (nlevels > MEDIAN_SKETCH_MAX_LEVELS))
+		{
+			elog(ERROR, "invalid median_sketch");
+			return;
+		}
+		dims = palloc(nlevels * sizeof *dims);
+		for (h = 0; h < nlevels; ++h)
+		{
+			dims[h] = pq_getmsgint64(buf);
+		}
+		for (h = 0; h < nlevels; ++h)
+		{
+			struct MedianPage *pg;
+			MT_ELEM    *v;
+			size_t		i;
+
+			/* every element takes at least 4 bytes */
+			if (dims[h] > (size_t) (buf->len - buf->cursor) / 4)
+			{
+				elog(ERROR, "invalid median_sketch");
+				return;
+			}
+			pg = median_sketch_reserve(pms, h, dims[h]);
+			v = MT_DATA(pg);
+			MT_READ_ARRAY(buf, v, dims[h], pms);
+			pg->dim = dims[h];
+			pms->sketch->size += dims[h];
+			for (i = 1; (h > 0) && (i < dims[h]); ++i)
+			{
+				if (MT_CMP(v[i - 1], v[i], pms) > 0)
+				{
+					elog(ERROR, "invalid median_sketch");
+					return;
+				}
+			}
+		}
+		pfree(dims);
+	}
+	else
+	{
+		struct MedianPage *pg = pms->pages[0];
+		size_t		left = n;
+
+		while (left > 0)
+		{
+			size_t		chunk = Min(left, MEDIAN_PAGE_CAP);
+
+			if (pg->dim > 0)
+			{
+				pg = median_insert_page(pms, pms->npages, NULL, 0);
+			}
+			else if (pg->cap < chunk)
+			{
+				pfree(pg);
+				pg = pms->pages[0] = create_MedianPage(pms, MEDIAN_PAGE_CAP);
+			}
+			MT_RECV_ARRAY(buf, MT_DATA(pg), chunk, pms);
+			pg->dim = chunk;
+			left -= chunk;
+		}
+	}
+	pms->dim = n;
+}
+
+/* Reads the `n` elements of a block of a spilled run into the new state */
+static void
+MT_UNPACK(struct MedianState *pms, StringInfo buf, size_t n)
+{
+	median_reserve_buf(pms, n);
+	MT_UNPACK_ARRAY(buf, pms->buf.MT_FIELD, n, pms);
+	pms->dim = n;
+}
+
+/*
+ * The order-statistic tree, for the moving aggregate (see `struct
+ * MedianNode`).
+ */
+static uint32
+MT_TREE_NEW(struct MedianState *pms, MT_ELEM x)
+{
+	uint32		n = pms->tree->freelist;
+
+	if (n != 0)
+	{
+		pms->tree->freelist = MT_N(pms, n).left;
+	}
+	else
+	{
+		if (pms->tree->nnodes >= pms->tree->cap)
+		{
+			size_t		ncap = (pms->tree->cap * 3) / 2;
+
+			if (ncap > PG_UINT32_MAX)
+			{
+				elog(ERROR, "Too many elements in median window");
+				return 0;
+			}
+			pms->tree->nodes = repalloc_huge(pms->tree->nodes, ncap * sizeof(struct MedianNode));
+			pms->tree->cap = ncap;
+			stats_grown(pms);
+		}
+		n = pms->tree->nnodes++;
+	}
+	MT_N(pms, n).val.MT_FIELD = x;
+	MT_N(pms, n).left = MT_N(pms, n).right = 0;
+	MT_N(pms, n).size = 1;
+	MT_N(pms, n).prio = next_random(&pms->tree->seed);
+
+	return n;
+}
+
+/*
+ * Splits the tree `t` into `*l`, with the elements less than `x`, and
+ * `*r`, with the rest.
+ */
+static void
+MT_TREE_SPLIT(struct MedianState *pms, uint32 t, MT_ELEM x, uint32 *l, uint32 *r)
+{
+	struct MedianNode  *nd;
+
+	if (t == 0)
+	{
+		*l = *r = 0;
+		return;
+	}
+	nd = &MT_N(pms, t);
+	if (MT_CMP(nd->val.MT_FIELD, x, pms) < 0)
+	{
+		MT_TREE_SPLIT(pms, nd->right, x, &nd->right, r);
+		*l = t;
+	}
+	else
+	{
+		MT_TREE_SPLIT(pms, nd->left, x, l, &nd->left);
+		*r = t;
+	}
+	nd->size = MT_N(pms, nd->left).size + MT_N(pms, nd->right).size + 1;
+}
+
+/* Joins `l` and `r`, all of `l` being less or equal to all of `r` */
+static uint32
+MT_TREE_MERGE(struct MedianState *pms, uint32 l, uint32 r)
+{
+	if (l == 0)
+		return r;
+	if (r == 0)
+		return l;
+	if (MT_N(pms, l).prio > MT_N(pms, r).prio)
+	{
+		MT_N(pms, l).right = MT_TREE_MERGE(pms, MT_N(pms, l).right, r);
+		MT_N(pms, l).size = MT_N(pms, MT_N(pms, l).left).size + MT_N(pms, MT_N(pms, l).right).size + 1;
+		return l;
+	}
+	MT_N(pms, r).left = MT_TREE_MERGE(pms, l, MT_N(pms, r).left);
+	MT_N(pms, r).size = MT_N(pms, MT_N(pms, r).left).size + MT_N(pms, MT_N(pms, r).right).size + 1;
+	return r;
+}
+
+/* Puts the node `n` into the tree `t`, returns the new root */
+static uint32
+MT_TREE_PUT(struct MedianState *pms, uint32 t, uint32 n)
+{
+	struct MedianNode  *nd;
+
+	if (t == 0)
+		return n;
+	if (MT_N(pms, n).prio > MT_N(pms, t).prio)
+	{
+		struct MedianNode  *nn = &MT_N(pms, n);
+
+		MT_TREE_SPLIT(pms, t, nn->val.MT_FIELD, &nn->left, &nn->right);
+		nn->size = MT_N(pms, nn->left).size + MT_N(pms, nn->right).size + 1;
+		return n;
+	}
+	nd = &MT_N(pms, t);
+	if (MT_CMP(MT_N(pms, n).val.MT_FIELD, nd->val.MT_FIELD, pms) < 0)
+		nd->left = MT_TREE_PUT(pms, nd->left, n);
+	else
+		nd->right = MT_TREE_PUT(pms, nd->right, n);
+	++nd->size;
+	return t;
+}
+
+/*
+ * Removes one node with element equal to `x` from the tree `t`, returning
+ * the new root. `*found` is set to the removed node, if there was one.
+ */
+static uint32
+MT_TREE_DEL(struct MedianState *pms, uint32 t, MT_ELEM x, uint32 *found)
+{
+	struct MedianNode  *nd;
+	int			c;
+
+	if (t == 0)
+		return 0;
+	nd = &MT_N(pms, t);
+	c = MT_CMP(x, nd->val.MT_FIELD, pms);
+	if (c == 0)
+	{
+		*found = t;
+		return MT_TREE_MERGE(pms, nd->left, nd->right);
+	}
+	if (c < 0)
+		nd->left = MT_TREE_DEL(pms, nd->left, x, found);
+	else
+		nd->right = MT_TREE_DEL(pms, nd->right, x, found);
+	if (*found != 0)
+		--nd->size;
+	return t;
+}
+
+static struct MedianState *
+MT_TREE_INSERT(struct MedianState *pms, MT_ELEM x)
+{
+	uint32		n = MT_TREE_NEW(pms, x);
+
+	pms->tree->root = MT_TREE_PUT(pms, pms->tree->root, n);
+	++pms->dim;
+
+	return pms;
+}
+
+/*
+ * Removes one element equal to `x` from the tree. Returns false if there
+ * is no such element.
+ */
+static bool
+MT_TREE_REMOVE(struct MedianState *pms, MT_ELEM x)
+{
+	uint32		found = 0;
+
+	pms->tree->root = MT_TREE_DEL(pms, pms->tree->root, x, &found);
+	if (found == 0)
+	{
+		return false;
+	}
+	MT_FREE(MT_N(pms, found).val.MT_FIELD, pms);
+	MT_N(pms, found).left = pms->tree->freelist;
+	pms->tree->freelist = found;
+	--pms->dim;
+
+	return true;
+}
+
+/* The element at position `rank` (in sorted order) of the tree */
+static MT_ELEM
+MT_TREE_AT(struct MedianState *pms, size_t rank)
+{
+	uint32		t = pms->tree->root;
+
+	Assert(rank < pms->dim);
+	for (;;)
+	{
+		struct MedianNode  *nd = &MT_N(pms, t);
+		size_t		nleft = MT_N(pms, nd->left).size;
+
+		if (rank < nleft)
+		{
+			t = nd->left;
+		}
+		else if (rank == nleft)
+		{
+			return nd->val.MT_FIELD;
+		}
+		else
+		{
+			rank -= nleft + 1;
+			t = nd->right;
+		}
+	}
+}
+
+/*
+ * The flat sorted array, for a small moving-aggregate: the `buf`, but
+ * kept sorted. For a few hundred elements, moving them is cheaper than
+ * maintaining a tree.
+ */
+static struct MedianState *
+MT_FLAT_INSERT(struct MedianState *pms, MT_ELEM x)
+{
+	size_t		i;
+
+	pms = median_expand_if_need_be(pms);
+	i = MT_UPPER_BOUND(pms->buf.MT_FIELD, pms->dim, x, pms);
+	MEDIAN_STAT(pms, moved, (pms->dim - i) * sizeof(MT_ELEM));
+	memmove(pms->buf.MT_FIELD + i + 1, pms->buf.MT_FIELD + i, (pms->dim - i) * sizeof(MT_ELEM));
+	pms->buf.MT_FIELD[i] = x;
+	++pms->dim;
+
+	return pms;
+}
+
+static bool
+MT_FLAT_REMOVE(struct MedianState *pms, MT_ELEM x)
+{
+	size_t		i = MT_LOWER_BOUND(pms->buf.MT_FIELD, pms->dim, x, pms);
+
+	if ((i == pms->dim) || (MT_CMP(pms->buf.MT_FIELD[i], x, pms) != 0))
+	{
+		return false;
+	}
+	MT_FREE(pms->buf.MT_FIELD[i], pms);
+	MEDIAN_STAT(pms, moved, (pms->dim - i - 1) * sizeof(MT_ELEM));
+	memmove(pms->buf.MT_FIELD + i, pms->buf.MT_FIELD + i + 1, (pms->dim - i - 1) * sizeof(MT_ELEM));
+	--pms->dim;
+
+	return true;
+}
+
+/* Moves the elements of the flat sorted array to the tree */
+static void
+MT_FLAT_TO_TREE(struct MedianState *pms)
+{
+	MT_ELEM    *v = pms->buf.MT_FIELD;
+	size_t		n = pms->dim;
+	size_t		i;
+
+	Assert(pms->engine == meFlat);
+	median_init_tree(pms, n);
+	pms->dim = 0;
+	for (i = 0; i < n; ++i)
+	{
+		MT_TREE_INSERT(pms, v[i]);
+	}
+	pfree(v);
+	pms->buf.MT_FIELD = NULL;
+	pms->cap = 0;
+	set_engine(pms, meTree);
+}
+
+/*
+ * The element at position `rank` (in sorted order) of the state, with
+ * whatever engine it has.
+ */
+static MT_ELEM
+MT_RANK(struct MedianState *pms, size_t rank)
+{
+	switch (pms->engine)
+	{
+		case meAppend:
+			if (pms->presorted)
+			{
+				return pms->buf.MT_FIELD[rank];
+			}
+			if (runs_count(pms) > 0)
+			{
+				if ((runs_count(pms) + 1) * MEDIAN_RUN_MIN_AVG <= pms->dim)
+				{
+					return MT_RUNS_AT(pms, rank);
+				}
+				/* selecting reorders the elements */
+				runs_clear(pms);
+			}
+#ifdef MT_RADIX_RANK
+			if (median_select == msRadix)
+			{
+				return MT_RADIX_RANK(pms->buf.MT_FIELD, pms->dim, rank);
+			}
+#endif
+			MT_SELECT(pms->buf.MT_FIELD, pms->dim, rank, pms);
+			return pms->buf.MT_FIELD[rank];
+		case meSorted:
+			return MT_AT(pms, rank);
+		case meSketch:
+			return MT_SKETCH_AT(pms, rank);
+		case meCounts:
+			return MT_COUNTS_AT(pms, rank);
+		case meHeap:
+			if (rank == (pms->heap.largest ? 0 : pms->dim - 1))
+			{
+				return pms->buf.MT_FIELD[0];
+			}
+			MT_HEAP_ORDER(pms);
+			return pms->buf.MT_FIELD[pms->heap.largest ? rank : pms->dim - 1 - rank];
+		case meTree:
+			return MT_TREE_AT(pms, rank);
+		case meFlat:
+			return pms->buf.MT_FIELD[rank];
+	}
+	pg_unreachable();
+}
+
+/* The operations on `Datum` arguments and results */
+
+static struct MedianState *
+MT_ADD_APPEND(struct MedianState *pms, Datum d)
+{
+	if (unlikely(NULL != pms->spill) && spill_due(pms))
+	{
+		MT_SPILL(pms);
+	}
+	pms = MT_APPEND(pms, MT_FROM_DATUM(d, pms));
+	if (pms->presorted)
+	{
+		MT_KEEP_PRESORTED(pms, pms->dim - 1);
+	}
+	else if (unlikely(pms->dim == MEDIAN_COUNTS_PROBE) && (spill_nruns(pms) == 0) &&
+			 (median_engine < 0))
+	{
+		MT_ADAPT(pms);
+	}
+	return pms;
+}
+
+/*
+ * Adds the `n` values at `d` as `MT_ADD_APPEND` does, but checks if it's
+ * due to spill, or to expand the buffer, only once per the elements that
+ * fit in it.
+ */
+static void
+MT_ADD_BATCH_APPEND(struct MedianState *pms, Datum const *d, size_t n)
+{
+	while (n > 0)
+	{
+		MT_ELEM    *dst;
+		size_t		m;
+		size_t		i;
+
+		if (unlikely(NULL != pms->spill) && spill_due(pms))
+		{
+			MT_SPILL(pms);
+		}
+		pms = median_expand_if_need_be(pms);
+		m = Min(n, pms->cap - pms->dim);
+		dst = pms->buf.MT_FIELD + pms->dim;
+		for (i = 0; i < m; ++i)
+		{
+			dst[i] = MT_FROM_DATUM(d[i], pms);
+		}
+		pms->dim += m;
+		if (pms->presorted)
+		{
+			MT_KEEP_PRESORTED(pms, pms->dim - m);
+		}
+		d += m;
+		n -= m;
+	}
+}
+
+/*
+ * Adds the `n` values at `d` as `MT_ADD_SKETCH` does, but checks if it's
+ * due to compact, or to expand level 0, only once per the elements that
+ * fit in it.
+ */
+static void
+MT_ADD_BATCH_SKETCH(struct MedianState *pms, Datum const *d, size_t n)
+{
+	while (n > 0)
+	{
+		struct MedianPage *pg;
+		MT_ELEM    *dst;
+		size_t		m;
+		size_t		i;
+
+		if (pms->sketch->size >= pms->sketch->capacity)
+		{
+			MT_SKETCH_COMPACT(pms);
+		}
+		pg = pms->pages[0];
+		if (pg->dim >= pg->cap)
+		{
+			pg = median_sketch_reserve(pms, 0, pg->dim + 1);
+		}
+		m = Min(n, pg->cap - pg->dim);
+		if (pms->sketch->size < pms->sketch->capacity)
+		{
+			m = Min(m, pms->sketch->capacity - pms->sketch->size);
+		}
+		else
+		{
+			m = 1;
+		}
+		dst = MT_DATA(pg) + pg->dim;
+		for (i = 0; i < m; ++i)
+		{
+			dst[i] = MT_FROM_DATUM(d[i], pms);
+		}
+		pg->dim += m;
+		pms->sketch->size += m;
+		pms->dim += m;
+		d += m;
+		n -= m;
+	}
+}
+
+static struct MedianState *
+MT_ADD_COUNTS(struct MedianState *pms, Datum d)
+{
+	MT_ELEM const x = MT_PEEK_DATUM(d, pms);
+	size_t const i = MT_LOWER_BOUND(pms->buf.MT_FIELD, pms->counts->size, x, pms);
+
+	if ((i < pms->counts->size) && (MT_CMP(pms->buf.MT_FIELD[i], x, pms) == 0))
+	{
+		++pms->counts->n[i];
+		++pms->dim;
+		return pms;
+	}
+	MT_COUNTS_PUT(pms, i, MT_FROM_DATUM(d, pms), 1);
+	if (unlikely(MT_COUNTS_TOO_MANY(pms)))
+	{
+		MT_COUNTS_EXPAND(pms);
+	}
+	return pms;
+}
+
+/*
+ * Adds the `n` values at `d` as `MT_ADD_COUNTS` does, handing the rest of
+ * them to the batch of the unsorted buffer, if it's turned into one, or,
+ * for an engine without batches (the tree, of a moving state), adding
+ * them one by one.
+ */
+static void
+MT_ADD_BATCH_COUNTS(struct MedianState *pms, Datum const *d, size_t n)
+{
+	size_t		i;
+
+	for (i = 0; i < n; ++i)
+	{
+		MT_ADD_COUNTS(pms, d[i]);
+		if (unlikely(pms->engine != meCounts))
+		{
+			if (NULL != pms->ti->ops->add_batch[pms->engine])
+			{
+				pms->ti->ops->add_batch[pms->engine] (pms, d + i + 1, n - i - 1);
+				return;
+			}
+			for (++i; i < n; ++i)
+			{
+				pms->ti->ops->add[pms->engine] (pms, d[i]);
+			}
+			return;
+		}
+	}
+}
+
+static struct MedianState *
+MT_ADD_SORTED(struct MedianState *pms, Datum d)
+{
+	return MT_INSERT(pms, MT_FROM_DATUM(d, pms));
+}
+
+static struct MedianState *
+MT_ADD_SKETCH(struct MedianState *pms, Datum d)
+{
+	return MT_SKETCH_INSERT(pms, MT_FROM_DATUM(d, pms));
+}
+
+static struct MedianState *
+MT_ADD_HEAP(struct MedianState *pms, Datum d)
+{
+	if (MT_HEAP_KEEPS(pms, MT_PEEK_DATUM(d, pms)))
+	{
+		pms = MT_HEAP_PUT(pms, MT_FROM_DATUM(d, pms));
+	}
+	return pms;
+}
+
+static struct MedianState *
+MT_ADD_TREE(struct MedianState *pms, Datum d)
+{
+	return MT_TREE_INSERT(pms, MT_FROM_DATUM(d, pms));
+}
+
+static struct MedianState *
+MT_ADD_FLAT(struct MedianState *pms, Datum d)
+{
+	pms = MT_FLAT_INSERT(pms, MT_FROM_DATUM(d, pms));
+	if ((pms->dim > (size_t) median_small_window_threshold) && (median_engine != meFlat))
+	{
+		if ((pms->dim < MEDIAN_COUNTS_PROBE) || !MT_TRY_COUNTS(pms, true))
+		{
+			MT_FLAT_TO_TREE(pms);
+		}
+	}
+	return pms;
+}
+
+static bool
+MT_REMOVE_TREE(struct MedianState *pms, Datum d)
+{
+	return MT_TREE_REMOVE(pms, MT_PEEK_DATUM(d, pms));
+}
+
+static bool
+MT_REMOVE_FLAT(struct MedianState *pms, Datum d)
+{
+	return MT_FLAT_REMOVE(pms, MT_PEEK_DATUM(d, pms));
+}
+
+static bool
+MT_REMOVE_COUNTS(struct MedianState *pms, Datum d)
+{
+	MT_ELEM const x = MT_PEEK_DATUM(d, pms);
+	size_t const size = pms->counts->size;
+	size_t const i = MT_LOWER_BOUND(pms->buf.MT_FIELD, size, x, pms);
+
+	if ((i == size) || (MT_CMP(pms->buf.MT_FIELD[i], x, pms) != 0))
+	{
+		return false;
+	}
+	--pms->dim;
+	if (--pms->counts->n[i] == 0)
+	{
+		MT_FREE(pms->buf.MT_FIELD[i], pms);
+		MEDIAN_STAT(pms, moved, (size - i - 1) * (sizeof(MT_ELEM) + sizeof(uint64)));
+		memmove(pms->buf.MT_FIELD + i, pms->buf.MT_FIELD + i + 1, (size - i - 1) * sizeof(MT_ELEM));
+		memmove(pms->counts->n + i, pms->counts->n + i + 1, (size - i - 1) * sizeof(uint64));
+		pms->counts->size = size - 1;
+	}
+
+	return true;
+}
+
+static Datum
+MT_RANK_DATUM(struct MedianState *pms, size_t rank)
+{
+	if (unlikely(spill_nruns(pms) > 0))
+	{
+#ifdef MT_RADIX_SPILL_RANK
+		if (median_select == msRadix)
+		{
+			return MT_TO_DATUM(MT_RADIX_SPILL_RANK(pms, rank), pms);
+		}
+#endif
+		return MT_TO_DATUM(MT_SPILL_RANK(pms, rank), pms);
+	}
+	return MT_TO_DATUM(MT_RANK(pms, rank), pms);
+}
+
+static void
+MT_RANKS_DATUM(struct MedianState *pms, size_t const *ranks, size_t n, Datum *values)
+{
+	size_t		i;
+
+	if ((pms->engine == meAppend) && (spill_nruns(pms) == 0))
+	{
+		if ((runs_count(pms) > 0) && ((runs_count(pms) + 1) * MEDIAN_RUN_MIN_AVG <= pms->dim))
+		{
+			for (i = 0; i < n; ++i)
+			{
+				values[i] = MT_TO_DATUM(MT_RUNS_AT(pms, ranks[i]), pms);
+			}
+			return;
+		}
+		runs_clear(pms);
+		if (!pms->presorted)
+		{
+			MT_MULTI_SELECT(pms->buf.MT_FIELD, 0, pms->dim, ranks, n, pms);
+		}
+		for (i = 0; i < n; ++i)
+		{
+			values[i] = MT_TO_DATUM(pms->buf.MT_FIELD[ranks[i]], pms);
+		}
+		return;
+	}
+	if (pms->engine == meCounts)
+	{
+		MT_COUNTS_RANKS(pms, ranks, n, values);
+		return;
+	}
+	for (i = 0; i < n; ++i)
+	{
+		values[i] = MT_RANK_DATUM(pms, ranks[i]);
+	}
+}
+
+#ifndef MT_SCOPE
+#define MT_SCOPE static
+#endif
+
+MT_SCOPE const struct MedianOps MT_OPS = {
+	.add = {
+		[meSorted] = MT_ADD_SORTED,
+		[meAppend] = MT_ADD_APPEND,
+		[meSketch] = MT_ADD_SKETCH,
+		[meCounts] = MT_ADD_COUNTS,
+		[meHeap] = MT_ADD_HEAP,
+		[meTree] = MT_ADD_TREE,
+		[meFlat] = MT_ADD_FLAT
+	},
+	.remove = {
+		[meCounts] = MT_REMOVE_COUNTS,
+		[meTree] = MT_REMOVE_TREE,
+		[meFlat] = MT_REMOVE_FLAT
+	},
+	.add_batch = {
+		[meAppend] = MT_ADD_BATCH_APPEND,
+		[meSketch] = MT_ADD_BATCH_SKETCH,
+		[meCounts] = MT_ADD_BATCH_COUNTS
+	},
+	.rank = MT_RANK_DATUM,
+	.ranks = MT_RANKS_DATUM,
+	.combine = MT_COMBINE,
+	.serialize = MT_SERIALIZE,
+	.deserialize = MT_DESERIALIZE,
+	.unpack = MT_UNPACK,
+	.elemsize = sizeof(MT_ELEM)
+};
+
+#undef MT_MAKE_PREFIX
+#undef MT_MAKE_NAME
+#undef MT_MAKE_NAME_
+#undef MT_UPPER_BOUND
+#undef MT_LOWER_BOUND
+#undef MT_FIND_PAGE
+#undef MT_INSERT
+#undef MT_AT
+#undef MT_APPEND
+#undef MT_KEEP_PRESORTED
+#undef MT_SWAP
+#undef MT_INSERTION_SORT
+#undef MT_MEDIAN3
+#undef MT_MOM_PIVOT
+#undef MT_SELECT_DEPTH
+#undef MT_SELECT
+#undef MT_APPEND_ALL
+#undef MT_FLATTEN
+#undef MT_ADD_RUNS
+#undef MT_SORT_RUNS
+#undef MT_RUNS_AT
+#undef MT_COMBINE
+#undef MT_HEAP_ABOVE
+#undef MT_HEAP_UP
+#undef MT_HEAP_DOWN
+#undef MT_HEAP_KEEPS
+#undef MT_HEAP_PUT
+#undef MT_HEAP_ORDER
+#undef MT_HEAP_COMBINE
+#undef MT_SERIALIZE
+#undef MT_DESERIALIZE
+#undef MT_UNPACK
+#undef MT_PACKED
+#undef MT_PACK_ARRAY
+#undef MT_UNPACK_ARRAY
+#undef MT_TREE_NEW
+#undef MT_TREE_SPLIT
+#undef MT_TREE_MERGE
+#undef MT_TREE_PUT
+#undef MT_TREE_DEL
+#undef MT_TREE_INSERT
+#undef MT_TREE_REMOVE
+#undef MT_TREE_AT
+#undef MT_N
+#undef MT_RANK
+#undef MT_FLAT_INSERT
+#undef MT_FLAT_REMOVE
+#undef MT_FLAT_TO_TREE
+#undef MT_ADD_APPEND
+#undef MT_COUNTS_RESERVE
+#undef MT_COUNTS_PUT
+#undef MT_COUNTS_TOO_MANY
+#undef MT_COUNTS_AT
+#undef MT_COUNTS_RANKS
+#undef MT_TRY_COUNTS
+#undef MT_ADAPT
+#undef MT_COUNTS_EXPAND
+#undef MT_COUNTS_MERGE
+#undef MT_APPEND_COUNTS
+#undef MT_ADD_COUNTS
+#undef MT_ADD_BATCH_COUNTS
+#undef MT_REMOVE_COUNTS
+#undef MT_ADD_BATCH_APPEND
+#undef MT_ADD_BATCH_SKETCH
+#undef MT_ADD_SORTED
+#undef MT_ADD_TREE
+#undef MT_ADD_FLAT
+#undef MT_ADD_HEAP
+#undef MT_REMOVE_TREE
+#undef MT_REMOVE_FLAT
+#undef MT_RANK_DATUM
+#undef MT_RANKS_DATUM
+#undef MT_MULTI_SELECT
+#undef MT_OPS
+#undef MT_SORT
+#undef MT_SPILL
+#undef MT_LOSER_WINS
+#undef MT_SPILL_RANK
+#undef MT_APPEND_RUNS
+#undef MT_HEAD
+#undef MT_RUNS_MID
+#undef MT_SKETCH_MERGE_LEVEL
+#undef MT_SKETCH_COMPACT
+#undef MT_SKETCH_INSERT
+#undef MT_SKETCH_AT
+#undef MT_SKETCH_COMBINE
+#undef MT_ADD_SKETCH
+#undef MT_DATA
+#undef MT_LAST
+#undef MT_PREFIX
+#undef MT_SCOPE
+#undef MT_ELEM
+#undef MT_FIELD
+#undef MT_CMP
+#undef MT_COPY
+#undef MT_FREE
+#undef MT_SEND_ARRAY
+#undef MT_RECV_ARRAY
+#undef MT_WRITE_ARRAY
+#undef MT_READ_ARRAY
+#undef MT_FROM_DATUM
+#undef MT_PEEK_DATUM
+#undef MT_TO_DATUM
+#undef MT_VEC_UPPER_BOUND
+#undef MT_VEC_LOWER_BOUND
+#undef MT_VEC_PARTITION
+#undef MT_VEC_SMALL_SORT
+#undef MT_RADIX_RANK
+#undef MT_RADIX_SPILL_RANK
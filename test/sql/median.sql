@@ -52,3 +52,314 @@ SELECT TIMESTAMP 'epoch' + (i * INTERVAL '1 second')
 FROM generate_series(0, 100000) as T(i);
 
 SELECT median(val) FROM timestampvals;
+
+-- Parallel aggregate
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+
+SELECT median(val) FROM timestampvals;
+SELECT median(val) FROM textvals;
+
+RESET max_parallel_workers_per_gather;
+RESET min_parallel_table_scan_size;
+RESET parallel_tuple_cost;
+RESET parallel_setup_cost;
+
+-- Moving and growing windows
+SELECT val,
+       median(val) OVER w3 AS moving,
+       median(val) OVER (ORDER BY val ROWS UNBOUNDED PRECEDING) AS growing
+FROM intvals
+WINDOW w3 AS (ORDER BY val ROWS BETWEEN 2 PRECEDING AND CURRENT ROW)
+ORDER BY val;
+SELECT val, median(val) OVER (ORDER BY val ROWS 1 PRECEDING)
+FROM textvals
+ORDER BY val;
+SELECT count(*) AS rows,
+       count(*) FILTER (WHERE asc_m <> x / 2 + 1) AS wrong_asc,
+       count(*) FILTER (WHERE desc_m <> x + (20001 - x) / 2) AS wrong_desc
+FROM (SELECT x,
+             median(x) OVER (ORDER BY x ROWS UNBOUNDED PRECEDING) AS asc_m,
+             median(x) OVER (ORDER BY x DESC ROWS UNBOUNDED PRECEDING) AS desc_m
+      FROM generate_series(1, 20000) AS T(x)) AS T;
+
+-- Moving window, in a tree from the start
+SET median.small_window_threshold = 0;
+SELECT val, median(val) OVER (ORDER BY val ROWS BETWEEN 2 PRECEDING AND CURRENT ROW)
+FROM intvals
+ORDER BY val;
+RESET median.small_window_threshold;
+
+-- Other types
+SELECT median(x::float8 / 4) AS float8,
+       median(x::float4) AS float4,
+       median(x * 1.5) AS numeric,
+       median(DATE '2020-01-01' + x) AS date
+FROM generate_series(1, 5) AS T(x);
+SELECT median(v) FROM (VALUES (1.0::float8), ('NaN'), ('NaN')) AS T(v);
+SELECT x, median(x * 0.5) OVER (ORDER BY x ROWS 1 PRECEDING)
+FROM generate_series(1, 4) AS T(x);
+
+-- Text compared by sort keys
+SET median.text_sort_keys = on;
+SELECT median(val) FROM textvals;
+SELECT val, median(val) OVER (ORDER BY val ROWS 1 PRECEDING)
+FROM textvals
+ORDER BY val;
+RESET median.text_sort_keys;
+
+-- Sort keys are made (where PostgreSQL trusts them: ICU, from 16), and
+-- give the median the collation does
+SET median.track_stats = on;
+DO $$
+DECLARE
+  keyed text;
+  compared text;
+BEGIN
+  IF current_setting('server_version_num')::int < 160000 OR
+     NOT EXISTS (SELECT FROM pg_collation WHERE collname = 'und-x-icu') THEN
+    RETURN;
+  END IF;
+  PERFORM median_stats_reset();
+  PERFORM set_config('median.text_sort_keys', 'on', true);
+  SELECT median(md5(x::text) COLLATE "und-x-icu") INTO keyed
+  FROM generate_series(1, 1000) AS T(x);
+  IF (SELECT sort_keys FROM median_stats()) < 1000 THEN
+    RAISE EXCEPTION 'text sort keys were not made';
+  END IF;
+  PERFORM set_config('median.text_sort_keys', 'off', true);
+  SELECT median(md5(x::text) COLLATE "und-x-icu") INTO compared
+  FROM generate_series(1, 1000) AS T(x);
+  IF keyed <> compared THEN
+    RAISE EXCEPTION 'median % by sort keys, % by the collation', keyed, compared;
+  END IF;
+END $$;
+RESET median.track_stats;
+
+-- Spilling to disk
+SET median.spill = on;
+SET work_mem = '64kB';
+SELECT median(val) FROM timestampvals;
+SELECT median(lpad(x::text, 6, '0')) FROM generate_series(1, 99999) AS T(x);
+SELECT median(x * 1.5) FROM generate_series(1, 99999) AS T(x);
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+EXPLAIN (COSTS OFF) SELECT median(val) FROM timestampvals;
+RESET max_parallel_workers_per_gather;
+RESET min_parallel_table_scan_size;
+RESET parallel_tuple_cost;
+RESET parallel_setup_cost;
+RESET work_mem;
+RESET median.spill;
+
+-- Radix select
+SET median.select = radix;
+SELECT median(val) FROM intvals;
+SELECT median(val) FROM timestampvals;
+SELECT median(x::float8 / 4) FROM generate_series(1, 5) AS T(x);
+SET median.spill = on;
+SET work_mem = '64kB';
+SELECT median(val) FROM timestampvals;
+SELECT median(x % 1000) FROM generate_series(1, 99999) AS T(x);
+RESET work_mem;
+RESET median.spill;
+RESET median.select;
+
+-- Approximate median
+SELECT approx_median(val) FROM intvals;
+SELECT approx_median(val) FROM textvals;
+SELECT abs(extract(epoch FROM approx_median(val)) - 50000) <= 1000 AS within
+FROM timestampvals;
+SELECT abs(approx_median(x, 0.05) - 50000) <= 5000 AS within
+FROM generate_series(1, 100000) AS T(x);
+SELECT approx_median(x, 0) FROM generate_series(1, 10) AS T(x);
+
+-- Persisted sketches
+CREATE TABLE sketchvals AS
+SELECT x % 3 AS part, median_sketch(x) AS sketch
+FROM generate_series(1, 9) AS T(x)
+GROUP BY x % 3;
+
+SELECT part, median_value(sketch, NULL::int) FROM sketchvals ORDER BY part;
+SELECT median_value(median_merge(sketch), NULL::int) FROM sketchvals;
+SELECT median_value(median_merge(sketch::text::median_sketch), NULL::int)
+FROM sketchvals;
+SELECT median_value(median_sketch(val), NULL::text) FROM textvals;
+SELECT abs(median_value(median_sketch(x, 0.05), NULL::int) - 50000) <= 5000 AS within
+FROM generate_series(1, 100000) AS T(x);
+SELECT median_value(sketch, NULL::text) FROM sketchvals WHERE part = 0;
+SELECT 'garbage'::median_sketch;
+SELECT median_value(median_sketch(x * 1.5)::text::median_sketch, NULL::numeric)
+FROM generate_series(1, 9) AS T(x);
+SELECT left(median_sketch(x * 1.5)::text, -8)::median_sketch
+FROM generate_series(1, 9) AS T(x);
+
+-- Quantiles
+SELECT quantiles(val, ARRAY[0, 0.25, 0.5, 0.75, 1]) FROM intvals;
+SELECT quantiles(val, ARRAY[0.2, NULL, 0.9]) FROM textvals;
+SELECT quantiles(val, ARRAY[0.5, 0.99, 0.25]) =
+       percentile_disc(ARRAY[0.5, 0.99, 0.25]) WITHIN GROUP (ORDER BY val) AS same
+FROM timestampvals;
+SELECT quantiles(val, ARRAY[1.5]) FROM intvals;
+
+-- Few distinct values
+SELECT median(x % 5) FROM generate_series(1, 1000) AS T(x);
+SELECT median((x % 5)::text) FROM generate_series(1, 1000) AS T(x);
+SELECT median(CASE WHEN x <= 1000 THEN x % 5 ELSE x END)
+FROM generate_series(1, 3000) AS T(x);
+SELECT quantiles(x % 5, ARRAY[0.1, 0.5, 0.9]) FROM generate_series(1, 1000) AS T(x);
+SELECT bool_and(m = 1) AS all_one FROM (
+  SELECT x, median(x % 3) OVER (ORDER BY x ROWS BETWEEN 999 PRECEDING AND CURRENT ROW) AS m
+  FROM generate_series(1, 3000) AS T(x)
+) AS W WHERE x >= 3;
+SELECT x, m FROM (
+  SELECT x, median(CASE WHEN x <= 2000 THEN x % 3 ELSE x END)
+         OVER (ORDER BY x ROWS BETWEEN 999 PRECEDING AND CURRENT ROW) AS m
+  FROM generate_series(1, 3000) AS T(x)
+) AS W WHERE x IN (1000, 3000) ORDER BY x;
+SELECT DISTINCT t, m FROM (
+  SELECT t, median(v) OVER (ORDER BY t RANGE BETWEEN 599 PRECEDING AND CURRENT ROW) AS m
+  FROM (SELECT CASE WHEN i <= 1000 THEN i ELSE 1089 + (i - 999) / 2 END,
+               CASE WHEN i <= 1000 THEN i % 3 ELSE i END
+        FROM generate_series(1, 3000) AS I(i)) AS T(t, v)
+) AS W WHERE t IN (1000, 1090, 1500, 2089) ORDER BY t;
+
+-- Stats
+SET median.track_stats = on;
+SELECT median_stats_reset();
+SELECT median(x) FROM generate_series(1, 1000) AS T(x);
+SELECT median(x % 5) FROM generate_series(1, 1000) AS T(x);
+SELECT count(m) FROM (
+  SELECT median(x) OVER (ORDER BY x ROWS BETWEEN 9 PRECEDING AND CURRENT ROW) AS m
+  FROM generate_series(1, 100) AS T(x)
+) AS W;
+SELECT results, added, comparisons > 0 AS compared, peak_bytes > 0 AS measured,
+       engine_switches, spilled_runs, select_ms >= 0 AS timed
+FROM median_stats();
+SET median.track_stats = off;
+SELECT median_stats_reset();
+SELECT median(x) FROM generate_series(1, 1000) AS T(x);
+SELECT results, added FROM median_stats();
+
+-- Engines
+SELECT median(CASE WHEN x = 2999 THEN 0 ELSE x END) FROM generate_series(1, 3000) AS T(x);
+SELECT median(lpad((CASE WHEN x = 700 THEN 0 ELSE x END)::text, 4, '0'))
+FROM generate_series(1, 1000) AS T(x);
+SELECT quantiles(x, ARRAY[0.25, 0.5, 1]) FROM generate_series(1, 1000) AS T(x);
+SET median.track_stats = on;
+SELECT median_stats_reset();
+SET median.engine = append;
+SELECT median(x % 5) FROM generate_series(1, 1000) AS T(x);
+SET median.engine = counts;
+SELECT median(x) FROM generate_series(1, 1000) AS T(x);
+SET median.engine = sorted;
+SELECT quantiles(x % 5, ARRAY[0.1, 0.5, 0.9]) FROM generate_series(1, 1000) AS T(x);
+SELECT results, engine_switches FROM median_stats();
+SET median.engine = flat;
+SELECT bool_and(m = x - 499) AS all_middle FROM (
+  SELECT x, median(x) OVER (ORDER BY x ROWS BETWEEN 999 PRECEDING AND CURRENT ROW) AS m
+  FROM generate_series(1, 3000) AS T(x)
+) AS W WHERE x >= 1000;
+SET median.engine = counts;
+SELECT bool_and(m = x - 499) AS all_middle FROM (
+  SELECT x, median(x) OVER (ORDER BY x ROWS BETWEEN 999 PRECEDING AND CURRENT ROW) AS m
+  FROM generate_series(1, 3000) AS T(x)
+) AS W WHERE x >= 1000;
+SET median.engine = tree;
+SELECT bool_and(m = x - 499) AS all_middle FROM (
+  SELECT x, median(x) OVER (ORDER BY x ROWS BETWEEN 999 PRECEDING AND CURRENT ROW) AS m
+  FROM generate_series(1, 3000) AS T(x)
+) AS W WHERE x >= 1000;
+SELECT engine_switches FROM median_stats();
+RESET median.engine;
+SELECT median(x % 5) FROM generate_series(1, 1000) AS T(x);
+SELECT engine_switches FROM median_stats();
+RESET median.track_stats;
+
+-- Ordered-set median
+SELECT median_os() WITHIN GROUP (ORDER BY x) FROM generate_series(1, 1000) AS T(x);
+SELECT median_os() WITHIN GROUP (ORDER BY x DESC) FROM generate_series(1, 1000) AS T(x);
+SELECT median_os() WITHIN GROUP (ORDER BY x) FROM (VALUES (NULL::int), (3), (NULL), (1)) AS T(x);
+SELECT median_os() WITHIN GROUP (ORDER BY x) FROM generate_series(1, 0) AS T(x);
+SELECT x % 3 AS g, median_os() WITHIN GROUP (ORDER BY x::text) = median(x::text) AS same
+FROM generate_series(1, 100) AS T(x) GROUP BY 1 ORDER BY 1;
+SET work_mem = '64kB';
+SELECT median_os() WITHIN GROUP (ORDER BY x) FROM generate_series(1, 100000) AS T(x);
+SELECT median_os() WITHIN GROUP (ORDER BY lpad(x::text, 6, '0')) FROM generate_series(1, 100000) AS T(x);
+RESET work_mem;
+
+-- Medians of several columns
+SELECT medians(x, x % 10, CASE WHEN x % 2 = 0 THEN x END) FROM generate_series(1, 1001) AS T(x);
+SELECT medians(x, NULL) FROM generate_series(1, 3) AS T(x);
+SELECT medians(x::text, lpad(x::text, 4, '0')) FROM generate_series(1, 1000) AS T(x);
+SELECT x % 3 AS g, medians(x, -x, x % 7) = ARRAY[median(x), median(-x), median(x % 7)] AS same
+FROM generate_series(1, 3000) AS T(x) GROUP BY 1 ORDER BY 1;
+SELECT medians(VARIADIC a) FROM (VALUES (ARRAY[1, 2]), (ARRAY[1])) AS T(a);
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+SELECT medians(val, val + INTERVAL '1 hour') = ARRAY[median(val), median(val) + INTERVAL '1 hour'] AS same
+FROM timestampvals;
+RESET max_parallel_workers_per_gather;
+RESET min_parallel_table_scan_size;
+RESET parallel_tuple_cost;
+RESET parallel_setup_cost;
+
+-- Order statistics
+SELECT kth_smallest(x, 10) FROM generate_series(1, 1000) AS T(x);
+SELECT kth_largest(x, 10) FROM generate_series(1, 1000) AS T(x);
+SELECT top_k(x, 3) FROM generate_series(1, 1000) AS T(x);
+SELECT top_k(x, 5) FROM (VALUES (2), (NULL), (3), (1)) AS T(x);
+SELECT kth_smallest(x, 5) FROM generate_series(1, 4) AS T(x);
+SELECT kth_smallest(x::text, 3), kth_largest(x::text, 3) FROM generate_series(1, 1000) AS T(x);
+SELECT kth_smallest(x, 0) FROM generate_series(1, 10) AS T(x);
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+SELECT kth_largest(val, 5) = (SELECT val FROM timestampvals ORDER BY val DESC LIMIT 1 OFFSET 4) AS same,
+       top_k(val, 3) = ARRAY(SELECT val FROM timestampvals ORDER BY val DESC LIMIT 3) AS same_top
+FROM timestampvals;
+RESET max_parallel_workers_per_gather;
+RESET min_parallel_table_scan_size;
+RESET parallel_tuple_cost;
+RESET parallel_setup_cost;
+
+-- Cached medians
+CREATE TABLE cached (bucket int, x int);
+INSERT INTO cached SELECT x % 3, x FROM generate_series(1, 999) AS T(x);
+SELECT median_cached('cached', 'x', 'bucket = 1', NULL::int);
+CREATE TRIGGER cached_median AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON cached
+FOR EACH STATEMENT EXECUTE FUNCTION median_cache_invalidate();
+SELECT median_cached('cached', 'x', 'bucket = 1', NULL::int);
+SELECT median_cached('cached', 'x', 'bucket = 1', NULL::int);
+INSERT INTO cached VALUES (1, 10000), (1, 10001);
+SELECT median_cached('cached', 'x', 'bucket = 1', NULL::int);
+SELECT median_cached('cached', 'x', NULL, NULL::int);
+SELECT median_cached('cached', 'x', 'bucket = 5', NULL::int);
+SELECT median_cached('cached', 'x', 'bucket = 1 AND random() < 2', NULL::int);
+SELECT median_cached('cached', 'x', 'true) ORDER BY (1', NULL::int);
+DROP TABLE cached;
+
+-- Partition-wise aggregate
+CREATE TABLE parted (t int, y int) PARTITION BY RANGE (t);
+CREATE TABLE parted_0 PARTITION OF parted FOR VALUES FROM (0) TO (3000);
+CREATE TABLE parted_1 PARTITION OF parted FOR VALUES FROM (3000) TO (6000);
+CREATE TABLE parted_2 PARTITION OF parted FOR VALUES FROM (6000) TO (9000);
+INSERT INTO parted SELECT t, (t % 3000) * 3 + t / 3000 FROM generate_series(0, 8999) AS T(t);
+SET enable_partitionwise_aggregate = on;
+SELECT t % 2 AS g, median(t),
+       quantiles(y, ARRAY[0.1, 0.5, 0.9]) = percentile_disc(ARRAY[0.1, 0.5, 0.9]) WITHIN GROUP (ORDER BY y) AS same
+FROM parted GROUP BY 1 ORDER BY 1;
+SET median.engine = sorted;
+SELECT t % 2 AS g, median(t),
+       quantiles(y, ARRAY[0.1, 0.5, 0.9]) = percentile_disc(ARRAY[0.1, 0.5, 0.9]) WITHIN GROUP (ORDER BY y) AS same
+FROM parted GROUP BY 1 ORDER BY 1;
+RESET median.engine;
+RESET enable_partitionwise_aggregate;
+DROP TABLE parted;
@@ -0,0 +1,72 @@
+-- The cache of median_cached(), only run by a server which preloads the
+-- module (see test/median_cache.conf and `make installcheck-cache`)
+SHOW median.cache_size;
+
+-- Hits, and misses once the relation changed
+CREATE TABLE cached (bucket int, x int);
+INSERT INTO cached SELECT x % 3, x FROM generate_series(1, 999) AS T(x);
+CREATE TRIGGER cached_median AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON cached
+FOR EACH STATEMENT EXECUTE FUNCTION median_cache_invalidate();
+SELECT median_stats_reset();
+SELECT median_cached('cached', 'x', 'bucket = 1', NULL::int);
+SELECT median_cached('cached', 'x', 'bucket = 1', NULL::int);
+SELECT cache_hits, cache_misses FROM median_stats();
+INSERT INTO cached VALUES (1, 10000), (1, 10001);
+SELECT median_cached('cached', 'x', 'bucket = 1', NULL::int);
+SELECT median_cached('cached', 'x', 'bucket = 1', NULL::int);
+SELECT cache_hits, cache_misses FROM median_stats();
+
+-- Not cached: a volatile predicate, and a key too long to keep
+SELECT median_stats_reset();
+SELECT median_cached('cached', 'x', 'bucket = 1 AND random() < 2', NULL::int);
+SELECT median_cached('cached', 'x', 'bucket = 1 AND random() < 2', NULL::int);
+SELECT median_cached('cached', 'x', 'bucket = 1' || repeat(' AND x > 0', 30), NULL::int);
+SELECT median_cached('cached', 'x', 'bucket = 1' || repeat(' AND x > 0', 30), NULL::int);
+SELECT cache_hits, cache_misses FROM median_stats();
+DROP TABLE cached;
+
+-- Cached by the time zone the predicate's literals were read in, and
+-- not at all through a stable cast of the median
+CREATE TABLE stamped (at timestamptz);
+INSERT INTO stamped
+SELECT '2020-01-01 00:00+00'::timestamptz + x * interval '1 hour' FROM generate_series(1, 47) AS T(x);
+CREATE TRIGGER stamped_median AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON stamped
+FOR EACH STATEMENT EXECUTE FUNCTION median_cache_invalidate();
+SELECT median_stats_reset();
+SET TimeZone = 'UTC';
+SELECT median_cached('stamped', 'at', 'at < ''2020-01-02''', NULL::timestamptz) = '2020-01-01 12:00+00' AS same;
+SET TimeZone = 'Etc/GMT-10';
+SELECT median_cached('stamped', 'at', 'at < ''2020-01-02''', NULL::timestamptz) = '2020-01-01 07:00+00' AS same;
+SET TimeZone = 'UTC';
+SELECT median_cached('stamped', 'at', 'at < ''2020-01-02''', NULL::timestamptz) = '2020-01-01 12:00+00' AS same;
+SELECT median_cached('stamped', 'at', NULL, NULL::text)::timestamptz = '2020-01-02 00:00+00' AS same;
+SELECT median_cached('stamped', 'at', NULL, NULL::text)::timestamptz = '2020-01-02 00:00+00' AS same;
+SELECT cache_hits, cache_misses FROM median_stats();
+RESET TimeZone;
+DROP TABLE stamped;
+
+-- Not cached: partitioned and inherited relations, whose children are
+-- changed without the parent's triggers
+CREATE TABLE parted (t int, x int) PARTITION BY RANGE (t);
+CREATE TABLE parted_0 PARTITION OF parted FOR VALUES FROM (0) TO (10);
+CREATE TABLE parted_1 PARTITION OF parted FOR VALUES FROM (10) TO (20);
+INSERT INTO parted SELECT t, t FROM generate_series(0, 18) AS T(t);
+CREATE TRIGGER parted_median AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON parted
+FOR EACH STATEMENT EXECUTE FUNCTION median_cache_invalidate();
+SELECT median_stats_reset();
+SELECT median_cached('parted', 'x', NULL, NULL::int);
+UPDATE parted_0 SET x = x + 100 WHERE t < 5;
+SELECT median_cached('parted', 'x', NULL, NULL::int);
+SELECT cache_hits, cache_misses FROM median_stats();
+DROP TABLE parted;
+CREATE TABLE inherited (x int);
+CREATE TABLE inherited_child () INHERITS (inherited);
+INSERT INTO inherited SELECT x FROM generate_series(1, 9) AS T(x);
+CREATE TRIGGER inherited_median AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON inherited
+FOR EACH STATEMENT EXECUTE FUNCTION median_cache_invalidate();
+SELECT median_stats_reset();
+SELECT median_cached('inherited', 'x', NULL, NULL::int);
+INSERT INTO inherited_child VALUES (100), (101);
+SELECT median_cached('inherited', 'x', NULL, NULL::int);
+SELECT cache_hits, cache_misses FROM median_stats();
+DROP TABLE inherited, inherited_child;